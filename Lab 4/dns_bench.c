@@ -0,0 +1,656 @@
+#define _GNU_SOURCE
+
+#include "dns_db.h"
+
+#include <limits.h>
+#include <math.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+
+/*
+ * Load generator for dns_server. The query log is either replayed from a
+ * file (-r) or generated: hits are drawn from the database's names with a
+ * Zipf skew, misses are made-up names under .invalid, and updates (-u)
+ * register and deregister addresses of a pool of service names. Connections
+ * are spread over worker threads, each driving its share through one epoll
+ * set with up to -w requests pipelined per connection. Results go to
+ * stdout as one JSON object, lookups and updates timed apart; a generated
+ * log can be saved (-o) and replayed later for a like-for-like comparison.
+ */
+
+#define BENCH_CONNS 16
+#define BENCH_WINDOW 16
+#define BENCH_QUERIES 1000000
+#define BENCH_LEN_MEAN 20
+#define BENCH_LEN_SD 6
+#define BENCH_MISS_TLD ".invalid" /* RFC 2606: never in a real zone */
+#define BENCH_ARENA (1u << 20) /* block size for generated miss names */
+#define BENCH_SERVICES 10000 /* names the updates work on */
+#define BENCH_SERVICE_ADDRS 4 /* addresses each may be given */
+
+typedef struct {
+	int fd;
+	dns_buf_t out;
+	dns_buf_t in; /* stream bytes, or the last seqpacket record */
+	uint64_t *sent_at; /* FIFO of send times, window long */
+	size_t head, inflight;
+	uint32_t events;
+} bconn_t;
+
+typedef struct {
+	pthread_t thread;
+	int epoll_fd;
+	bconn_t *conns;
+	size_t nconns;
+	size_t active; /* connections with requests still to send or answer */
+	uint64_t *lat; /* lookups */
+	size_t lat_n, lat_cap;
+	uint64_t *ulat; /* updates */
+	size_t ulat_n, ulat_cap;
+	uint64_t hits, misses, errors;
+} worker_t;
+
+static const char **g_queries;
+static size_t g_nqueries;
+static _Atomic size_t g_next;
+static size_t g_window = BENCH_WINDOW;
+static int g_seqpacket = 0;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-S] [-c conns] [-t threads] [-w window] [-n queries]\n"
+		"       [-D database.txt [-z skew] [-m miss_ratio] [-u update_ratio] [-l mean[:sd]]\n"
+		"       [-o log.txt]]"
+		" [-r log.txt] [-s seed] [socket_path]\n", argv0);
+	fprintf(stderr, "       %s -G count [-l mean[:sd]] [-s seed] > database.txt\n", argv0);
+	fprintf(stderr, "Default socket: %s\n", DNS_SOCK_PATH);
+	fprintf(stderr, "-D: draw hits from this database's names, Zipf distributed with exponent "
+		"-z\n    (default 1.0, 0 = uniform); -m of the queries (default 0) are misses\n");
+	fprintf(stderr, "-u: this share of the queries (default 0) are ADD or DEL of one of %d "
+		"addresses\n    on one of %d service names\n", BENCH_SERVICE_ADDRS, BENCH_SERVICES);
+	fprintf(stderr, "-l: length of generated names, normal with this mean and sd "
+		"(default %d:%d)\n", BENCH_LEN_MEAN, BENCH_LEN_SD);
+	fprintf(stderr, "-o: also write the generated queries, one per line, for -r\n");
+	fprintf(stderr, "-r: replay queries from a file in order, repeating it to fill -n\n");
+	fprintf(stderr, "-n: queries to send (default %d, or the -r file's length)\n",
+		BENCH_QUERIES);
+	fprintf(stderr, "-c: connections (default %d), over -t threads (default 1), each with "
+		"-w requests\n    in flight (default %d)\n", BENCH_CONNS, BENCH_WINDOW);
+	fprintf(stderr, "-S: use SOCK_SEQPACKET, for a server started with -S\n");
+	fprintf(stderr, "-G: write a synthetic database of count names to stdout and exit\n");
+}
+
+/* splitmix64 */
+static uint64_t bench_rand(uint64_t *state)
+{
+	*state += 0x9E3779B97F4A7C15ull;
+	return dns_mix64(*state);
+}
+
+/* Uniform in [0, 1). */
+static double bench_unit(uint64_t *state)
+{
+	return (double)(bench_rand(state) >> 11) / 9007199254740992.0;
+}
+
+/* Normal(mean, sd) from the Irwin-Hall sum of 12 uniforms, clamped to a name. */
+static size_t bench_length(uint64_t *state, double mean, double sd)
+{
+	double z = -6.0;
+	for (int i = 0; i < 12; i++)
+		z += bench_unit(state);
+	long len = lround(mean + sd * z);
+	if (len < 8)
+		len = 8;
+	if (len > MAX_DOMAIN - 1)
+		len = MAX_DOMAIN - 1;
+	return (size_t)len;
+}
+
+/* A random name of len characters (at least one before tld) made of labels of 1-12. */
+static void bench_name(uint64_t *state, size_t len, const char *tld, char *out)
+{
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+	size_t tl = strlen(tld);
+	size_t body = len > tl ? len - tl : 1;
+	size_t dot = 1 + bench_rand(state) % 12;
+	for (size_t i = 0; i < body; i++) {
+		if (i == dot && i + 1 < body) {
+			out[i] = '.';
+			dot = i + 2 + bench_rand(state) % 12;
+		} else {
+			out[i] = alphabet[bench_rand(state) % (sizeof(alphabet) - 1)];
+		}
+	}
+	memcpy(out + body, tld, tl + 1);
+}
+
+/*
+ * Zipf over ranks 1..n: P(k) ~ 1 / k^s. The CDF is tabulated once and
+ * sampled by binary search.
+ */
+static double *zipf_cdf(size_t n, double s)
+{
+	double *cdf = (double *)malloc(n * sizeof(double));
+	if (!cdf)
+		dns_die("malloc zipf");
+	double sum = 0;
+	for (size_t k = 0; k < n; k++) {
+		sum += s == 0 ? 1.0 : pow((double)(k + 1), -s);
+		cdf[k] = sum;
+	}
+	for (size_t k = 0; k < n; k++)
+		cdf[k] /= sum;
+	return cdf;
+}
+
+static size_t zipf_draw(const double *cdf, size_t n, uint64_t *state)
+{
+	double u = bench_unit(state);
+	size_t lo = 0, hi = n - 1;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void gen_database(size_t count, double mean, double sd, uint64_t seed)
+{
+	char name[MAX_DOMAIN];
+	for (size_t i = 0; i < count; i++) {
+		bench_name(&seed, bench_length(&seed, mean, sd), ".com", name);
+		uint32_t a = (uint32_t)bench_rand(&seed);
+		printf("%s %u.%u.%u.%u\n", name, a >> 24, (a >> 16) & 255, (a >> 8) & 255, a & 255);
+	}
+}
+
+/* "ADD svcN.bench.invalid 10.N.N.k" or the matching DEL, as one request. */
+static void bench_update(uint64_t *state, char *out, size_t outsz)
+{
+	uint32_t svc = (uint32_t)(bench_rand(state) % BENCH_SERVICES);
+	uint32_t addr = (uint32_t)(bench_rand(state) % BENCH_SERVICE_ADDRS);
+	snprintf(out, outsz, "%s svc%u.bench%s 10.%u.%u.%u", bench_rand(state) & 1 ? "ADD" : "DEL",
+		svc, BENCH_MISS_TLD, svc >> 8, svc & 255, addr + 1);
+}
+
+/*
+ * Builds g_queries: an update with probability update, a miss with
+ * probability miss, otherwise a database name by Zipf rank. Ranks map to
+ * names through a shuffle, so the popular names are spread over the file
+ * rather than being its first lines.
+ */
+static void gen_queries(const dns_entries_t *e, size_t n, double skew, double miss,
+	double update, double mean, double sd, uint64_t seed)
+{
+	uint32_t names = e->names;
+	uint32_t *by_rank = (uint32_t *)malloc(((size_t)names + 1) * sizeof(uint32_t));
+	g_queries = (const char **)malloc((n + 1) * sizeof(char *));
+	char *arena = NULL;
+	size_t arena_used = BENCH_ARENA;
+	if (!by_rank || !g_queries)
+		dns_die("malloc queries");
+	for (uint32_t i = 0; i < names; i++)
+		by_rank[i] = i;
+	for (uint32_t i = names; i > 1; i--) {
+		uint32_t j = (uint32_t)(bench_rand(&seed) % i);
+		uint32_t tmp = by_rank[i - 1];
+		by_rank[i - 1] = by_rank[j];
+		by_rank[j] = tmp;
+	}
+	double *cdf = names ? zipf_cdf(names, skew) : NULL;
+
+	for (size_t i = 0; i < n; i++) {
+		int is_update = update > 0 && bench_unit(&seed) < update;
+		if (!is_update && names > 0 && bench_unit(&seed) >= miss) {
+			g_queries[i] = e->arena + e->name_off[by_rank[zipf_draw(cdf, names, &seed)]];
+			continue;
+		}
+		if (arena_used + MAX_DOMAIN > BENCH_ARENA) {
+			/* Misses live for the whole run: start another block. */
+			arena = (char *)malloc(BENCH_ARENA);
+			if (!arena)
+				dns_die("malloc queries");
+			arena_used = 0;
+		}
+		char *name = arena + arena_used;
+		if (is_update)
+			bench_update(&seed, name, MAX_DOMAIN);
+		else
+			bench_name(&seed, bench_length(&seed, mean, sd), BENCH_MISS_TLD, name);
+		arena_used += strlen(name) + 1;
+		g_queries[i] = name;
+	}
+	g_nqueries = n;
+	free(cdf);
+	free(by_rank);
+}
+
+/* Reads a replay log; each non-empty line is sent as one request. */
+static size_t load_log(const char *path, char **storage)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		dns_die(path);
+	size_t cap = 0, used = 0, count = 0;
+	char *buf = NULL, line[MAX_DOMAIN + 2];
+	while (fgets(line, sizeof(line), f)) {
+		trim_newline_dns(line);
+		size_t n = strlen(line);
+		if (n == 0 || n >= MAX_DOMAIN)
+			continue;
+		buf = (char *)dns_grow(buf, &cap, used + n + 1, 1);
+		memcpy(buf + used, line, n + 1);
+		used += n + 1;
+		count++;
+	}
+	fclose(f);
+	*storage = buf;
+	return count;
+}
+
+/* ---- load ---- */
+
+static void bconn_set_events(worker_t *w, bconn_t *c, uint32_t events)
+{
+	if (events == c->events)
+		return;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = c;
+	if (epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+		dns_die("epoll_ctl");
+	c->events = events;
+}
+
+/* Queues requests while the window has room; 0 once the log is used up. */
+static int bconn_fill(bconn_t *c)
+{
+	while (c->inflight < g_window) {
+		size_t i = atomic_fetch_add_explicit(&g_next, 1, memory_order_relaxed);
+		if (i >= g_nqueries)
+			return 0;
+		const char *q = g_queries[i];
+		dns_buf_put(&c->out, q, strlen(q));
+		c->sent_at[(c->head + c->inflight) % g_window] = now_ns();
+		c->inflight++;
+	}
+	return 1;
+}
+
+/* Sends what the socket takes, all queued frames per send() or sendmmsg(). */
+static void bconn_flush(bconn_t *c)
+{
+	while (dns_buf_pending(&c->out) > 0) {
+		if (dns_buf_send(&c->out, c->fd, g_seqpacket, c->out.len) >= 0)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+		dns_die("send");
+	}
+}
+
+static void bconn_answer(worker_t *w, bconn_t *c, const char *msg, size_t len)
+{
+	if (c->inflight == 0) {
+		fprintf(stderr, "unexpected reply\n");
+		exit(EXIT_FAILURE);
+	}
+	uint64_t ns = now_ns() - c->sent_at[c->head];
+	if ((len >= 6 && memcmp(msg, "ADDED ", 6) == 0) ||
+		(len >= 8 && memcmp(msg, "DELETED ", 8) == 0) ||
+		(len >= 7 && memcmp(msg, "ABSENT ", 7) == 0)) {
+		w->ulat = (uint64_t *)dns_grow(w->ulat, &w->ulat_cap, w->ulat_n + 1, sizeof(uint64_t));
+		w->ulat[w->ulat_n++] = ns;
+	} else {
+		if (len >= 3 && memcmp(msg, "OK ", 3) == 0)
+			w->hits++;
+		else if (len >= 9 && memcmp(msg, "NOTFOUND ", 9) == 0)
+			w->misses++;
+		else
+			w->errors++;
+		w->lat = (uint64_t *)dns_grow(w->lat, &w->lat_cap, w->lat_n + 1, sizeof(uint64_t));
+		w->lat[w->lat_n++] = ns;
+	}
+	c->head = (c->head + 1) % g_window;
+	c->inflight--;
+}
+
+/* Reads and matches replies; -1 when the server has gone. */
+static int bconn_read(worker_t *w, bconn_t *c)
+{
+	for (;;) {
+		ssize_t r;
+		if (g_seqpacket) {
+			do {
+				r = recv(c->fd, c->in.buf, c->in.cap, 0);
+			} while (r < 0 && errno == EINTR);
+			if (r > 0) {
+				bconn_answer(w, c, c->in.buf, (size_t)r);
+				continue;
+			}
+		} else {
+			r = dns_buf_fill(&c->in, c->fd);
+		}
+		if (r == 0)
+			return -1;
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			dns_die("recv");
+		}
+
+		char *msg;
+		size_t len;
+		int f;
+		while ((f = dns_buf_frame(&c->in, MAX_REPLY, &msg, &len)) != 0) {
+			if (f < 0) {
+				fprintf(stderr, "reply too long\n");
+				exit(EXIT_FAILURE);
+			}
+			bconn_answer(w, c, msg, len);
+		}
+	}
+}
+
+/* Refills and flushes c, and retires it once everything it sent is answered. */
+static void bconn_pump(worker_t *w, bconn_t *c)
+{
+	int more = bconn_fill(c);
+	bconn_flush(c);
+	if (!more && c->inflight == 0 && dns_buf_pending(&c->out) == 0) {
+		close(c->fd);
+		c->fd = -1;
+		w->active--;
+		return;
+	}
+	bconn_set_events(w, c, EPOLLIN | (dns_buf_pending(&c->out) > 0 ? EPOLLOUT : 0));
+}
+
+static void *worker_main(void *arg)
+{
+	worker_t *w = (worker_t *)arg;
+	for (size_t i = 0; i < w->nconns; i++)
+		bconn_pump(w, &w->conns[i]);
+
+	struct epoll_event events[64];
+	while (w->active > 0) {
+		int n = epoll_wait(w->epoll_fd, events, 64, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			dns_die("epoll_wait");
+		}
+		for (int i = 0; i < n; i++) {
+			bconn_t *c = (bconn_t *)events[i].data.ptr;
+			if (c->fd < 0)
+				continue;
+			if (bconn_read(w, c) != 0) {
+				fprintf(stderr, "server closed the connection\n");
+				exit(EXIT_FAILURE);
+			}
+			bconn_pump(w, c);
+		}
+	}
+	return NULL;
+}
+
+static int bench_connect(const char *path)
+{
+	int fd = socket(AF_UNIX, (g_seqpacket ? SOCK_SEQPACKET : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		dns_die("socket");
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		dns_die("connect");
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+		dns_die("fcntl");
+	return fd;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted v[n], in microseconds. */
+static double percentile_us(const uint64_t *v, size_t n, double p)
+{
+	if (n == 0)
+		return 0.0;
+	size_t i = (size_t)(p / 100.0 * (double)n);
+	if (i >= n)
+		i = n - 1;
+	return (double)v[i] / 1e3;
+}
+
+/* ", \"key\": {percentiles}" of sorted v[n]. */
+static void print_latency(const char *key, const uint64_t *v, size_t n)
+{
+	printf(", \"%s\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, "
+		"\"max\": %.3f}", key, percentile_us(v, n, 50), percentile_us(v, n, 90),
+		percentile_us(v, n, 99), percentile_us(v, n, 99.9), n ? (double)v[n - 1] / 1e3 : 0.0);
+}
+
+static long parse_opt_long(const char *s, long max, const char *what)
+{
+	char *end;
+	long v = strtol(s, &end, 10);
+	if (end == s || *end != '\0' || v < 0 || v > max) {
+		fprintf(stderr, "Invalid %s '%s'\n", what, s);
+		exit(EXIT_FAILURE);
+	}
+	return v;
+}
+
+static double parse_opt_double(const char *s, double max, const char *what)
+{
+	char *end;
+	double v = strtod(s, &end);
+	if (end == s || *end != '\0' || !(v >= 0) || v > max) {
+		fprintf(stderr, "Invalid %s '%s'\n", what, s);
+		exit(EXIT_FAILURE);
+	}
+	return v;
+}
+
+int main(int argc, char **argv)
+{
+	const char *prog = argv[0];
+	const char *db_path = NULL, *log_in = NULL, *log_out = NULL;
+	long conns = BENCH_CONNS, threads = 1, queries = -1, gen = -1;
+	double skew = 1.0, miss = 0.0, update = 0.0, len_mean = BENCH_LEN_MEAN, len_sd = BENCH_LEN_SD;
+	uint64_t seed = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "Sc:t:w:n:D:z:m:u:l:o:r:s:G:")) != -1) {
+		if (opt == 'S') {
+			g_seqpacket = 1;
+		} else if (opt == 'c') {
+			conns = parse_opt_long(optarg, 100000, "connection count");
+		} else if (opt == 't') {
+			threads = parse_opt_long(optarg, 1024, "thread count");
+		} else if (opt == 'w') {
+			g_window = (size_t)parse_opt_long(optarg, 1000000, "window");
+		} else if (opt == 'n') {
+			queries = parse_opt_long(optarg, 1000000000, "query count");
+		} else if (opt == 'D') {
+			db_path = optarg;
+		} else if (opt == 'z') {
+			skew = parse_opt_double(optarg, 10.0, "skew");
+		} else if (opt == 'm') {
+			miss = parse_opt_double(optarg, 1.0, "miss ratio");
+		} else if (opt == 'u') {
+			update = parse_opt_double(optarg, 1.0, "update ratio");
+		} else if (opt == 'l') {
+			char *colon = strchr(optarg, ':');
+			if (colon)
+				*colon = '\0';
+			len_mean = parse_opt_double(optarg, MAX_DOMAIN - 1, "name length");
+			if (colon)
+				len_sd = parse_opt_double(colon + 1, MAX_DOMAIN, "name length sd");
+		} else if (opt == 'o') {
+			log_out = optarg;
+		} else if (opt == 'r') {
+			log_in = optarg;
+		} else if (opt == 's') {
+			seed = (uint64_t)parse_opt_long(optarg, LONG_MAX, "seed");
+		} else if (opt == 'G') {
+			gen = parse_opt_long(optarg, UINT32_MAX / 2, "name count");
+		} else {
+			usage(prog);
+			return 1;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	const char *sock_path = argc >= 2 ? argv[1] : DNS_SOCK_PATH;
+	if (argc > 2 || (gen < 0 && !db_path == !log_in) || conns < 1 || threads < 1 ||
+		g_window < 1) {
+		usage(prog);
+		return 1;
+	}
+	if (gen >= 0) {
+		gen_database((size_t)gen, len_mean, len_sd, seed);
+		return 0;
+	}
+	if (threads > conns)
+		threads = conns;
+
+	double t0 = dns_clock_ms();
+	dns_entries_t e;
+	memset(&e, 0, sizeof(e));
+	char *log_storage = NULL;
+	if (db_path) {
+		if (dns_entries_load(&e, db_path) != 0)
+			dns_die(db_path);
+		if (e.names == 0 && miss < 1.0 && update < 1.0) {
+			fprintf(stderr, "%s has no names; use -m 1 for misses only\n", db_path);
+			return 1;
+		}
+		gen_queries(&e, (size_t)(queries < 0 ? BENCH_QUERIES : queries), skew, miss, update,
+			len_mean, len_sd, seed);
+	} else {
+		size_t lines = load_log(log_in, &log_storage);
+		if (lines == 0) {
+			fprintf(stderr, "%s has no queries\n", log_in);
+			return 1;
+		}
+		g_nqueries = queries < 0 ? lines : (size_t)queries;
+		g_queries = (const char **)malloc(g_nqueries * sizeof(char *));
+		if (!g_queries)
+			dns_die("malloc queries");
+		const char *p = log_storage;
+		for (size_t i = 0; i < g_nqueries; i++) {
+			if (i % lines == 0)
+				p = log_storage;
+			g_queries[i] = p;
+			p += strlen(p) + 1;
+		}
+	}
+	if (log_out) {
+		FILE *f = fopen(log_out, "w");
+		if (!f)
+			dns_die(log_out);
+		for (size_t i = 0; i < g_nqueries; i++)
+			fprintf(f, "%s\n", g_queries[i]);
+		if (fclose(f) != 0)
+			dns_die(log_out);
+	}
+	double prep_ms = dns_clock_ms() - t0;
+
+	/* Connect everything first, so the run measures queries only. */
+	worker_t *workers = (worker_t *)calloc((size_t)threads, sizeof(worker_t));
+	if (!workers)
+		dns_die("calloc workers");
+	for (long t = 0; t < threads; t++) {
+		worker_t *w = &workers[t];
+		w->nconns = (size_t)(conns / threads + (t < conns % threads));
+		w->conns = (bconn_t *)calloc(w->nconns, sizeof(bconn_t));
+		w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (!w->conns || w->epoll_fd < 0)
+			dns_die("worker");
+		for (size_t i = 0; i < w->nconns; i++) {
+			bconn_t *c = &w->conns[i];
+			c->fd = bench_connect(sock_path);
+			dns_buf_reserve(&c->in, sizeof(uint32_t) + MAX_REPLY);
+			c->sent_at = (uint64_t *)malloc(g_window * sizeof(uint64_t));
+			if (!c->sent_at)
+				dns_die("malloc conn");
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = c->events = EPOLLIN;
+			ev.data.ptr = c;
+			if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+				dns_die("epoll_ctl");
+		}
+		w->active = w->nconns;
+	}
+
+	uint64_t start = now_ns();
+	for (long t = 0; t < threads; t++) {
+		if (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0)
+			dns_die("pthread_create");
+	}
+	size_t lat_n = 0, ulat_n = 0;
+	for (long t = 0; t < threads; t++) {
+		pthread_join(workers[t].thread, NULL);
+		lat_n += workers[t].lat_n;
+		ulat_n += workers[t].ulat_n;
+	}
+	double secs = (double)(now_ns() - start) / 1e9;
+
+	uint64_t *lat = (uint64_t *)malloc((lat_n + 1) * sizeof(uint64_t));
+	uint64_t *ulat = (uint64_t *)malloc((ulat_n + 1) * sizeof(uint64_t));
+	if (!lat || !ulat)
+		dns_die("malloc latencies");
+	uint64_t hits = 0, misses = 0, errors = 0;
+	size_t k = 0, uk = 0;
+	for (long t = 0; t < threads; t++) {
+		worker_t *w = &workers[t];
+		memcpy(lat + k, w->lat, w->lat_n * sizeof(uint64_t));
+		k += w->lat_n;
+		memcpy(ulat + uk, w->ulat, w->ulat_n * sizeof(uint64_t));
+		uk += w->ulat_n;
+		hits += w->hits;
+		misses += w->misses;
+		errors += w->errors;
+	}
+	qsort(lat, lat_n, sizeof(uint64_t), cmp_u64);
+	qsort(ulat, ulat_n, sizeof(uint64_t), cmp_u64);
+
+	printf("{\"source\": \"%s\", \"queries\": %zu, \"connections\": %ld, \"threads\": %ld, "
+		"\"window\": %zu, \"transport\": \"%s\"", db_path ? "zipf" : "replay", lat_n + ulat_n, conns,
+		threads, g_window, g_seqpacket ? "seqpacket" : "stream");
+	if (db_path)
+		printf(", \"names\": %u, \"skew\": %.3f, \"miss_ratio\": %.3f, "
+			"\"update_ratio\": %.3f, \"seed\": %llu", e.names, skew, miss, update,
+			(unsigned long long)seed);
+	printf(", \"prepare_ms\": %.1f, \"elapsed_s\": %.3f, \"qps\": %.1f", prep_ms, secs,
+		secs > 0 ? (double)(lat_n + ulat_n) / secs : 0.0);
+	printf(", \"hits\": %llu, \"misses\": %llu, \"errors\": %llu", (unsigned long long)hits,
+		(unsigned long long)misses, (unsigned long long)errors);
+	print_latency("latency_us", lat, lat_n);
+	if (ulat_n > 0) {
+		printf(", \"updates\": %zu, \"update_qps\": %.1f", ulat_n,
+			secs > 0 ? (double)ulat_n / secs : 0.0);
+		print_latency("update_latency_us", ulat, ulat_n);
+	}
+	printf("}\n");
+	return errors > 0;
+}
@@ -0,0 +1,231 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include "dns_common.h"
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Answer cache for names forwarded upstream. Names are spread over
+ * DNS_CACHE_SHARDS independently locked shards, each a chained hash table
+ * with an LRU list bounded to its share of the capacity. A name being
+ * fetched has a PENDING entry carrying the requests waiting for it, so
+ * concurrent misses on one name cost a single upstream query; once the
+ * answer is in, the entry is READY until its TTL runs out. Negative
+ * answers are cached the same way with their own TTL.
+ */
+
+#define DNS_CACHE_SHARDS 64
+
+enum { DNS_CACHE_HIT, DNS_CACHE_NEGATIVE, DNS_CACHE_WAIT, DNS_CACHE_MISS, DNS_CACHE_FAIL };
+enum { DNS_CENTRY_PENDING, DNS_CENTRY_READY };
+
+/* A request parked on a PENDING entry; owner and slot are the caller's. */
+typedef struct dns_waiter {
+	struct dns_waiter *next;
+	void *owner;
+	uint32_t slot;
+} dns_waiter_t;
+
+typedef struct dns_centry {
+	struct dns_centry *hnext; /* hash chain */
+	struct dns_centry *prev, *next; /* LRU, most recent first */
+	uint64_t expires_ns;
+	uint32_t hash;
+	int state;
+	char *answer; /* addresses, NULL for a negative answer */
+	dns_waiter_t *waiters;
+	size_t name_len;
+	char name[];
+} dns_centry_t;
+
+typedef struct {
+	_Alignas(64) pthread_mutex_t lock;
+	dns_centry_t **buckets;
+	uint32_t mask;
+	uint32_t count;
+	uint32_t cap;
+	dns_centry_t lru; /* sentinel */
+} dns_cache_shard_t;
+
+typedef struct {
+	dns_cache_shard_t *shards;
+	uint64_t ttl_ns;
+	uint64_t neg_ttl_ns;
+} dns_cache_t;
+
+static inline uint64_t dns_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void dns_cache_init(dns_cache_t *c, uint32_t capacity, uint32_t ttl_s,
+	uint32_t neg_ttl_s)
+{
+	c->ttl_ns = (uint64_t)ttl_s * 1000000000ull;
+	c->neg_ttl_ns = (uint64_t)neg_ttl_s * 1000000000ull;
+	if (posix_memalign((void **)&c->shards, 64, DNS_CACHE_SHARDS * sizeof(dns_cache_shard_t)))
+		dns_die("posix_memalign cache");
+	memset(c->shards, 0, DNS_CACHE_SHARDS * sizeof(dns_cache_shard_t));
+
+	uint32_t per = capacity / DNS_CACHE_SHARDS;
+	if (per < 16)
+		per = 16;
+	uint32_t nb = 16;
+	while (nb < per)
+		nb *= 2;
+	for (int i = 0; i < DNS_CACHE_SHARDS; i++) {
+		dns_cache_shard_t *s = &c->shards[i];
+		pthread_mutex_init(&s->lock, NULL);
+		s->buckets = (dns_centry_t **)calloc(nb, sizeof(dns_centry_t *));
+		if (!s->buckets)
+			dns_die("calloc cache");
+		s->mask = nb - 1;
+		s->cap = per;
+		s->lru.prev = s->lru.next = &s->lru;
+	}
+}
+
+static inline dns_cache_shard_t *dns_cache_shard(dns_cache_t *c, uint32_t hash)
+{
+	return &c->shards[hash >> 26]; /* top bits; buckets use the low ones */
+}
+
+static inline void dns_lru_unlink(dns_centry_t *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static inline void dns_lru_push(dns_cache_shard_t *s, dns_centry_t *e)
+{
+	e->prev = &s->lru;
+	e->next = s->lru.next;
+	s->lru.next->prev = e;
+	s->lru.next = e;
+}
+
+static inline dns_centry_t *dns_cache_find_locked(dns_cache_shard_t *s, const char *name,
+	size_t len, uint32_t hash)
+{
+	for (dns_centry_t *e = s->buckets[hash & s->mask]; e; e = e->hnext) {
+		if (e->hash == hash && e->name_len == len && memcmp(e->name, name, len) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static inline void dns_cache_remove_locked(dns_cache_shard_t *s, dns_centry_t *e)
+{
+	dns_centry_t **pp = &s->buckets[e->hash & s->mask];
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	dns_lru_unlink(e);
+	s->count--;
+	free(e->answer);
+	free(e);
+}
+
+/* Drops least recently used READY entries until there is room for one. */
+static inline void dns_cache_evict_locked(dns_cache_shard_t *s)
+{
+	dns_centry_t *e = s->lru.prev;
+	while (s->count >= s->cap && e != &s->lru) {
+		dns_centry_t *prev = e->prev;
+		if (e->state == DNS_CENTRY_READY)
+			dns_cache_remove_locked(s, e);
+		e = prev;
+	}
+}
+
+/*
+ * Looks up a lowercased name. HIT copies the cached addresses into out,
+ * NEGATIVE means a cached NOTFOUND. Otherwise (owner, slot) is parked on
+ * the name: WAIT when a query for it is already in flight, MISS when the
+ * caller must send one and later call dns_cache_complete().
+ */
+static inline int dns_cache_lookup(dns_cache_t *c, const char *name, size_t len,
+	uint32_t hash, void *owner, uint32_t slot, char *out, size_t outsz)
+{
+	dns_cache_shard_t *s = dns_cache_shard(c, hash);
+	pthread_mutex_lock(&s->lock);
+	dns_centry_t *e = dns_cache_find_locked(s, name, len, hash);
+	if (e && e->state == DNS_CENTRY_READY && e->expires_ns > dns_now_ns()) {
+		dns_lru_unlink(e);
+		dns_lru_push(s, e);
+		int rc = e->answer ? DNS_CACHE_HIT : DNS_CACHE_NEGATIVE;
+		if (e->answer)
+			snprintf(out, outsz, "%s", e->answer);
+		pthread_mutex_unlock(&s->lock);
+		return rc;
+	}
+
+	dns_waiter_t *w = (dns_waiter_t *)malloc(sizeof(*w));
+	if (!w)
+		dns_die("malloc waiter");
+	w->owner = owner;
+	w->slot = slot;
+	int rc = DNS_CACHE_MISS;
+	if (e && e->state == DNS_CENTRY_PENDING) {
+		rc = DNS_CACHE_WAIT;
+	} else if (e) {
+		/* Expired: refetch in place. */
+		free(e->answer);
+		e->answer = NULL;
+		e->state = DNS_CENTRY_PENDING;
+		dns_lru_unlink(e);
+		dns_lru_push(s, e);
+	} else {
+		dns_cache_evict_locked(s);
+		e = (dns_centry_t *)calloc(1, sizeof(*e) + len + 1);
+		if (!e)
+			dns_die("calloc cache entry");
+		e->hash = hash;
+		e->state = DNS_CENTRY_PENDING;
+		e->name_len = len;
+		memcpy(e->name, name, len);
+		e->hnext = s->buckets[hash & s->mask];
+		s->buckets[hash & s->mask] = e;
+		dns_lru_push(s, e);
+		s->count++;
+	}
+	w->next = e->waiters;
+	e->waiters = w;
+	pthread_mutex_unlock(&s->lock);
+	return rc;
+}
+
+/*
+ * Stores the upstream result for a PENDING name and hands back its waiters
+ * for the caller to answer and free. status is DNS_CACHE_HIT (answer holds
+ * the addresses), DNS_CACHE_NEGATIVE, or DNS_CACHE_FAIL, which caches
+ * nothing so the next request retries.
+ */
+static inline dns_waiter_t *dns_cache_complete(dns_cache_t *c, const char *name, size_t len,
+	uint32_t hash, int status, const char *answer)
+{
+	dns_cache_shard_t *s = dns_cache_shard(c, hash);
+	pthread_mutex_lock(&s->lock);
+	dns_centry_t *e = dns_cache_find_locked(s, name, len, hash);
+	dns_waiter_t *w = NULL;
+	if (e && e->state == DNS_CENTRY_PENDING) {
+		w = e->waiters;
+		e->waiters = NULL;
+		if (status == DNS_CACHE_FAIL) {
+			dns_cache_remove_locked(s, e);
+		} else {
+			e->state = DNS_CENTRY_READY;
+			e->answer = status == DNS_CACHE_HIT ? strdup(answer) : NULL;
+			e->expires_ns = dns_now_ns() +
+				(status == DNS_CACHE_HIT ? c->ttl_ns : c->neg_ttl_ns);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return w;
+}
+
+#endif
@@ -1,38 +1,222 @@
-#include "dns_common.h"
+#define _GNU_SOURCE
 
+#include "dns_export.h"
+#include "dns_shm.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <strings.h>
 #include <sys/un.h>
+#include <time.h>
+
+#define BULK_WINDOW 64
+
+static int g_seqpacket = 0; /* -S: one record per message, no length prefix */
+static int g_shm = 0; /* -m: resolve from the server's shared table */
 
 static void usage(const char *argv0)
 {
-	fprintf(stderr, "Usage: %s [socket_path]\n", argv0);
+	fprintf(stderr, "Usage: %s [-S] [-m] [-f names.txt|-] [-w window] [-E image | -T "
+		"text|-] [socket_path]\n", argv0);
 	fprintf(stderr, "Default socket: %s\n", DNS_SOCK_PATH);
+	fprintf(stderr, "-f: bulk mode, resolve one name per line from a file or stdin (-),\n"
+		"    printing answers in input order and a rate/latency summary\n");
+	fprintf(stderr, "-w: requests kept in flight in bulk mode (default %d)\n", BULK_WINDOW);
+	fprintf(stderr, "-S: use SOCK_SEQPACKET, for a server started with -S\n");
+	fprintf(stderr, "-m: map the table of a server started with -M and resolve names "
+		"locally,\n    without a round trip per name (either transport)\n");
+	fprintf(stderr, "-E: copy the server's table to an image file, and its online changes "
+		"to\n    image.journal.snap for a peer started with -J image.journal\n");
+	fprintf(stderr, "-T: copy the server's table, online changes included, as database "
+		"lines to a file\n    or stdout (-)\n");
 }
 
-int main(int argc, char **argv)
+static uint64_t now_ns(void)
 {
-	const char *sock_path = DNS_SOCK_PATH;
-	if (argc >= 2)
-		sock_path = argv[1];
-	if (argc > 2) {
-		usage(argv[0]);
-		return 1;
-	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (fd < 0)
-		dns_die("socket");
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
 
-	struct sockaddr_un addr;
-	memset(&addr, 0, sizeof(addr));
-	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+/* Nearest-rank percentile of sorted v[n]. */
+static double percentile_us(const uint64_t *v, size_t n, double p)
+{
+	size_t i = (size_t)(p / 100.0 * (double)n);
+	if (i >= n)
+		i = n - 1;
+	return (double)v[i] / 1e3;
+}
 
-	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-		dns_die("connect");
+/*
+ * Bulk mode: keeps up to window requests outstanding on the socket. The
+ * server answers a connection's frames in order, so replies are matched to
+ * requests through a FIFO of send times and printed as they arrive. The
+ * socket is non-blocking and both directions are driven by poll(), so a
+ * large window cannot deadlock against the server's own backpressure.
+ * Requests queued between polls leave in one send() (one sendmmsg() of
+ * records), and one recv() takes every reply that has arrived.
+ */
+static int run_bulk(int fd, FILE *in, size_t window)
+{
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+		dns_die("fcntl");
+
+	uint64_t *sent_at = (uint64_t *)malloc(window * sizeof(uint64_t));
+	size_t lat_cap = 1024, lat_n = 0;
+	uint64_t *lat = (uint64_t *)malloc(lat_cap * sizeof(uint64_t));
+	if (!sent_at || !lat)
+		dns_die("malloc");
+	dns_buf_t wbuf, rbuf;
+	memset(&wbuf, 0, sizeof(wbuf));
+	memset(&rbuf, 0, sizeof(rbuf));
+	size_t head = 0, inflight = 0; /* FIFO of send times */
+	size_t skipped = 0;
+	int eof = 0;
+
+	char line[MAX_DOMAIN + 2];
+	uint64_t start = now_ns();
+	while (!eof || inflight > 0) {
+		/* Queue names while the window has room. */
+		while (!eof && inflight < window) {
+			if (!fgets(line, sizeof(line), in)) {
+				eof = 1;
+				break;
+			}
+			size_t n = strlen(line);
+			if (n > 0 && line[n - 1] != '\n' && !feof(in)) {
+				/* Overlong line: drop the rest of it. */
+				int ch;
+				while ((ch = fgetc(in)) != EOF && ch != '\n')
+					;
+				skipped++;
+				continue;
+			}
+			trim_newline_dns(line);
+			n = strlen(line);
+			if (n == 0 || n >= MAX_DOMAIN) {
+				skipped += n > 0;
+				continue;
+			}
+			if (strcasecmp(line, "exit") == 0) {
+				skipped++;
+				continue;
+			}
+			dns_buf_put(&wbuf, line, n);
+			sent_at[(head + inflight) % window] = now_ns();
+			inflight++;
+		}
+
+		struct pollfd pfd = {fd, 0, 0};
+		if (dns_buf_pending(&wbuf) > 0)
+			pfd.events |= POLLOUT;
+		if (inflight > 0)
+			pfd.events |= POLLIN;
+		if (pfd.events == 0)
+			break;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			dns_die("poll");
+		}
+
+		if (pfd.revents & POLLOUT) {
+			ssize_t w = dns_buf_send(&wbuf, fd, g_seqpacket, wbuf.len);
+			if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				dns_die("send");
+		}
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			ssize_t r;
+			if (g_seqpacket) {
+				/* A record is one reply: give it the prefix the parser expects. */
+				size_t room = MAX_REPLY + 1;
+				dns_buf_compact(&rbuf);
+				dns_buf_reserve(&rbuf, sizeof(uint32_t) + room);
+				do {
+					r = recv(fd, rbuf.buf + rbuf.len + sizeof(uint32_t), room, MSG_TRUNC);
+				} while (r < 0 && errno == EINTR);
+				if (r > 0) {
+					uint32_t len = (uint32_t)r;
+					memcpy(rbuf.buf + rbuf.len, &len, sizeof(len));
+					rbuf.len += sizeof(len) + ((size_t)r < room ? (size_t)r : room);
+				}
+			} else {
+				r = dns_buf_fill(&rbuf, fd);
+			}
+			if (r == 0) {
+				fprintf(stderr, "server closed the connection\n");
+				break;
+			}
+			if (r < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					continue;
+				dns_die("recv");
+			}
+
+			char *msg;
+			size_t len;
+			int f;
+			while ((f = dns_buf_frame(&rbuf, MAX_REPLY, &msg, &len)) != 0) {
+				if (f < 0) {
+					fprintf(stderr, "reply too long\n");
+					exit(EXIT_FAILURE);
+				}
+				printf("%.*s\n", (int)len, msg);
+
+				if (inflight == 0) {
+					fprintf(stderr, "unexpected reply\n");
+					exit(EXIT_FAILURE);
+				}
+				if (lat_n == lat_cap) {
+					lat_cap *= 2;
+					lat = (uint64_t *)realloc(lat, lat_cap * sizeof(uint64_t));
+					if (!lat)
+						dns_die("realloc");
+				}
+				lat[lat_n++] = now_ns() - sent_at[head];
+				head = (head + 1) % window;
+				inflight--;
+			}
+		}
+	}
+	double secs = (double)(now_ns() - start) / 1e9;
+	fflush(stdout);
+
+	if (skipped > 0)
+		fprintf(stderr, "skipped %zu lines (empty name, 'exit', or over %d characters)\n",
+			skipped, MAX_DOMAIN - 1);
+	qsort(lat, lat_n, sizeof(uint64_t), cmp_u64);
+	fprintf(stderr, "%zu names in %.3f s, %.0f names/sec, window %zu\n", lat_n, secs,
+		secs > 0 ? (double)lat_n / secs : 0.0, window);
+	if (lat_n > 0)
+		fprintf(stderr, "latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+			percentile_us(lat, lat_n, 50), percentile_us(lat, lat_n, 90),
+			percentile_us(lat, lat_n, 99), percentile_us(lat, lat_n, 99.9),
+			(double)lat[lat_n - 1] / 1e3);
 
-	printf("DNS client connected. Type a domain (or 'exit').\n\n");
+	dns_buf_free(&rbuf);
+	dns_buf_free(&wbuf);
+	free(lat);
+	free(sent_at);
+	return inflight == 0 ? 0 : 1;
+}
+
+static void run_interactive(int fd)
+{
+	printf("DNS client connected. Type a domain, several separated by spaces, "
+		"'PTR ip', 'CIDR ip',\n'ADD name ip [weight]', 'DEL name [ip]', or 'exit'.\n\n");
 
-	char line[MAX_DOMAIN];
+	char *reply = (char *)malloc(MAX_BATCH_REPLY);
+	if (!reply)
+		dns_die("malloc");
+	dns_buf_t in; /* replies, read as they come */
+	memset(&in, 0, sizeof(in));
+	char line[MAX_BATCH_MSG];
 	for (;;) {
 		printf("domain> ");
 		fflush(stdout);
@@ -42,21 +226,278 @@ int main(int argc, char **argv)
 		if (line[0] == '\0')
 			continue;
 
-		if (send_msg(fd, line) != 0)
-			dns_die("send_msg");
+		/* Several names go out as one batch: one round trip for all. */
+		const char *names[DNS_MAX_BATCH];
+		size_t n = 0;
+		char *save = NULL;
+		int too_long = 0;
+		if (strncasecmp(line, "PTR ", 4) == 0 || strncasecmp(line, "CIDR ", 5) == 0 ||
+			strncasecmp(line, "ADD ", 4) == 0 || strncasecmp(line, "DEL ", 4) == 0) {
+			too_long = strlen(line) >= MAX_DOMAIN;
+			names[n++] = line; /* a reverse lookup or an update is one request */
+		}
+		for (char *tok = n ? NULL : strtok_r(line, " \t", &save);
+			tok && n < DNS_MAX_BATCH; tok = strtok_r(NULL, " \t", &save)) {
+			too_long |= strlen(tok) >= MAX_DOMAIN;
+			names[n++] = tok;
+		}
+		if (too_long) {
+			printf("Names are limited to %d characters.\n\n", MAX_DOMAIN - 1);
+			continue;
+		}
+		if (n == 0)
+			continue;
+		int sr;
+		if (n > 1)
+			sr = send_batch(fd, g_seqpacket, names, n);
+		else
+			sr = g_seqpacket ? send_record(fd, names[0], strlen(names[0])) :
+				send_msg(fd, names[0]);
+		if (sr != 0)
+			dns_die("send");
 
-		char reply[MAX_DOMAIN + MAX_IP + 32];
-		int rr = recv_msg(fd, reply, sizeof(reply));
+		int rr = g_seqpacket ? recv_record(fd, reply, MAX_BATCH_REPLY) :
+			dns_buf_recv_msg(&in, fd, reply, MAX_BATCH_REPLY);
 		if (rr == -2)
 			break;
 		if (rr != 0)
 			dns_die("recv_msg");
 
 		printf("%s\n\n", reply);
-		if (strcasecmp(line, "exit") == 0)
+		if (n == 1 && strcasecmp(names[0], "exit") == 0)
 			break;
 	}
 
-	close(fd);
+	dns_buf_free(&in);
+	free(reply);
+}
+
+/*
+ * -m: names are resolved in this process from the server's shared table;
+ * the socket is only used again to remap it after a reload. Answers are
+ * printed like the server's, and bulk mode ends with the same summary.
+ */
+static int run_shm(const char *sock_path, FILE *in)
+{
+	dns_shm_t s;
+	if (dns_shm_open(&s, sock_path) != 0)
+		dns_die("map shared table");
+	int interactive = in == NULL;
+	if (interactive) {
+		printf("DNS client mapped %u records. Type a domain, several separated by spaces, "
+			"or 'exit'.\n\n", s.table.hdr->count);
+		in = stdin;
+	}
+
+	size_t lat_cap = 1024, lat_n = 0, skipped = 0;
+	uint64_t warned = 0; /* the generation we last could not remap */
+	uint64_t *lat = (uint64_t *)malloc(lat_cap * sizeof(uint64_t));
+	if (!lat)
+		dns_die("malloc");
+	char line[MAX_BATCH_MSG], ips[MAX_REPLY];
+	uint64_t start = now_ns();
+	for (;;) {
+		if (interactive) {
+			printf("domain> ");
+			fflush(stdout);
+		}
+		if (!fgets(line, sizeof(line), in))
+			break;
+		trim_newline_dns(line);
+		char *save = NULL;
+		int done = 0;
+		for (char *tok = strtok_r(line, " \t", &save); tok;
+			tok = strtok_r(NULL, " \t", &save)) {
+			if (strcasecmp(tok, "exit") == 0) {
+				done = interactive;
+				skipped += !interactive;
+				continue;
+			}
+			if (strlen(tok) >= MAX_DOMAIN) {
+				skipped++;
+				continue;
+			}
+			uint64_t t0 = now_ns();
+			int rc = dns_shm_lookup(&s, tok, ips, sizeof(ips));
+			uint64_t t1 = now_ns();
+			if (s.refresh_err && s.tried != warned) {
+				warned = s.tried;
+				fprintf(stderr, "cannot map reloaded table generation %llu (%s), "
+					"answering from generation %llu\n", (unsigned long long)s.tried,
+					strerror(s.refresh_err), (unsigned long long)s.generation);
+			}
+			if (rc == 0)
+				printf("OK %s %s\n", tok, ips);
+			else
+				printf("NOTFOUND %s\n", tok);
+			if (lat_n == lat_cap) {
+				lat_cap *= 2;
+				lat = (uint64_t *)realloc(lat, lat_cap * sizeof(uint64_t));
+				if (!lat)
+					dns_die("realloc");
+			}
+			lat[lat_n++] = t1 - t0;
+		}
+		if (interactive)
+			printf("\n");
+		if (done)
+			break;
+	}
+	double secs = (double)(now_ns() - start) / 1e9;
+	fflush(stdout);
+
+	if (!interactive) {
+		if (skipped > 0)
+			fprintf(stderr, "skipped %zu names ('exit', or over %d characters)\n", skipped,
+				MAX_DOMAIN - 1);
+		qsort(lat, lat_n, sizeof(uint64_t), cmp_u64);
+		fprintf(stderr, "%zu names in %.3f s, %.0f names/sec, shared table generation %llu\n",
+			lat_n, secs, secs > 0 ? (double)lat_n / secs : 0.0,
+			(unsigned long long)s.generation);
+		if (lat_n > 0)
+			fprintf(stderr, "latency us: p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+				percentile_us(lat, lat_n, 50), percentile_us(lat, lat_n, 90),
+				percentile_us(lat, lat_n, 99), percentile_us(lat, lat_n, 99.9),
+				(double)lat[lat_n - 1] / 1e3);
+	}
+	free(lat);
+	dns_shm_close(&s);
 	return 0;
 }
+
+/*
+ * -E and -T: fetches a bulk export into path. A file is written as
+ * path.tmp and renamed over path only once it is complete and on disk, so
+ * a failure leaves the old file alone, even one a server has mapped.
+ * Stdout (-), pipes and devices get the export as it comes.
+ */
+static int run_export(int fd, const char *path, int text)
+{
+	struct stat st;
+	int to_stdout = strcmp(path, "-") == 0;
+	int direct = to_stdout || (stat(path, &st) == 0 && !S_ISREG(st.st_mode));
+	char tmp[4096 + sizeof(".tmp")];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int out = to_stdout ? STDOUT_FILENO : direct ? open(path, O_WRONLY | O_CLOEXEC) :
+		open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out < 0)
+		dns_die(direct ? path : tmp);
+	dns_buf_t snap;
+	memset(&snap, 0, sizeof(snap));
+	uint64_t bytes;
+	char err[256];
+	uint64_t t0 = now_ns();
+	int rc = dns_export_fetch(fd, g_seqpacket, text, out, &snap, &bytes, err, sizeof(err));
+	double secs = (double)(now_ns() - t0) / 1e9;
+	if (rc != 0)
+		fprintf(stderr, "export: %s\n", err);
+	if (rc == 0 && !direct && fsync(out) != 0) {
+		perror(tmp);
+		rc = -1;
+	}
+	if (!to_stdout && close(out) != 0 && rc == 0) {
+		perror(direct ? path : tmp);
+		rc = -1;
+	}
+	if (rc == 0 && !direct && (rename(tmp, path) != 0 || dns_fsync_dir(path) != 0)) {
+		perror(path);
+		rc = -1;
+	}
+	if (rc != 0 && !direct)
+		unlink(tmp);
+
+	/* An image's changes, in the place a -J server recovers them from. */
+	char snap_path[4096];
+	snprintf(snap_path, sizeof(snap_path), "%s.journal.snap", path);
+	if (rc == 0 && !text && !direct && snap.len > sizeof(dns_journal_hdr_t)) {
+		if (dns_write_file(snap_path, snap.buf, snap.len) != 0)
+			dns_die(snap_path);
+		fprintf(stderr, "online changes in %s (%zu bytes)\n", snap_path, snap.len);
+	} else if (rc == 0 && !text && !direct && unlink(snap_path) == 0) {
+		fprintf(stderr, "no online changes, removed the old %s\n", snap_path);
+	}
+	if (rc == 0)
+		fprintf(stderr, "exported %llu bytes in %.3f s, %.1f MB/s\n",
+			(unsigned long long)bytes, secs, secs > 0 ? (double)bytes / secs / 1e6 : 0.0);
+	dns_buf_free(&snap);
+	return rc == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *prog = argv[0];
+	const char *bulk_path = NULL, *export_path = NULL;
+	int export_text = 0;
+	long window = BULK_WINDOW;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:w:E:T:Sm")) != -1) {
+		if (opt == 'S') {
+			g_seqpacket = 1;
+		} else if (opt == 'm') {
+			g_shm = 1;
+		} else if (opt == 'f') {
+			bulk_path = optarg;
+		} else if (opt == 'E' || opt == 'T') {
+			export_path = optarg;
+			export_text = opt == 'T';
+		} else if (opt == 'w') {
+			char *end;
+			window = strtol(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || window <= 0 || window > 1000000) {
+				fprintf(stderr, "Invalid window '%s'\n", optarg);
+				return 1;
+			}
+		} else {
+			usage(prog);
+			return 1;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	const char *sock_path = DNS_SOCK_PATH;
+	if (argc >= 2)
+		sock_path = argv[1];
+	if (argc > 2) {
+		usage(prog);
+		return 1;
+	}
+
+	FILE *in = NULL;
+	if (bulk_path) {
+		in = strcmp(bulk_path, "-") == 0 ? stdin : fopen(bulk_path, "r");
+		if (!in)
+			dns_die(bulk_path);
+	}
+	if (g_shm) {
+		int rc = run_shm(sock_path, in);
+		if (in && in != stdin)
+			fclose(in);
+		return rc;
+	}
+
+	int fd = socket(AF_UNIX, g_seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+	if (fd < 0)
+		dns_die("socket");
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		dns_die("connect");
+
+	int rc = 0;
+	if (export_path) {
+		rc = run_export(fd, export_path, export_text);
+	} else if (in) {
+		rc = run_bulk(fd, in, (size_t)window);
+		if (in != stdin)
+			fclose(in);
+	} else {
+		run_interactive(fd);
+	}
+	close(fd);
+	return rc;
+}
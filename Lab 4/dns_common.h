@@ -9,10 +9,25 @@
 #include <unistd.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #define DNS_SOCK_PATH "./dns_socket"
 #define MAX_DOMAIN 256
 #define MAX_IP 64
+#define DNS_MAX_ADDRS 32 /* addresses per name */
+#define MAX_REPLY (MAX_DOMAIN + DNS_MAX_ADDRS * MAX_IP + 32)
+
+/*
+ * Batch request: DNS_BATCH_TAG followed by up to DNS_MAX_BATCH names, one
+ * per line. The reply is a single frame holding one answer line per name,
+ * in request order, joined by '\n'. A name never contains a newline, so a
+ * plain single-name frame cannot be mistaken for a batch.
+ */
+#define DNS_BATCH_TAG "BATCH\n"
+#define DNS_BATCH_TAG_LEN (sizeof(DNS_BATCH_TAG) - 1)
+#define DNS_MAX_BATCH 256
+#define MAX_BATCH_MSG (DNS_BATCH_TAG_LEN + DNS_MAX_BATCH * MAX_DOMAIN)
+#define MAX_BATCH_REPLY (DNS_MAX_BATCH * MAX_REPLY)
 
 static inline void dns_die(const char *msg)
 {
@@ -54,13 +69,91 @@ static inline int recv_all_bytes(int fd, void *buf, size_t len)
 	return 0;
 }
 
-/* Simple length-prefixed message: uint32_t length (host order) + bytes (no NUL required). */
+/*
+ * Messages on the UNIX socket. SOCK_STREAM (the default) frames each one as
+ * a uint32_t length (host order) + bytes, no NUL required. SOCK_SEQPACKET
+ * keeps message boundaries itself, so a message is one record without the
+ * prefix: one send and one recv each. A record must fit the socket buffer
+ * (about 200 KB by default), less than MAX_BATCH_REPLY: a batch reply too
+ * big for it is sent as one "ERROR: reply too large" line per name.
+ * send_frame() hands prefix and body to one sendmsg() (a writev() that
+ * takes MSG_NOSIGNAL); a stream may still take part of it, and the loop
+ * sends the rest.
+ */
+static inline int send_frame(int fd, const void *buf, uint32_t len)
+{
+	struct iovec iov[2] = {{&len, sizeof(len)}, {(void *)buf, len}};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	size_t left = sizeof(len) + len;
+	while (left > 0) {
+		ssize_t w = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		left -= (size_t)w;
+		/* Short write: step the iovecs past what went out. */
+		while (msg.msg_iovlen > 0 && (size_t)w >= msg.msg_iov->iov_len) {
+			w -= (ssize_t)msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + w;
+			msg.msg_iov->iov_len -= (size_t)w;
+		}
+	}
+	return 0;
+}
+
 static inline int send_msg(int fd, const char *s)
 {
-	uint32_t len = (uint32_t)strlen(s);
-	if (send_all_bytes(fd, &len, sizeof(len)) != 0)
+	return send_frame(fd, s, (uint32_t)strlen(s));
+}
+
+/* One SOCK_SEQPACKET record. */
+static inline int send_record(int fd, const void *buf, size_t len)
+{
+	for (;;) {
+		ssize_t w = send(fd, buf, len, MSG_NOSIGNAL);
+		if (w >= 0)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+/*
+ * Sends names[0..n) as one batch message, as a record when seqpacket is
+ * set; -1 if n or a name is out of range.
+ */
+static inline int send_batch(int fd, int seqpacket, const char *const *names, size_t n)
+{
+	if (n == 0 || n > DNS_MAX_BATCH)
+		return -1;
+	char *buf = (char *)malloc(MAX_BATCH_MSG);
+	if (!buf)
 		return -1;
-	return send_all_bytes(fd, s, len);
+	memcpy(buf, DNS_BATCH_TAG, DNS_BATCH_TAG_LEN);
+	size_t len = DNS_BATCH_TAG_LEN;
+	for (size_t i = 0; i < n; i++) {
+		size_t nl = strlen(names[i]);
+		if (nl == 0 || nl >= MAX_DOMAIN || memchr(names[i], '\n', nl)) {
+			free(buf);
+			return -1;
+		}
+		if (i > 0)
+			buf[len++] = '\n';
+		memcpy(buf + len, names[i], nl);
+		len += nl;
+	}
+	int rc = seqpacket ? send_record(fd, buf, len) : send_frame(fd, buf, (uint32_t)len);
+	free(buf);
+	return rc;
 }
 
 static inline int recv_msg(int fd, char *out, size_t outsz)
@@ -80,6 +173,201 @@ static inline int recv_msg(int fd, char *out, size_t outsz)
 	return 0;
 }
 
+/* One SOCK_SEQPACKET record, same results as recv_msg(). */
+static inline int recv_record(int fd, char *out, size_t outsz)
+{
+	for (;;) {
+		ssize_t r = recv(fd, out, outsz - 1, MSG_TRUNC);
+		if (r == 0)
+			return -2; /* closed */
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if ((size_t)r >= outsz)
+			return -3;
+		out[r] = '\0';
+		return 0;
+	}
+}
+
+/*
+ * Buffered framing. A dns_buf_t holds bytes [off, len) of buf: on the read
+ * side, received data not yet parsed into frames; on the write side,
+ * framed messages not yet sent. Reads take whatever the socket has, so one
+ * recv() usually yields many frames; writes go out together, one send()
+ * for a stream and one sendmmsg() for up to DNS_BUF_BATCH records.
+ * Under pipelined load both sides cost well under one syscall a message.
+ */
+#define DNS_BUF_READ 4096 /* initial read buffer; grows only for longer frames */
+#define DNS_BUF_BATCH 64 /* records per sendmmsg() */
+
+typedef struct {
+	char *buf;
+	size_t off;
+	size_t len;
+	size_t cap;
+} dns_buf_t;
+
+static inline void dns_buf_free(dns_buf_t *b)
+{
+	free(b->buf);
+	memset(b, 0, sizeof(*b));
+}
+
+static inline size_t dns_buf_pending(const dns_buf_t *b)
+{
+	return b->len - b->off;
+}
+
+/* Makes room for extra more bytes at len. */
+static inline void dns_buf_reserve(dns_buf_t *b, size_t extra)
+{
+	size_t need = b->len + extra;
+	if (need <= b->cap)
+		return;
+	size_t cap = b->cap ? b->cap : 256;
+	while (cap < need)
+		cap *= 2;
+	char *p = (char *)realloc(b->buf, cap);
+	if (!p)
+		dns_die("realloc");
+	b->buf = p;
+	b->cap = cap;
+}
+
+/* Moves the pending bytes to the front. */
+static inline void dns_buf_compact(dns_buf_t *b)
+{
+	if (b->off == 0)
+		return;
+	memmove(b->buf, b->buf + b->off, b->len - b->off);
+	b->len -= b->off;
+	b->off = 0;
+}
+
+/* Appends one length-prefixed frame. */
+static inline void dns_buf_put(dns_buf_t *b, const void *data, size_t len)
+{
+	uint32_t len32 = (uint32_t)len;
+	dns_buf_reserve(b, sizeof(len32) + len);
+	memcpy(b->buf + b->len, &len32, sizeof(len32));
+	memcpy(b->buf + b->len + sizeof(len32), data, len);
+	b->len += sizeof(len32) + len;
+}
+
+/*
+ * One recv() into all the free space, after compacting. Returns what
+ * recv() did: bytes read, 0 at end of stream, -1 with errno set.
+ */
+static inline ssize_t dns_buf_fill(dns_buf_t *b, int fd)
+{
+	dns_buf_compact(b);
+	if (b->cap - b->len < DNS_BUF_READ / 4)
+		dns_buf_reserve(b, DNS_BUF_READ);
+	ssize_t r;
+	do {
+		r = recv(fd, b->buf + b->len, b->cap - b->len, 0);
+	} while (r < 0 && errno == EINTR);
+	if (r > 0)
+		b->len += (size_t)r;
+	return r;
+}
+
+/*
+ * Takes the next complete frame: returns 1 with its payload (inside buf,
+ * valid until the next fill) and length, 0 if it has not all arrived, -1
+ * if its length is over max.
+ */
+static inline int dns_buf_frame(dns_buf_t *b, size_t max, char **payload, size_t *len)
+{
+	uint32_t n;
+	if (b->len - b->off < sizeof(n))
+		return 0;
+	memcpy(&n, b->buf + b->off, sizeof(n));
+	if (n > max)
+		return -1;
+	if (b->len - b->off - sizeof(n) < n)
+		return 0;
+	*payload = b->buf + b->off + sizeof(n);
+	*len = n;
+	b->off += sizeof(n) + n;
+	return 1;
+}
+
+/*
+ * Sends pending frames up to offset end: as raw stream bytes, or with
+ * seqpacket set as one record per frame, prefixes dropped. Returns the
+ * payload bytes sent (possibly short), or -1 with errno set when nothing
+ * went; the buffer empties itself once everything is out.
+ */
+static inline ssize_t dns_buf_send(dns_buf_t *b, int fd, int seqpacket, size_t end)
+{
+	ssize_t sent = 0;
+	if (!seqpacket) {
+		do {
+			sent = send(fd, b->buf + b->off, end - b->off, MSG_NOSIGNAL);
+		} while (sent < 0 && errno == EINTR);
+		if (sent > 0)
+			b->off += (size_t)sent;
+	} else {
+		struct mmsghdr msgs[DNS_BUF_BATCH];
+		struct iovec iov[DNS_BUF_BATCH];
+		unsigned n = 0;
+		size_t at = b->off;
+		memset(msgs, 0, sizeof(msgs));
+		while (at < end && n < DNS_BUF_BATCH) {
+			uint32_t len;
+			memcpy(&len, b->buf + at, sizeof(len));
+			iov[n].iov_base = b->buf + at + sizeof(len);
+			iov[n].iov_len = len;
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			at += sizeof(len) + len;
+			n++;
+		}
+		int r;
+		do {
+			r = sendmmsg(fd, msgs, n, MSG_NOSIGNAL);
+		} while (r < 0 && errno == EINTR);
+		if (r < 0)
+			sent = -1;
+		for (int i = 0; i < r; i++) {
+			sent += (ssize_t)iov[i].iov_len;
+			b->off += sizeof(uint32_t) + iov[i].iov_len;
+		}
+	}
+	if (b->off == b->len)
+		b->off = b->len = 0;
+	return sent;
+}
+
+/*
+ * Blocking counterpart of recv_msg() over a dns_buf_t: answers from frames
+ * already buffered, reading more only when none is complete.
+ */
+static inline int dns_buf_recv_msg(dns_buf_t *b, int fd, char *out, size_t outsz)
+{
+	for (;;) {
+		char *payload;
+		size_t len;
+		int f = dns_buf_frame(b, outsz - 1, &payload, &len);
+		if (f < 0)
+			return -3;
+		if (f > 0) {
+			memcpy(out, payload, len);
+			out[len] = '\0';
+			return 0;
+		}
+		ssize_t r = dns_buf_fill(b, fd);
+		if (r == 0)
+			return -2;
+		if (r < 0)
+			return -1;
+	}
+}
+
 static inline void trim_newline_dns(char *s)
 {
 	if (!s)
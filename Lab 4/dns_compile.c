@@ -0,0 +1,65 @@
+#define _GNU_SOURCE
+
+#include "dns_db.h"
+
+#include <time.h>
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s <database.txt> <image>\n", argv0);
+	fprintf(stderr, "Compiles a text database into an image dns_server can mmap.\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	double t0 = now_ms();
+	dns_entries_t e;
+	memset(&e, 0, sizeof(e));
+	dns_load_stats_t ls;
+	if (dns_entries_load_parallel(&e, argv[1], 0, &ls) != 0)
+		dns_die("open database");
+	double t1 = now_ms();
+
+	dns_table_t t;
+	size_t skipped = 0;
+	dns_table_build(&t, &e, &skipped);
+	dns_entries_free(&e);
+	double t2 = now_ms();
+
+	dns_table_t mph;
+	if (dns_table_build_mph(&mph, &t) != 0) {
+		fprintf(stderr, "dns_compile: could not build a perfect hash\n");
+		return 1;
+	}
+	dns_table_free(&t);
+	double t3 = now_ms();
+
+	if (dns_table_write(&mph, argv[2]) != 0)
+		dns_die("write image");
+	double t4 = now_ms();
+
+	if (skipped > 0)
+		fprintf(stderr, "dns_compile: skipped %zu records (bad address or weight, or over %d "
+			"per name)\n", skipped, DNS_MAX_ADDRS);
+	printf("%u records, %llu bytes (%.1f bytes/record)\n", mph.hdr->count,
+		(unsigned long long)mph.hdr->total_size,
+		mph.hdr->count ? (double)mph.hdr->total_size / mph.hdr->count : 0.0);
+	printf("parse %.1f ms (%d thread%s: map %.1f ms, parse %.1f ms, merge %.1f ms), "
+		"build %.1f ms, perfect hash %.1f ms, write %.1f ms\n", t1 - t0, ls.threads,
+		ls.threads == 1 ? "" : "s", ls.map_ms, ls.parse_ms, ls.merge_ms, t2 - t1, t3 - t2,
+		t4 - t3);
+	dns_table_free(&mph);
+	return 0;
+}
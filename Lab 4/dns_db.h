@@ -0,0 +1,1938 @@
+#ifndef DNS_DB_H
+#define DNS_DB_H
+
+#include "dns_common.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * Compiled DNS table. The same layout is used in memory (built from a text
+ * database at startup) and on disk (written by dns_compile, mmap'd by
+ * dns_server), so a table is always one flat blob: a header followed by
+ * 64-byte aligned sections addressed by offset. Integers are host order,
+ * like the socket protocol.
+ *
+ *   RECS     dns_rec_t[count]
+ *   INDEX    DNS_INDEX_RH:  dns_slot_t[index_size], index_size a power of two
+ *            DNS_INDEX_MPH: uint32_t displacement[index_size], one per bucket;
+ *                           record i is the one whose name hashes to slot i
+ *   STRINGS  lowercased names, NUL terminated
+ *   ADDRS    per record, a run of addr_count entries: family (4 or 6),
+ *            prefix length, weight (uint16), then 4 or 16 address bytes
+ *            with the bits past the prefix zeroed; unaligned
+ *   TRIE     dns_trie_node_t[], wildcard ("*.suffix") records keyed on
+ *            reversed labels; node 0 is the root, children of a node are
+ *            contiguous and sorted by label hash, nodes in breadth-first order
+ *   RADIX    dns_radix_node_t[], a path-compressed binary trie over every
+ *            address and prefix in ADDRS; node 0 roots IPv4, node 1 IPv6
+ *   RNAMES   uint32_t[], record indexes owning each RADIX node's prefix
+ *   BLOOM    blocked Bloom filter over the record names: 64-byte blocks,
+ *            each name sets DNS_BLOOM_K bits in the one block it hashes to
+ */
+
+#define DNS_IMAGE_MAGIC 0x31534E44u /* "DNS1" */
+#define DNS_IMAGE_VERSION 5
+#define DNS_ALIGN 64
+
+enum { DNS_INDEX_RH = 1, DNS_INDEX_MPH = 2 };
+enum {
+	DNS_SEC_RECS,
+	DNS_SEC_INDEX,
+	DNS_SEC_STRINGS,
+	DNS_SEC_ADDRS,
+	DNS_SEC_TRIE,
+	DNS_SEC_RADIX,
+	DNS_SEC_RNAMES,
+	DNS_SEC_BLOOM,
+	DNS_SEC_MAX = 16
+};
+
+#define DNS_NONE 0xFFFFFFFFu
+
+typedef struct {
+	uint64_t off;
+	uint64_t size;
+} dns_section_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t index_kind;
+	uint32_t count; /* records */
+	uint32_t index_size; /* RH slots or MPH buckets */
+	uint32_t reserved;
+	uint64_t mph_seed;
+	uint64_t total_size;
+	dns_section_t sec[DNS_SEC_MAX];
+} dns_hdr_t;
+
+typedef struct {
+	uint32_t hash; /* dns_hash32() of the lowercased name */
+	uint32_t name_off; /* into STRINGS */
+	uint32_t addr_off; /* first address entry in ADDRS */
+	uint16_t name_len;
+	uint16_t addr_count;
+} dns_rec_t;
+
+#define DNS_ADDR_HDR 4 /* family, prefix and weight ahead of the address bytes */
+
+typedef struct {
+	uint8_t family;
+	uint8_t prefix; /* 32 or 128 for a host address */
+	uint16_t weight;
+	const uint8_t *bytes;
+} dns_addr_t;
+
+typedef struct {
+	uint32_t hash; /* 0 marks an empty slot */
+	uint32_t idx;
+} dns_slot_t;
+
+typedef struct {
+	uint32_t label_hash; /* dns_hash32() of the label */
+	uint32_t label_off; /* label text inside STRINGS (part of a wildcard name) */
+	uint32_t child_first;
+	uint32_t child_count;
+	uint32_t wildcard; /* record index of "*.<this suffix>", or DNS_NONE */
+	uint32_t label_len;
+} dns_trie_node_t;
+
+typedef struct {
+	uint32_t key_off; /* address bytes in ADDRS sharing this node's prefix */
+	uint32_t bits; /* prefix length */
+	uint32_t child[2]; /* by the bit after the prefix, DNS_NONE if absent */
+	uint32_t name_first; /* into RNAMES */
+	uint32_t name_count; /* records with exactly this prefix; 0 for a branch */
+} dns_radix_node_t;
+
+typedef struct {
+	uint8_t *base;
+	size_t size;
+	int mapped; /* base is an mmap'd image rather than malloc'd */
+	int fd; /* the file or memfd a mapped table came from, kept open; -1 if none */
+	const dns_hdr_t *hdr;
+	const dns_rec_t *recs;
+	const void *index;
+	const char *strings;
+	const uint8_t *addrs;
+	const dns_trie_node_t *trie;
+	uint32_t trie_nodes;
+	const dns_radix_node_t *radix;
+	uint32_t radix_nodes;
+	const uint32_t *rnames;
+	uint32_t rnames_count;
+	const uint64_t *bloom; /* DNS_BLOOM_WORDS per block; NULL when empty */
+	uint32_t bloom_blocks;
+	/*
+	 * Answer rotation, one counter per record. Kept beside the blob since
+	 * images are mapped read-only; pages of it are only touched for names
+	 * with more than one address.
+	 */
+	_Atomic uint32_t *rotation;
+} dns_table_t;
+
+/* ---- hashing ---- */
+
+/* Lowercases name into out[MAX_DOMAIN]; returns its length, -1 if too long. */
+static inline int dns_lower(const char *name, char *out)
+{
+	size_t i = 0;
+	for (; name[i]; i++) {
+		if (i + 1 >= MAX_DOMAIN)
+			return -1;
+		out[i] = (char)tolower((unsigned char)name[i]);
+	}
+	out[i] = '\0';
+	return (int)i;
+}
+
+static inline uint64_t dns_mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+/* FNV-1a over an already lowercased name, then a murmur3 finalizer. */
+static inline uint64_t dns_hash64(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ull;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)s[i];
+		h *= 1099511628211ull;
+	}
+	return dns_mix64(h);
+}
+
+static inline uint32_t dns_hash32(uint64_t h)
+{
+	uint32_t v = (uint32_t)h;
+	return v ? v : 1;
+}
+
+/* Multiply-shift reduction of a 32-bit value into [0, n). */
+static inline uint32_t dns_reduce(uint32_t x, uint32_t n)
+{
+	return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+static inline uint32_t dns_mph_bucket(uint64_t h, uint32_t buckets)
+{
+	return dns_reduce((uint32_t)(h >> 32), buckets);
+}
+
+static inline uint32_t dns_mph_slot(uint64_t h, uint32_t disp, uint64_t seed, uint32_t n)
+{
+	uint64_t x = h ^ seed ^ ((uint64_t)disp + 1) * 0x9E3779B97F4A7C15ull;
+	return dns_reduce((uint32_t)dns_mix64(x), n);
+}
+
+/* ---- table access ---- */
+
+static inline uint64_t dns_align(uint64_t v)
+{
+	return (v + DNS_ALIGN - 1) & ~(uint64_t)(DNS_ALIGN - 1);
+}
+
+static inline const char *dns_rec_name(const dns_table_t *t, const dns_rec_t *r)
+{
+	if ((uint64_t)r->name_off + r->name_len >= t->hdr->sec[DNS_SEC_STRINGS].size)
+		return "";
+	return t->strings + r->name_off;
+}
+
+static inline uint32_t dns_addr_bits(uint8_t family)
+{
+	return family == 6 ? 128 : 32;
+}
+
+static inline size_t dns_addr_size(uint8_t family)
+{
+	return DNS_ADDR_HDR + dns_addr_bits(family) / 8;
+}
+
+/* Decodes r's addresses into out[max]; returns the count, -1 if damaged. */
+static inline int dns_rec_addrs(const dns_table_t *t, const dns_rec_t *r, dns_addr_t *out,
+	int max)
+{
+	uint64_t off = r->addr_off;
+	uint64_t end = t->hdr->sec[DNS_SEC_ADDRS].size;
+	if (r->addr_count > max)
+		return -1;
+	for (int i = 0; i < r->addr_count; i++) {
+		if (off + DNS_ADDR_HDR > end)
+			return -1;
+		const uint8_t *p = t->addrs + off;
+		if (p[0] != 4 && p[0] != 6)
+			return -1;
+		if (off + dns_addr_size(p[0]) > end || p[1] > dns_addr_bits(p[0]))
+			return -1;
+		out[i].family = p[0];
+		out[i].prefix = p[1];
+		memcpy(&out[i].weight, p + 2, sizeof(out[i].weight));
+		out[i].bytes = p + DNS_ADDR_HDR;
+		off += dns_addr_size(p[0]);
+	}
+	return r->addr_count;
+}
+
+/*
+ * Rotates a[] for the tick-th answer. The first address is picked with
+ * probability proportional to its weight (weight 0 marks a standby that
+ * never leads while any address has weight), the rest follow in database
+ * order. Equal weights give plain round robin.
+ */
+static inline void dns_addrs_order(dns_addr_t *a, int n, uint32_t tick)
+{
+	if (n < 2)
+		return;
+	uint32_t total = 0;
+	for (int i = 0; i < n; i++)
+		total += a[i].weight;
+	int start = 0;
+	if (total == 0) {
+		start = (int)(tick % (uint32_t)n);
+	} else {
+		uint32_t p = tick % total;
+		while (p >= a[start].weight) {
+			p -= a[start].weight;
+			start++;
+		}
+	}
+	dns_addr_t tmp[DNS_MAX_ADDRS];
+	for (int i = 0; i < n; i++)
+		tmp[i] = a[(start + i) % n];
+	memcpy(a, tmp, (size_t)n * sizeof(*a));
+}
+
+/*
+ * Decodes r's addresses into a[DNS_MAX_ADDRS] in this answer's order,
+ * advancing the record's rotation counter. Returns the count, -1 if the
+ * record is damaged.
+ */
+static inline int dns_rec_ordered(const dns_table_t *t, const dns_rec_t *r, dns_addr_t *a)
+{
+	int n = dns_rec_addrs(t, r, a, DNS_MAX_ADDRS);
+	if (n > 1 && t->rotation) {
+		uint32_t tick = atomic_fetch_add_explicit(&t->rotation[r - t->recs], 1,
+			memory_order_relaxed);
+		dns_addrs_order(a, n, tick);
+	}
+	return n;
+}
+
+/* Writes v in decimal at p; returns the end. */
+static inline char *dns_put_uint(char *p, unsigned v)
+{
+	char d[10];
+	int n = 0;
+	do
+		d[n++] = (char)('0' + v % 10);
+	while ((v /= 10) > 0);
+	while (n > 0)
+		*p++ = d[--n];
+	return p;
+}
+
+/* Formats an address, with "/len" when it is a prefix. */
+static inline int dns_addr_format(uint8_t family, uint8_t prefix, const uint8_t *bytes,
+	char *out, size_t outsz)
+{
+	if (family != 6 && outsz >= sizeof("255.255.255.255/32")) {
+		/* By hand: inet_ntop() formats IPv4 through sprintf(). */
+		char *p = out;
+		for (int i = 0; i < 4; i++) {
+			if (i > 0)
+				*p++ = '.';
+			p = dns_put_uint(p, bytes[i]);
+		}
+		if (prefix < 32) {
+			*p++ = '/';
+			p = dns_put_uint(p, prefix);
+		}
+		*p = '\0';
+		return (int)(p - out);
+	}
+	char ip[INET6_ADDRSTRLEN];
+	if (!inet_ntop(family == 6 ? AF_INET6 : AF_INET, bytes, ip, sizeof(ip)))
+		return -1;
+	int w = prefix < dns_addr_bits(family) ? snprintf(out, outsz, "%s/%u", ip, prefix) :
+		snprintf(out, outsz, "%s", ip);
+	return w < 0 || (size_t)w >= outsz ? -1 : w;
+}
+
+/* Formats a[n], space separated; -1 if out is too small. */
+static inline int dns_addrs_answer(const dns_addr_t *a, int n, char *out, size_t outsz)
+{
+	size_t used = 0;
+	for (int i = 0; i < n; i++) {
+		if (i > 0 && used + 1 < outsz)
+			out[used++] = ' ';
+		int w = dns_addr_format(a[i].family, a[i].prefix, a[i].bytes, out + used,
+			outsz - used);
+		if (w < 0)
+			return -1;
+		used += (size_t)w;
+	}
+	return 0;
+}
+
+/* Formats a[n] as database lines for name; returns the length, -1 if out is too small. */
+static inline int dns_addrs_lines(const char *name, const dns_addr_t *a, int n, char *out,
+	size_t outsz)
+{
+	size_t name_len = strlen(name), used = 0;
+	for (int i = 0; i < n; i++) {
+		/* name, address, weight up to 5 digits, two spaces, newline */
+		if (outsz - used < name_len + MAX_IP + 8)
+			return -1;
+		memcpy(out + used, name, name_len);
+		used += name_len;
+		out[used++] = ' ';
+		int w = dns_addr_format(a[i].family, a[i].prefix, a[i].bytes, out + used, MAX_IP);
+		if (w < 0)
+			return -1;
+		char *p = out + used + w;
+		if (a[i].weight != 1) {
+			*p++ = ' ';
+			p = dns_put_uint(p, a[i].weight);
+		}
+		*p++ = '\n';
+		used = (size_t)(p - out);
+	}
+	return (int)used;
+}
+
+/*
+ * Formats r's addresses, space separated, in this answer's order. Returns
+ * -1 if the record is damaged or out is too small.
+ */
+static inline int dns_rec_answer(const dns_table_t *t, const dns_rec_t *r, char *out,
+	size_t outsz)
+{
+	dns_addr_t a[DNS_MAX_ADDRS];
+	int n = dns_rec_ordered(t, r, a);
+	return n > 0 ? dns_addrs_answer(a, n, out, outsz) : -1;
+}
+
+static inline int dns_rec_matches(const dns_table_t *t, const dns_rec_t *r, uint32_t h32,
+	const char *lower, size_t len)
+{
+	return r->hash == h32 && r->name_len == len &&
+		memcmp(dns_rec_name(t, r), lower, len) == 0;
+}
+
+/* Slot position distance from a hash's home bucket (Robin Hood probing). */
+static inline uint32_t dns_probe_dist(uint32_t hash, uint32_t pos, uint32_t mask)
+{
+	return (pos - hash) & mask;
+}
+
+/*
+ * Blocked Bloom filter: a name's hash picks one 512-bit block (one cache
+ * line) and DNS_BLOOM_K bits inside it, so a definite miss costs a single
+ * line no matter how large the table. At 10 bits per name about 1% of
+ * absent names get through to the index.
+ */
+#define DNS_BLOOM_BITS_PER_NAME 10
+#define DNS_BLOOM_K 7
+#define DNS_BLOOM_WORDS (DNS_ALIGN / sizeof(uint64_t))
+
+static inline const uint64_t *dns_bloom_block(const uint64_t *bloom, uint32_t blocks,
+	uint64_t h)
+{
+	return bloom + (size_t)dns_reduce((uint32_t)(h >> 32), blocks) * DNS_BLOOM_WORDS;
+}
+
+/* Bit i of a name's DNS_BLOOM_K, from 9-bit slices of a second mix of its hash. */
+static inline uint32_t dns_bloom_bit(uint64_t g, int i)
+{
+	return (uint32_t)(g >> (9 * i)) & 511;
+}
+
+/* 0 if the name with hash h is certainly absent. */
+static inline int dns_bloom_maybe(const dns_table_t *t, uint64_t h)
+{
+	if (!t->bloom)
+		return 1;
+	const uint64_t *blk = dns_bloom_block(t->bloom, t->bloom_blocks, h);
+	uint64_t g = dns_mix64(h ^ 0xB10011ull);
+	for (int i = 0; i < DNS_BLOOM_K; i++) {
+		uint32_t bit = dns_bloom_bit(g, i);
+		if (!(blk[bit >> 6] & (1ull << (bit & 63))))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Expected share of absent names the filter lets through: the mean over
+ * blocks of (set bits / 512)^k. Scans the filter; for stats, not lookups.
+ */
+static inline double dns_bloom_fpr(const dns_table_t *t)
+{
+	if (!t->bloom)
+		return 1.0;
+	double sum = 0;
+	for (uint32_t b = 0; b < t->bloom_blocks; b++) {
+		unsigned set = 0;
+		for (size_t w = 0; w < DNS_BLOOM_WORDS; w++)
+			set += (unsigned)__builtin_popcountll(t->bloom[b * DNS_BLOOM_WORDS + w]);
+		double p = set / (double)(DNS_BLOOM_WORDS * 64), pk = 1;
+		for (int i = 0; i < DNS_BLOOM_K; i++)
+			pk *= p;
+		sum += pk;
+	}
+	return sum / (double)t->bloom_blocks;
+}
+
+/*
+ * Case-insensitive exact lookup; NULL when the name is not in the table.
+ * *filtered (if given) is set when the Bloom filter alone ruled it out.
+ */
+static inline const dns_rec_t *dns_table_lookup(const dns_table_t *t, const char *name,
+	int *filtered)
+{
+	char lower[MAX_DOMAIN];
+	int len = dns_lower(name, lower);
+	if (len < 0 || t->hdr->count == 0)
+		return NULL;
+	uint64_t h = dns_hash64(lower, (size_t)len);
+	if (!dns_bloom_maybe(t, h)) {
+		if (filtered)
+			*filtered = 1;
+		return NULL;
+	}
+	uint32_t h32 = dns_hash32(h);
+
+	if (t->hdr->index_kind == DNS_INDEX_MPH) {
+		const uint32_t *disp = (const uint32_t *)t->index;
+		uint32_t d = disp[dns_mph_bucket(h, t->hdr->index_size)];
+		const dns_rec_t *r =
+			&t->recs[dns_mph_slot(h, d, t->hdr->mph_seed, t->hdr->count)];
+		return dns_rec_matches(t, r, h32, lower, (size_t)len) ? r : NULL;
+	}
+
+	const dns_slot_t *slots = (const dns_slot_t *)t->index;
+	uint32_t mask = t->hdr->index_size - 1;
+	uint32_t pos = h32 & mask;
+	for (uint32_t dist = 0;; dist++) {
+		const dns_slot_t *s = &slots[pos];
+		/* Robin Hood invariant: our key would have displaced a closer slot. */
+		if (s->hash == 0 || dns_probe_dist(s->hash, pos, mask) < dist)
+			return NULL;
+		if (s->hash == h32 && s->idx < t->hdr->count &&
+			dns_rec_matches(t, &t->recs[s->idx], h32, lower, (size_t)len))
+			return &t->recs[s->idx];
+		pos = (pos + 1) & mask;
+	}
+}
+
+static inline const dns_rec_t *dns_table_find(const dns_table_t *t, const char *name)
+{
+	return dns_table_lookup(t, name, NULL);
+}
+
+/* Child of node n whose label is s[0..len), or NULL. */
+static inline const dns_trie_node_t *dns_trie_child(const dns_table_t *t,
+	const dns_trie_node_t *n, const char *s, size_t len)
+{
+	uint32_t h = dns_hash32(dns_hash64(s, len));
+	uint32_t lo = n->child_first, hi = n->child_first + n->child_count;
+	if (hi > t->trie_nodes)
+		return NULL;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (t->trie[mid].label_hash < h)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < n->child_first + n->child_count && t->trie[lo].label_hash == h; lo++) {
+		const dns_trie_node_t *c = &t->trie[lo];
+		if (c->label_len == len &&
+			(uint64_t)c->label_off + len <= t->hdr->sec[DNS_SEC_STRINGS].size &&
+			memcmp(t->strings + c->label_off, s, len) == 0)
+			return c;
+	}
+	return NULL;
+}
+
+/*
+ * Longest wildcard suffix match: walks the query's labels right to left
+ * and returns the deepest "*.suffix" record that still leaves at least one
+ * label of the query to match the '*'. Cost is O(labels), independent of
+ * the table size.
+ */
+static inline const dns_rec_t *dns_table_find_wildcard(const dns_table_t *t, const char *name)
+{
+	if (t->trie_nodes == 0)
+		return NULL;
+	char lower[MAX_DOMAIN];
+	int len = dns_lower(name, lower);
+	if (len <= 0)
+		return NULL;
+
+	const dns_trie_node_t *node = &t->trie[0];
+	uint32_t best = DNS_NONE;
+	size_t end = (size_t)len;
+	while (end > 0) {
+		size_t start = end;
+		while (start > 0 && lower[start - 1] != '.')
+			start--;
+		node = dns_trie_child(t, node, lower + start, end - start);
+		if (!node)
+			break;
+		if (node->wildcard != DNS_NONE && start > 0)
+			best = node->wildcard;
+		if (start == 0)
+			break;
+		end = start - 1;
+	}
+	return best < t->hdr->count ? &t->recs[best] : NULL;
+}
+
+/* Exact match first, then the longest matching wildcard. */
+static inline const dns_rec_t *dns_table_resolve(const dns_table_t *t, const char *name)
+{
+	const dns_rec_t *r = dns_table_find(t, name);
+	return r ? r : dns_table_find_wildcard(t, name);
+}
+
+/* Parses an address; returns its family (4 or 6), 0 if it does not parse. */
+static inline uint8_t dns_parse_addr(const char *ip, uint8_t *out)
+{
+	if (inet_pton(AF_INET, ip, out) == 1)
+		return 4;
+	if (inet_pton(AF_INET6, ip, out) == 1)
+		return 6;
+	return 0;
+}
+
+static inline uint32_t dns_addr_bit(const uint8_t *a, uint32_t i)
+{
+	return (uint32_t)(a[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+/* First bit position in [from, max) where a and b differ, else max. */
+static inline uint32_t dns_addr_common(const uint8_t *a, const uint8_t *b, uint32_t from,
+	uint32_t max)
+{
+	uint32_t i = from;
+	while (i < max) {
+		if ((i & 7) == 0 && i + 8 <= max && a[i >> 3] == b[i >> 3]) {
+			i += 8;
+			continue;
+		}
+		if (dns_addr_bit(a, i) != dns_addr_bit(b, i))
+			break;
+		i++;
+	}
+	return i;
+}
+
+/*
+ * Walks the RADIX tree for the first bits of addr. Exact returns the node
+ * for precisely that prefix; otherwise the longest prefix in the table
+ * that covers it. Only nodes with owners are returned, NULL if none. Each
+ * bit of the address is compared once, so the cost is O(address bits).
+ */
+static inline const dns_radix_node_t *dns_radix_find(const dns_table_t *t, uint8_t family,
+	const uint8_t *addr, uint32_t bits, int exact)
+{
+	if (t->radix_nodes < 2)
+		return NULL;
+	const dns_radix_node_t *n = &t->radix[family == 6];
+	const dns_radix_node_t *best = NULL;
+	uint64_t key_end = t->hdr->sec[DNS_SEC_ADDRS].size;
+	uint32_t from = 0;
+	for (;;) {
+		if (n->bits > bits || (uint64_t)n->key_off + dns_addr_bits(family) / 8 > key_end)
+			break;
+		if (dns_addr_common(t->addrs + n->key_off, addr, from, n->bits) < n->bits)
+			break;
+		if (n->name_count > 0 && (!exact || n->bits == bits))
+			best = n;
+		if (n->bits == bits)
+			break;
+		uint32_t c = n->child[dns_addr_bit(addr, n->bits)];
+		if (c >= t->radix_nodes || t->radix[c].bits <= n->bits)
+			break;
+		from = n->bits;
+		n = &t->radix[c];
+	}
+	return best;
+}
+
+/* Parses a weight, plain digits up to 65535 ("-1" would wrap under %u); 0 or -1. */
+static inline int dns_parse_weight(const char *text, uint16_t *weight)
+{
+	if (!isdigit((unsigned char)text[0]))
+		return -1;
+	char *end = NULL;
+	errno = 0;
+	unsigned long v = strtoul(text, &end, 10);
+	if (*end != '\0' || errno != 0 || v > UINT16_MAX)
+		return -1;
+	*weight = (uint16_t)v;
+	return 0;
+}
+
+/* Parses "ip" or "ip/len"; zeroes the bits past the prefix. Returns the family or 0. */
+static inline uint8_t dns_parse_prefix(const char *text, uint8_t *out, uint8_t *prefix)
+{
+	char ip[MAX_IP];
+	const char *slash = strchr(text, '/');
+	size_t len = slash ? (size_t)(slash - text) : strlen(text);
+	if (len >= sizeof(ip))
+		return 0;
+	memcpy(ip, text, len);
+	ip[len] = '\0';
+	uint8_t family = dns_parse_addr(ip, out);
+	if (family == 0)
+		return 0;
+	uint32_t bits = dns_addr_bits(family);
+	if (slash) {
+		char *end;
+		unsigned long v = strtoul(slash + 1, &end, 10);
+		if (slash[1] < '0' || slash[1] > '9' || *end != '\0' || v > bits)
+			return 0;
+		bits = (uint32_t)v;
+	}
+	for (uint32_t i = bits; i < dns_addr_bits(family); i++)
+		out[i >> 3] &= (uint8_t)~(0x80u >> (i & 7));
+	*prefix = (uint8_t)bits;
+	return family;
+}
+
+/*
+ * Reverse lookups. PTR ("ip" or "ip/len") lists the names that own exactly
+ * that address or prefix; CIDR lists the owners of the longest prefix that
+ * covers it, after the prefix itself. Writes "<query> [prefix] names..."
+ * into out, cut short with " ..." when out fills. Returns 0, -1 when
+ * nothing matches, -2 when the query does not parse.
+ */
+static inline int dns_table_reverse(const dns_table_t *t, const char *query, int cidr,
+	char *out, size_t outsz)
+{
+	uint8_t addr[16] = {0};
+	uint8_t prefix;
+	uint8_t family = dns_parse_prefix(query, addr, &prefix);
+	if (family == 0)
+		return -2;
+	const dns_radix_node_t *n = dns_radix_find(t, family, addr, prefix, !cidr);
+	if (!n)
+		return -1;
+
+	int w = snprintf(out, outsz, "%s", query);
+	if (w < 0 || (size_t)w >= outsz)
+		return -1;
+	size_t used = (size_t)w;
+	if (cidr) {
+		out[used++] = ' ';
+		w = dns_addr_format(family, (uint8_t)n->bits, t->addrs + n->key_off, out + used,
+			outsz - used);
+		if (w < 0)
+			return -1;
+		used += (size_t)w;
+	}
+	for (uint32_t i = 0; i < n->name_count; i++) {
+		uint64_t k = (uint64_t)n->name_first + i;
+		if (k >= t->rnames_count || t->rnames[k] >= t->hdr->count)
+			break;
+		const dns_rec_t *r = &t->recs[t->rnames[k]];
+		if (used + 1 + r->name_len + 4 >= outsz) {
+			memcpy(out + used, " ...", 5);
+			return 0;
+		}
+		out[used++] = ' ';
+		memcpy(out + used, dns_rec_name(t, r), r->name_len);
+		used += r->name_len;
+	}
+	out[used] = '\0';
+	return 0;
+}
+
+/* Points t at a blob after checking that every section lies inside it. */
+static inline int dns_table_attach(dns_table_t *t, uint8_t *base, size_t size, int mapped)
+{
+	const dns_hdr_t *h = (const dns_hdr_t *)base;
+	if (size < sizeof(*h) || h->magic != DNS_IMAGE_MAGIC || h->version != DNS_IMAGE_VERSION)
+		return -1;
+	if (h->total_size > size)
+		return -1;
+	for (int i = 0; i < DNS_SEC_MAX; i++) {
+		if (h->sec[i].off > h->total_size || h->sec[i].size > h->total_size - h->sec[i].off)
+			return -1;
+		if (h->sec[i].off % DNS_ALIGN != 0)
+			return -1;
+	}
+	if (h->sec[DNS_SEC_RECS].size != (uint64_t)h->count * sizeof(dns_rec_t))
+		return -1;
+	if (h->sec[DNS_SEC_TRIE].size % sizeof(dns_trie_node_t) != 0 ||
+		h->sec[DNS_SEC_TRIE].size / sizeof(dns_trie_node_t) > UINT32_MAX)
+		return -1;
+	if (h->sec[DNS_SEC_RADIX].size % sizeof(dns_radix_node_t) != 0 ||
+		h->sec[DNS_SEC_RADIX].size / sizeof(dns_radix_node_t) > UINT32_MAX ||
+		h->sec[DNS_SEC_RNAMES].size % sizeof(uint32_t) != 0 ||
+		h->sec[DNS_SEC_RNAMES].size / sizeof(uint32_t) > UINT32_MAX ||
+		h->sec[DNS_SEC_BLOOM].size % DNS_ALIGN != 0 ||
+		h->sec[DNS_SEC_BLOOM].size / DNS_ALIGN > UINT32_MAX)
+		return -1;
+	if (h->index_kind == DNS_INDEX_RH) {
+		if (h->index_size == 0 || (h->index_size & (h->index_size - 1)) != 0 ||
+			h->sec[DNS_SEC_INDEX].size != (uint64_t)h->index_size * sizeof(dns_slot_t))
+			return -1;
+	} else if (h->index_kind == DNS_INDEX_MPH) {
+		if (h->index_size == 0 ||
+			h->sec[DNS_SEC_INDEX].size != (uint64_t)h->index_size * sizeof(uint32_t))
+			return -1;
+	} else {
+		return -1;
+	}
+
+	memset(t, 0, sizeof(*t));
+	t->base = base;
+	t->size = size;
+	t->mapped = mapped;
+	t->fd = -1;
+	t->hdr = h;
+	t->recs = (const dns_rec_t *)(base + h->sec[DNS_SEC_RECS].off);
+	t->index = base + h->sec[DNS_SEC_INDEX].off;
+	t->strings = (const char *)(base + h->sec[DNS_SEC_STRINGS].off);
+	t->addrs = base + h->sec[DNS_SEC_ADDRS].off;
+	t->trie = (const dns_trie_node_t *)(base + h->sec[DNS_SEC_TRIE].off);
+	t->trie_nodes = (uint32_t)(h->sec[DNS_SEC_TRIE].size / sizeof(dns_trie_node_t));
+	t->radix = (const dns_radix_node_t *)(base + h->sec[DNS_SEC_RADIX].off);
+	t->radix_nodes = (uint32_t)(h->sec[DNS_SEC_RADIX].size / sizeof(dns_radix_node_t));
+	t->rnames = (const uint32_t *)(base + h->sec[DNS_SEC_RNAMES].off);
+	t->rnames_count = (uint32_t)(h->sec[DNS_SEC_RNAMES].size / sizeof(uint32_t));
+	t->bloom_blocks = (uint32_t)(h->sec[DNS_SEC_BLOOM].size / DNS_ALIGN);
+	if (t->bloom_blocks)
+		t->bloom = (const uint64_t *)(base + h->sec[DNS_SEC_BLOOM].off);
+	return 0;
+}
+
+static inline void dns_table_free(dns_table_t *t)
+{
+	free((void *)t->rotation);
+	if (!t->base)
+		return;
+	if (t->mapped)
+		munmap(t->base, t->size);
+	else
+		free(t->base);
+	if (t->fd >= 0)
+		close(t->fd);
+	memset(t, 0, sizeof(*t));
+}
+
+/* ---- text database staging ---- */
+
+/*
+ * One parsed line, 24 bytes: the address is binary and the name is an id
+ * into the staging arena, where every distinct (lowercased) name is stored
+ * once. Name ids become record indexes, and the arena becomes STRINGS.
+ */
+typedef struct {
+	uint32_t name;
+	uint16_t weight;
+	uint8_t family;
+	uint8_t prefix;
+	uint8_t addr[16];
+} entry_t;
+
+typedef struct {
+	entry_t *v;
+	size_t count;
+	size_t cap;
+	size_t bad; /* lines whose address or name did not parse */
+	char *arena; /* lowercased names, NUL terminated */
+	size_t arena_used;
+	size_t arena_cap;
+	uint32_t *name_off; /* per name id, into arena */
+	uint32_t *name_hash; /* per name id, dns_hash32() */
+	uint32_t names;
+	size_t names_cap;
+	uint32_t *slots; /* name id + 1, 0 when empty; at most half full */
+	uint32_t slot_mask;
+} dns_entries_t;
+
+static inline void *dns_grow(void *p, size_t *cap, size_t want, size_t elem)
+{
+	if (want <= *cap)
+		return p;
+	size_t n = *cap ? *cap : 16;
+	while (n < want)
+		n *= 2;
+	p = realloc(p, n * elem);
+	if (!p)
+		dns_die("realloc");
+	*cap = n;
+	return p;
+}
+
+/* Rebuilds the name slots big enough for names names at half load. */
+static inline void dns_entries_rehash(dns_entries_t *e, uint64_t names)
+{
+	uint64_t nslots = e->slots ? ((uint64_t)e->slot_mask + 1) * 2 : 1024;
+	while (nslots < names * 2)
+		nslots *= 2;
+	free(e->slots);
+	e->slots = (uint32_t *)calloc((size_t)nslots, sizeof(uint32_t));
+	if (!e->slots)
+		dns_die("calloc names");
+	e->slot_mask = (uint32_t)(nslots - 1);
+	for (uint32_t id = 0; id < e->names; id++) {
+		uint32_t pos = e->name_hash[id] & e->slot_mask;
+		while (e->slots[pos])
+			pos = (pos + 1) & e->slot_mask;
+		e->slots[pos] = id + 1;
+	}
+}
+
+/* Id of a lowercased name with hash h32, adding it to the arena the first time. */
+static inline uint32_t dns_entries_intern(dns_entries_t *e, const char *lower, size_t len,
+	uint32_t h32)
+{
+	if (!e->slots || (uint64_t)(e->names + 1) * 2 > (uint64_t)e->slot_mask + 1)
+		dns_entries_rehash(e, (uint64_t)e->names + 1);
+	uint32_t pos = h32 & e->slot_mask;
+	for (; e->slots[pos]; pos = (pos + 1) & e->slot_mask) {
+		uint32_t id = e->slots[pos] - 1;
+		if (e->name_hash[id] == h32 && memcmp(e->arena + e->name_off[id], lower, len + 1) == 0)
+			return id;
+	}
+
+	if (e->arena_used + len + 1 > UINT32_MAX || e->names >= UINT32_MAX / 2) {
+		fprintf(stderr, "too many records\n");
+		exit(EXIT_FAILURE);
+	}
+	e->arena = (char *)dns_grow(e->arena, &e->arena_cap, e->arena_used + len + 1, 1);
+	if (e->names == e->names_cap) {
+		size_t cap = e->names_cap;
+		e->name_off = (uint32_t *)dns_grow(e->name_off, &cap, (size_t)e->names + 1,
+			sizeof(uint32_t));
+		e->name_hash = (uint32_t *)dns_grow(e->name_hash, &e->names_cap,
+			(size_t)e->names + 1, sizeof(uint32_t));
+	}
+
+	uint32_t id = e->names++;
+	e->name_off[id] = (uint32_t)e->arena_used;
+	e->name_hash[id] = h32;
+	memcpy(e->arena + e->arena_used, lower, len + 1);
+	e->arena_used += len + 1;
+	e->slots[pos] = id + 1;
+	return id;
+}
+
+static inline uint32_t dns_entries_name(dns_entries_t *e, const char *lower, size_t len)
+{
+	return dns_entries_intern(e, lower, len, dns_hash32(dns_hash64(lower, len)));
+}
+
+/* Stages one line; counts it in e->bad when the name or address is unusable. */
+static inline void dns_entries_add(dns_entries_t *e, const char *domain, const char *ip,
+	uint16_t weight)
+{
+	entry_t en;
+	char lower[MAX_DOMAIN];
+	int len = dns_lower(domain, lower);
+	memset(&en, 0, sizeof(en));
+	en.family = dns_parse_prefix(ip, en.addr, &en.prefix);
+	if (len <= 0 || en.family == 0) {
+		e->bad++;
+		return;
+	}
+	en.name = dns_entries_name(e, lower, (size_t)len);
+	en.weight = weight;
+	e->v = (entry_t *)dns_grow(e->v, &e->cap, e->count + 1, sizeof(entry_t));
+	e->v[e->count++] = en;
+}
+
+static inline void dns_entries_free(dns_entries_t *e)
+{
+	free(e->v);
+	free(e->arena);
+	free(e->name_off);
+	free(e->name_hash);
+	free(e->slots);
+	memset(e, 0, sizeof(*e));
+}
+
+/* Where a text load spent its time, for the loaders' startup lines. */
+typedef struct {
+	int threads;
+	size_t bytes;
+	double map_ms, parse_ms, merge_ms, build_ms;
+} dns_load_stats_t;
+
+static inline double dns_clock_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+/*
+ * "domain ip [weight]" per line; a name may appear on several lines, once
+ * per address. The address may be a prefix ("10.1.0.0/16"), which is
+ * answered as written and matched by CIDR lookups. Weight defaults to 1.
+ * Blank lines and '#' comments are skipped, as is anything past 511
+ * characters on a line; a line without an address or with a weight that
+ * is not 0-65535 is counted in e->bad.
+ */
+static inline void dns_entries_parse(dns_entries_t *e, const char *p, const char *end)
+{
+	char line[512];
+	while (p < end) {
+		const char *nl = (const char *)memchr(p, '\n', (size_t)(end - p));
+		const char *eol = nl ? nl : end;
+		size_t n = (size_t)(eol - p);
+		if (n >= sizeof(line))
+			n = sizeof(line) - 1;
+		memcpy(line, p, n);
+		line[n] = '\0';
+		p = eol + 1;
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		char domain[MAX_DOMAIN];
+		char ip[MAX_IP], wtext[16];
+		uint16_t weight = 1;
+		int fields = sscanf(line, "%255s %63s %15s", domain, ip, wtext);
+		if (fields < 1)
+			continue; /* only blanks */
+		if (fields < 2 || (fields == 3 && dns_parse_weight(wtext, &weight) != 0))
+			e->bad++;
+		else
+			dns_entries_add(e, domain, ip, weight);
+	}
+}
+
+/* Makes room for more names, arena bytes and lines without regrowing. */
+static inline void dns_entries_reserve(dns_entries_t *e, size_t names, size_t arena,
+	size_t lines)
+{
+	e->arena = (char *)dns_grow(e->arena, &e->arena_cap, e->arena_used + arena, 1);
+	size_t cap = e->names_cap;
+	e->name_off = (uint32_t *)dns_grow(e->name_off, &cap, (size_t)e->names + names,
+		sizeof(uint32_t));
+	e->name_hash = (uint32_t *)dns_grow(e->name_hash, &e->names_cap, (size_t)e->names + names,
+		sizeof(uint32_t));
+	e->v = (entry_t *)dns_grow(e->v, &e->cap, e->count + lines, sizeof(entry_t));
+	uint64_t want = (uint64_t)e->names + names;
+	if (!e->slots || want * 2 > (uint64_t)e->slot_mask + 1)
+		dns_entries_rehash(e, want);
+}
+
+/*
+ * Appends part's lines to e, renumbering its names into e's arena; part
+ * is freed. Names keep their order of first appearance, so merging chunks
+ * in file order stages exactly what one pass over the file would.
+ */
+static inline void dns_entries_merge(dns_entries_t *e, dns_entries_t *part)
+{
+	uint32_t *map = (uint32_t *)malloc(((size_t)part->names + 1) * sizeof(uint32_t));
+	if (!map)
+		dns_die("malloc merge");
+	for (uint32_t id = 0; id < part->names; id++) {
+		const char *name = part->arena + part->name_off[id];
+		map[id] = dns_entries_intern(e, name, strlen(name), part->name_hash[id]);
+	}
+	e->v = (entry_t *)dns_grow(e->v, &e->cap, e->count + part->count, sizeof(entry_t));
+	for (size_t i = 0; i < part->count; i++) {
+		entry_t en = part->v[i];
+		en.name = map[en.name];
+		e->v[e->count++] = en;
+	}
+	e->bad += part->bad;
+	free(map);
+	dns_entries_free(part);
+}
+
+#define DNS_LOAD_CHUNK_MIN (4u << 20) /* smaller files are parsed on one thread */
+#define DNS_LOAD_THREADS_MAX 64
+
+typedef struct {
+	dns_entries_t e;
+	const char *p, *end;
+} dns_load_chunk_t;
+
+static inline void *dns_load_chunk_run(void *arg)
+{
+	dns_load_chunk_t *c = (dns_load_chunk_t *)arg;
+	dns_entries_parse(&c->e, c->p, c->end);
+	return NULL;
+}
+
+/*
+ * Maps the file and parses newline-aligned chunks of it on up to threads
+ * threads (0: one per online CPU), each into its own staging, then merges
+ * them in file order. stats, if given, receives the timing breakdown.
+ */
+static inline int dns_entries_load_parallel(dns_entries_t *e, const char *path, int threads,
+	dns_load_stats_t *stats)
+{
+	double t0 = dns_clock_ms();
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	size_t size = (size_t)st.st_size;
+	const char *data = NULL;
+	if (size > 0) {
+		void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		madvise(m, size, MADV_WILLNEED);
+		data = (const char *)m;
+	}
+	close(fd);
+
+	if (threads <= 0)
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > DNS_LOAD_THREADS_MAX)
+		threads = DNS_LOAD_THREADS_MAX;
+	if ((size_t)threads > size / DNS_LOAD_CHUNK_MIN)
+		threads = (int)(size / DNS_LOAD_CHUNK_MIN);
+	if (threads < 1)
+		threads = 1;
+	double t1 = dns_clock_ms();
+
+	/* Chunk i starts just past the first newline at or after i * size / threads. */
+	dns_load_chunk_t *chunk = (dns_load_chunk_t *)calloc((size_t)threads, sizeof(*chunk));
+	pthread_t *tid = (pthread_t *)calloc((size_t)threads, sizeof(pthread_t));
+	if (!chunk || !tid)
+		dns_die("calloc load");
+	const char *end = data + size;
+	for (int i = 0; i < threads; i++) {
+		chunk[i].p = i == 0 ? data : chunk[i - 1].end;
+		const char *cut = data + size / (size_t)threads * (size_t)(i + 1);
+		if (i == threads - 1 || cut <= chunk[i].p) {
+			cut = i == threads - 1 ? end : chunk[i].p;
+		} else {
+			const char *nl = (const char *)memchr(cut - 1, '\n', (size_t)(end - cut + 1));
+			cut = nl ? nl + 1 : end;
+		}
+		chunk[i].end = cut;
+	}
+	chunk[0].e = *e;
+	for (int i = 1; i < threads; i++) {
+		if (pthread_create(&tid[i], NULL, dns_load_chunk_run, &chunk[i]) != 0)
+			dns_die("pthread_create");
+	}
+	dns_load_chunk_run(&chunk[0]);
+	for (int i = 1; i < threads; i++)
+		pthread_join(tid[i], NULL);
+	double t2 = dns_clock_ms();
+
+	*e = chunk[0].e;
+	size_t names = 0, arena = 0, lines = 0;
+	for (int i = 1; i < threads; i++) {
+		names += chunk[i].e.names;
+		arena += chunk[i].e.arena_used;
+		lines += chunk[i].e.count;
+	}
+	if (threads > 1)
+		dns_entries_reserve(e, names, arena, lines);
+	for (int i = 1; i < threads; i++)
+		dns_entries_merge(e, &chunk[i].e);
+	free(tid);
+	free(chunk);
+	if (data)
+		munmap((void *)data, size);
+	double t3 = dns_clock_ms();
+
+	if (stats) {
+		stats->threads = threads;
+		stats->bytes = size;
+		stats->map_ms = t1 - t0;
+		stats->parse_ms = t2 - t1;
+		stats->merge_ms = t3 - t2;
+	}
+	return 0;
+}
+
+static inline int dns_entries_load(dns_entries_t *e, const char *path)
+{
+	return dns_entries_load_parallel(e, path, 0, NULL);
+}
+
+/* ---- building ---- */
+
+/* Lays out sections for the given capacities; returns the blob size. */
+static inline uint64_t dns_layout(dns_hdr_t *h, uint64_t recs, uint64_t index_bytes,
+	uint64_t strings, uint64_t addrs)
+{
+	uint64_t off = dns_align(sizeof(dns_hdr_t));
+	uint64_t sizes[DNS_SEC_MAX] = {0};
+	sizes[DNS_SEC_RECS] = recs * sizeof(dns_rec_t);
+	sizes[DNS_SEC_INDEX] = index_bytes;
+	sizes[DNS_SEC_STRINGS] = strings;
+	sizes[DNS_SEC_ADDRS] = addrs;
+	for (int i = 0; i < DNS_SEC_MAX; i++) {
+		h->sec[i].off = off;
+		h->sec[i].size = sizes[i];
+		off = dns_align(off + sizes[i]);
+	}
+	h->total_size = off;
+	return off;
+}
+
+static inline uint8_t *dns_blob_alloc(uint64_t size)
+{
+	uint8_t *p = (uint8_t *)calloc(1, (size_t)size);
+	if (!p)
+		dns_die("calloc table");
+	return p;
+}
+
+/* Grows the blob by one trailing section; returns the (moved) blob. */
+static inline uint8_t *dns_blob_append(uint8_t *base, dns_hdr_t *h, int sec, const void *data,
+	uint64_t size)
+{
+	uint64_t off = h->total_size;
+	uint8_t *p = (uint8_t *)realloc(base, (size_t)dns_align(off + size));
+	if (!p)
+		dns_die("realloc table");
+	memcpy(p + off, data, (size_t)size);
+	memset(p + off + size, 0, (size_t)(dns_align(off + size) - off - size));
+	h->sec[sec].off = off;
+	h->sec[sec].size = size;
+	h->total_size = dns_align(off + size);
+	return p;
+}
+
+typedef struct {
+	uint32_t label_off;
+	uint32_t label_len;
+	uint32_t label_hash;
+	uint32_t wildcard;
+	uint32_t *children;
+	uint32_t nchildren;
+	uint32_t parent;
+} dns_tnode_t;
+
+static inline int dns_tnode_cmp_hash(const void *a, const void *b, void *nodes)
+{
+	uint32_t ha = ((const dns_tnode_t *)nodes)[*(const uint32_t *)a].label_hash;
+	uint32_t hb = ((const dns_tnode_t *)nodes)[*(const uint32_t *)b].label_hash;
+	return ha < hb ? -1 : ha > hb;
+}
+
+/*
+ * Builds the TRIE section for every "*.suffix" record. Label text is not
+ * copied: nodes point at the labels inside the wildcard names in STRINGS.
+ * Returns a malloc'd node array (NULL and *count 0 when there are no
+ * wildcards).
+ */
+static inline dns_trie_node_t *dns_trie_build(const dns_rec_t *recs, uint32_t count,
+	const char *strings, uint32_t *out_count)
+{
+	/* Upper bound on nodes: the root plus one per wildcard label. */
+	uint64_t max_nodes = 1;
+	for (uint32_t i = 0; i < count; i++) {
+		const char *name = strings + recs[i].name_off;
+		if (recs[i].name_len >= 3 && name[0] == '*' && name[1] == '.') {
+			for (uint32_t k = 1; k < recs[i].name_len; k++)
+				max_nodes += name[k] == '.';
+		}
+	}
+	*out_count = 0;
+	if (max_nodes == 1)
+		return NULL;
+
+	dns_tnode_t *tn = (dns_tnode_t *)calloc((size_t)max_nodes, sizeof(dns_tnode_t));
+	/* (parent, label) -> node, so wide levels stay linear to build. */
+	uint64_t mcap = 16;
+	while (mcap < max_nodes * 2)
+		mcap *= 2;
+	uint32_t *map = (uint32_t *)malloc((size_t)mcap * sizeof(uint32_t));
+	if (!tn || !map)
+		dns_die("calloc trie");
+	memset(map, 0xFF, (size_t)mcap * sizeof(uint32_t));
+	tn[0].wildcard = DNS_NONE;
+	uint32_t ntn = 1;
+
+	for (uint32_t i = 0; i < count; i++) {
+		const char *name = strings + recs[i].name_off;
+		size_t len = recs[i].name_len;
+		if (len < 3 || name[0] != '*' || name[1] != '.')
+			continue;
+
+		uint32_t cur = 0;
+		size_t end = len;
+		while (end > 2) {
+			size_t start = end;
+			while (start > 2 && name[start - 1] != '.')
+				start--;
+			uint32_t lh = dns_hash32(dns_hash64(name + start, end - start));
+			uint64_t pos = dns_mix64(((uint64_t)cur << 32) | lh) & (mcap - 1);
+			uint32_t next = DNS_NONE;
+			for (; map[pos] != DNS_NONE; pos = (pos + 1) & (mcap - 1)) {
+				const dns_tnode_t *c = &tn[map[pos]];
+				if (c->parent == cur && c->label_hash == lh && c->label_len == end - start &&
+					memcmp(strings + c->label_off, name + start, end - start) == 0) {
+					next = map[pos];
+					break;
+				}
+			}
+			if (next == DNS_NONE) {
+				next = ntn++;
+				map[pos] = next;
+				tn[next].label_off = recs[i].name_off + (uint32_t)start;
+				tn[next].label_len = (uint32_t)(end - start);
+				tn[next].label_hash = lh;
+				tn[next].wildcard = DNS_NONE;
+				tn[next].parent = cur;
+				tn[cur].nchildren++;
+			}
+			cur = next;
+			end = start > 2 ? start - 1 : 2;
+		}
+		if (tn[cur].wildcard == DNS_NONE)
+			tn[cur].wildcard = i;
+	}
+	free(map);
+
+	/* Gather each node's children into one array, then sort by hash. */
+	uint32_t *child_ix = (uint32_t *)malloc((size_t)ntn * sizeof(uint32_t));
+	if (!child_ix)
+		dns_die("malloc trie");
+	uint32_t fill = 0;
+	for (uint32_t k = 0; k < ntn; k++) {
+		tn[k].children = child_ix + fill;
+		fill += tn[k].nchildren;
+		tn[k].nchildren = 0;
+	}
+	for (uint32_t k = 1; k < ntn; k++) {
+		dns_tnode_t *parent = &tn[tn[k].parent];
+		parent->children[parent->nchildren++] = k;
+	}
+	/* Breadth-first flattening: each node's children become one block. */
+	dns_trie_node_t *out = (dns_trie_node_t *)calloc(ntn, sizeof(dns_trie_node_t));
+	uint32_t *queue = (uint32_t *)malloc(ntn * sizeof(uint32_t));
+	if (!out || !queue)
+		dns_die("calloc trie");
+	uint32_t head = 0, tail = 0;
+	queue[tail++] = 0;
+	while (head < tail) {
+		uint32_t at = head;
+		dns_tnode_t *n = &tn[queue[head++]];
+		qsort_r(n->children, n->nchildren, sizeof(uint32_t), dns_tnode_cmp_hash, tn);
+		out[at].label_hash = n->label_hash;
+		out[at].label_off = n->label_off;
+		out[at].label_len = n->label_len;
+		out[at].wildcard = n->wildcard;
+		out[at].child_first = tail;
+		out[at].child_count = n->nchildren;
+		for (uint32_t k = 0; k < n->nchildren; k++)
+			queue[tail++] = n->children[k];
+	}
+	free(queue);
+	free(child_ix);
+	free(tn);
+	*out_count = ntn;
+	return out;
+}
+
+/* Builds the TRIE for the records already in the blob and appends it. */
+static inline uint8_t *dns_blob_add_trie(uint8_t *base, dns_hdr_t *h)
+{
+	uint32_t nodes = 0;
+	const dns_rec_t *recs = (const dns_rec_t *)(base + h->sec[DNS_SEC_RECS].off);
+	const char *strings = (const char *)(base + h->sec[DNS_SEC_STRINGS].off);
+	dns_trie_node_t *trie = dns_trie_build(recs, h->count, strings, &nodes);
+	if (trie) {
+		base = dns_blob_append(base, h, DNS_SEC_TRIE, trie,
+			(uint64_t)nodes * sizeof(dns_trie_node_t));
+		free(trie);
+	}
+	return base;
+}
+
+static inline uint32_t dns_radix_new(dns_radix_node_t *nodes, uint32_t *used, uint32_t key_off,
+	uint32_t bits)
+{
+	dns_radix_node_t *n = &nodes[(*used)++];
+	n->key_off = key_off;
+	n->bits = bits;
+	n->child[0] = n->child[1] = DNS_NONE;
+	return (uint32_t)(n - nodes);
+}
+
+/* Node for exactly key/bits under root, splitting an edge if needed. */
+static inline uint32_t dns_radix_insert(dns_radix_node_t *nodes, uint32_t *used,
+	const uint8_t *addrs, uint32_t root, uint32_t key_off, uint32_t bits)
+{
+	const uint8_t *key = addrs + key_off;
+	uint32_t cur = root;
+	for (;;) {
+		if (nodes[cur].bits == bits) {
+			if (nodes[cur].name_count == 0)
+				nodes[cur].key_off = key_off; /* was a branch: exact key now */
+			return cur;
+		}
+		uint32_t b = dns_addr_bit(key, nodes[cur].bits);
+		uint32_t c = nodes[cur].child[b];
+		if (c == DNS_NONE) {
+			uint32_t leaf = dns_radix_new(nodes, used, key_off, bits);
+			nodes[cur].child[b] = leaf;
+			return leaf;
+		}
+		const uint8_t *ckey = addrs + nodes[c].key_off;
+		uint32_t cbits = nodes[c].bits;
+		uint32_t common = dns_addr_common(ckey, key, nodes[cur].bits,
+			cbits < bits ? cbits : bits);
+		if (common == cbits) {
+			cur = c;
+			continue;
+		}
+		/* The edge to c diverges at bit common: put a node there. */
+		uint32_t m = dns_radix_new(nodes, used, key_off, common);
+		nodes[m].child[dns_addr_bit(ckey, common)] = c;
+		nodes[cur].child[b] = m;
+		if (common == bits)
+			return m;
+		uint32_t leaf = dns_radix_new(nodes, used, key_off, bits);
+		nodes[m].child[dns_addr_bit(key, common)] = leaf;
+		return leaf;
+	}
+}
+
+/*
+ * Builds the RADIX and RNAMES sections for the records already in the blob
+ * and appends them. Owners of each prefix are listed in record order.
+ */
+static inline uint8_t *dns_blob_add_radix(uint8_t *base, dns_hdr_t *h)
+{
+	const dns_rec_t *recs = (const dns_rec_t *)(base + h->sec[DNS_SEC_RECS].off);
+	const uint8_t *addrs = base + h->sec[DNS_SEC_ADDRS].off;
+	uint64_t total = 0;
+	for (uint32_t r = 0; r < h->count; r++)
+		total += recs[r].addr_count;
+	if (total == 0)
+		return base;
+
+	/* Each address adds at most a leaf and a branch. */
+	dns_radix_node_t *nodes =
+		(dns_radix_node_t *)calloc((size_t)(2 + total * 2), sizeof(dns_radix_node_t));
+	uint32_t *owner = (uint32_t *)malloc((size_t)total * sizeof(uint32_t));
+	uint32_t *rnames = (uint32_t *)malloc((size_t)total * sizeof(uint32_t));
+	if (!nodes || !owner || !rnames)
+		dns_die("calloc radix");
+	uint32_t used = 0;
+	dns_radix_new(nodes, &used, 0, 0); /* IPv4 root */
+	dns_radix_new(nodes, &used, 0, 0); /* IPv6 root */
+
+	uint64_t k = 0;
+	for (uint32_t r = 0; r < h->count; r++) {
+		uint64_t off = recs[r].addr_off;
+		for (uint16_t j = 0; j < recs[r].addr_count; j++, k++) {
+			uint32_t n = dns_radix_insert(nodes, &used, addrs, addrs[off] == 6,
+				(uint32_t)(off + DNS_ADDR_HDR), addrs[off + 1]);
+			nodes[n].name_count++;
+			owner[k] = n;
+			off += dns_addr_size(addrs[off]);
+		}
+	}
+
+	/* Counting sort of owners by node; name_count doubles as the cursor. */
+	uint32_t first = 0;
+	for (uint32_t n = 0; n < used; n++) {
+		nodes[n].name_first = first;
+		first += nodes[n].name_count;
+		nodes[n].name_count = 0;
+	}
+	k = 0;
+	for (uint32_t r = 0; r < h->count; r++) {
+		for (uint16_t j = 0; j < recs[r].addr_count; j++, k++) {
+			dns_radix_node_t *n = &nodes[owner[k]];
+			rnames[n->name_first + n->name_count++] = r;
+		}
+	}
+
+	base = dns_blob_append(base, h, DNS_SEC_RADIX, nodes,
+		(uint64_t)used * sizeof(dns_radix_node_t));
+	base = dns_blob_append(base, h, DNS_SEC_RNAMES, rnames, total * sizeof(uint32_t));
+	free(rnames);
+	free(owner);
+	free(nodes);
+	return base;
+}
+
+/* Appends the BLOOM section over every record name. */
+static inline uint8_t *dns_blob_add_bloom(uint8_t *base, dns_hdr_t *h)
+{
+	uint32_t blocks = (uint32_t)(((uint64_t)h->count * DNS_BLOOM_BITS_PER_NAME + 511) / 512);
+	if (blocks == 0)
+		return base;
+	uint64_t *bloom = (uint64_t *)calloc(blocks, DNS_ALIGN);
+	if (!bloom)
+		dns_die("calloc bloom");
+	const dns_rec_t *recs = (const dns_rec_t *)(base + h->sec[DNS_SEC_RECS].off);
+	const char *strings = (const char *)(base + h->sec[DNS_SEC_STRINGS].off);
+	for (uint32_t i = 0; i < h->count; i++) {
+		uint64_t hash = dns_hash64(strings + recs[i].name_off, recs[i].name_len);
+		uint64_t *blk = (uint64_t *)dns_bloom_block(bloom, blocks, hash);
+		uint64_t g = dns_mix64(hash ^ 0xB10011ull);
+		for (int k = 0; k < DNS_BLOOM_K; k++) {
+			uint32_t bit = dns_bloom_bit(g, k);
+			blk[bit >> 6] |= 1ull << (bit & 63);
+		}
+	}
+	base = dns_blob_append(base, h, DNS_SEC_BLOOM, bloom, (uint64_t)blocks * DNS_ALIGN);
+	free(bloom);
+	return base;
+}
+
+/*
+ * Moves a finished blob to DNS_ALIGN-aligned memory, so sections start on
+ * cache lines (realloc only promises 16 bytes) and each Bloom block is one
+ * line. Returns the blob to attach.
+ */
+static inline uint8_t *dns_blob_finish(uint8_t *base, const dns_hdr_t *h)
+{
+	memcpy(base, h, sizeof(*h));
+	if ((uintptr_t)base % DNS_ALIGN == 0)
+		return base;
+	void *p = NULL;
+	if (posix_memalign(&p, DNS_ALIGN, (size_t)h->total_size) != 0)
+		dns_die("posix_memalign table");
+	memcpy(p, base, (size_t)h->total_size);
+	free(base);
+	return (uint8_t *)p;
+}
+
+/*
+ * Builds an in-memory table with a Robin Hood index from staged text
+ * entries. Each distinct name is one record and every line for it adds
+ * one address, in file order; a repeated address is merged. Lines that
+ * did not parse, or beyond DNS_MAX_ADDRS for a name, are counted in
+ * *skipped.
+ */
+static inline void dns_table_build(dns_table_t *t, const dns_entries_t *e, size_t *skipped)
+{
+	size_t n = e->count;
+	uint32_t count = e->names;
+	if (n > UINT32_MAX / 2) {
+		fprintf(stderr, "too many records\n");
+		exit(EXIT_FAILURE);
+	}
+	uint64_t addrs_cap = 0;
+	for (size_t i = 0; i < n; i++)
+		addrs_cap += dns_addr_size(e->v[i].family);
+
+	/* Power-of-two capacity at <= 75% load. */
+	uint64_t cap = 16;
+	while (cap * 3 < (uint64_t)count * 4)
+		cap *= 2;
+
+	dns_hdr_t h;
+	memset(&h, 0, sizeof(h));
+	uint64_t size = dns_layout(&h, count, cap * sizeof(dns_slot_t), e->arena_used, addrs_cap);
+	uint8_t *base = dns_blob_alloc(size);
+	dns_rec_t *recs = (dns_rec_t *)(base + h.sec[DNS_SEC_RECS].off);
+	dns_slot_t *slots = (dns_slot_t *)(base + h.sec[DNS_SEC_INDEX].off);
+	uint8_t *addrs = base + h.sec[DNS_SEC_ADDRS].off;
+	uint32_t mask = (uint32_t)(cap - 1);
+
+	/* Names are already distinct: the arena is STRINGS as is. */
+	if (e->arena_used)
+		memcpy(base + h.sec[DNS_SEC_STRINGS].off, e->arena, e->arena_used);
+	for (uint32_t id = 0; id < count; id++) {
+		dns_rec_t *r = &recs[id];
+		r->hash = e->name_hash[id];
+		r->name_off = e->name_off[id];
+		r->name_len = (uint16_t)strlen(e->arena + r->name_off);
+
+		dns_slot_t cur = {r->hash, id};
+		uint32_t pos = r->hash & mask;
+		for (uint32_t dist = 0;; dist++) {
+			dns_slot_t *s = &slots[pos];
+			if (s->hash == 0) {
+				*s = cur;
+				break;
+			}
+			uint32_t sdist = dns_probe_dist(s->hash, pos, mask);
+			if (sdist < dist) {
+				dns_slot_t tmp = *s;
+				*s = cur;
+				cur = tmp;
+				dist = sdist;
+			}
+			pos = (pos + 1) & mask;
+		}
+	}
+
+	/* Group lines by record (counting sort, stable), then write each run. */
+	uint32_t *group = (uint32_t *)calloc((size_t)count + 2, sizeof(uint32_t));
+	uint32_t *order = (uint32_t *)malloc((n + 1) * sizeof(uint32_t));
+	if (!group || !order)
+		dns_die("malloc build");
+	for (size_t i = 0; i < n; i++)
+		group[e->v[i].name + 2]++;
+	for (uint32_t r = 0; r < count; r++)
+		group[r + 2] += group[r + 1];
+	for (size_t i = 0; i < n; i++)
+		order[group[e->v[i].name + 1]++] = (uint32_t)i;
+
+	uint64_t addrs_used = 0;
+	size_t bad = e->bad;
+	for (uint32_t r = 0; r < count; r++) {
+		recs[r].addr_off = (uint32_t)addrs_used;
+		for (uint32_t k = group[r]; k < group[r + 1]; k++) {
+			const entry_t *en = &e->v[order[k]];
+			size_t asz = dns_addr_size(en->family) - DNS_ADDR_HDR;
+
+			/* Same address again: keep the first line's weight. */
+			int dup = 0;
+			uint64_t off = recs[r].addr_off;
+			for (uint16_t j = 0; j < recs[r].addr_count && !dup; j++) {
+				dup = addrs[off] == en->family && addrs[off + 1] == en->prefix &&
+					memcmp(addrs + off + DNS_ADDR_HDR, en->addr, asz) == 0;
+				off += dns_addr_size(addrs[off]);
+			}
+			if (dup)
+				continue;
+			if (recs[r].addr_count == DNS_MAX_ADDRS) {
+				bad++;
+				continue;
+			}
+			uint8_t *p = addrs + addrs_used;
+			p[0] = en->family;
+			p[1] = en->prefix;
+			memcpy(p + 2, &en->weight, sizeof(en->weight));
+			memcpy(p + DNS_ADDR_HDR, en->addr, asz);
+			addrs_used += DNS_ADDR_HDR + asz;
+			recs[r].addr_count++;
+		}
+	}
+	free(order);
+	free(group);
+
+	h.magic = DNS_IMAGE_MAGIC;
+	h.version = DNS_IMAGE_VERSION;
+	h.index_kind = DNS_INDEX_RH;
+	h.count = count;
+	h.index_size = (uint32_t)cap;
+	h.sec[DNS_SEC_ADDRS].size = addrs_used;
+	base = dns_blob_add_trie(base, &h);
+	base = dns_blob_add_radix(base, &h);
+	base = dns_blob_add_bloom(base, &h);
+	base = dns_blob_finish(base, &h);
+	if (dns_table_attach(t, base, (size_t)h.total_size, 0) != 0)
+		dns_die("dns_table_build");
+	if (skipped)
+		*skipped = bad;
+}
+
+/*
+ * Minimal perfect hash over the record names (hash and displace, ~4 names
+ * per bucket): bucket b = f(hash), slot = g(hash, disp[b]) in [0, count).
+ * Buckets are placed largest first, trying displacements until all of a
+ * bucket's names land on free slots. Returns -1 if the seed is unlucky.
+ */
+static inline int dns_mph_place(const uint64_t *hashes, uint32_t n, uint32_t nb, uint64_t seed,
+	uint32_t *disp, uint32_t *slot_of)
+{
+	uint32_t *bucket_start = (uint32_t *)calloc((size_t)nb + 1, sizeof(uint32_t));
+	uint32_t *members = (uint32_t *)malloc((size_t)n * sizeof(uint32_t));
+	uint8_t *taken = (uint8_t *)calloc(((size_t)n + 7) / 8, 1);
+	uint32_t *order = (uint32_t *)malloc((size_t)nb * sizeof(uint32_t));
+	if (!bucket_start || !members || !taken || !order)
+		dns_die("malloc mph");
+
+	/* Counting sort of names by bucket. */
+	for (uint32_t i = 0; i < n; i++)
+		bucket_start[dns_mph_bucket(hashes[i], nb) + 1]++;
+	uint32_t max_size = 0;
+	for (uint32_t b = 0; b < nb; b++) {
+		if (bucket_start[b + 1] > max_size)
+			max_size = bucket_start[b + 1];
+		bucket_start[b + 1] += bucket_start[b];
+	}
+	uint32_t *fill = (uint32_t *)malloc((size_t)nb * sizeof(uint32_t));
+	if (!fill)
+		dns_die("malloc mph");
+	memcpy(fill, bucket_start, (size_t)nb * sizeof(uint32_t));
+	for (uint32_t i = 0; i < n; i++)
+		members[fill[dns_mph_bucket(hashes[i], nb)]++] = i;
+
+	/* Buckets by size, largest first (counting sort again). */
+	uint32_t *by_size = (uint32_t *)calloc((size_t)max_size + 2, sizeof(uint32_t));
+	if (!by_size)
+		dns_die("malloc mph");
+	for (uint32_t b = 0; b < nb; b++)
+		by_size[max_size - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+	for (uint32_t s = 0; s <= max_size; s++)
+		by_size[s + 1] += by_size[s];
+	for (uint32_t b = 0; b < nb; b++)
+		order[by_size[max_size - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+
+	/* The last free slots take ~n tries each to hit. */
+	uint64_t max_disp = (uint64_t)n * 16 + 1024;
+	if (max_disp > UINT32_MAX - 1)
+		max_disp = UINT32_MAX - 1;
+
+	int rc = 0;
+	uint32_t tried[64];
+	for (uint32_t k = 0; k < nb && rc == 0; k++) {
+		uint32_t b = order[k];
+		uint32_t first = bucket_start[b], size = bucket_start[b + 1] - first;
+		disp[b] = 0;
+		if (size == 0)
+			continue;
+		if (size > 64) {
+			rc = -1;
+			break;
+		}
+		uint32_t d = 0;
+		for (;; d++) {
+			if (d > max_disp) {
+				rc = -1;
+				break;
+			}
+			uint32_t j = 0;
+			for (; j < size; j++) {
+				uint32_t s = dns_mph_slot(hashes[members[first + j]], d, seed, n);
+				if (taken[s / 8] & (1u << (s % 8)))
+					break;
+				uint32_t q = 0;
+				while (q < j && tried[q] != s)
+					q++;
+				if (q < j)
+					break;
+				tried[j] = s;
+			}
+			if (j == size)
+				break;
+		}
+		if (rc != 0)
+			break;
+		disp[b] = d;
+		for (uint32_t j = 0; j < size; j++) {
+			taken[tried[j] / 8] |= (uint8_t)(1u << (tried[j] % 8));
+			slot_of[members[first + j]] = tried[j];
+		}
+	}
+
+	free(by_size);
+	free(fill);
+	free(order);
+	free(taken);
+	free(members);
+	free(bucket_start);
+	return rc;
+}
+
+/*
+ * Re-lays a table out with a minimal perfect hash index: records are
+ * permuted into slot order and the other sections copied unchanged, so the
+ * result is tight and ready to be written as an image.
+ */
+static inline int dns_table_build_mph(dns_table_t *out, const dns_table_t *in)
+{
+	uint32_t n = in->hdr->count;
+	uint32_t nb = n / 4 + 1;
+	uint64_t *hashes = (uint64_t *)malloc(((size_t)n + 1) * sizeof(uint64_t));
+	uint32_t *slot_of = (uint32_t *)malloc(((size_t)n + 1) * sizeof(uint32_t));
+	if (!hashes || !slot_of)
+		dns_die("malloc mph");
+	for (uint32_t i = 0; i < n; i++)
+		hashes[i] = dns_hash64(dns_rec_name(in, &in->recs[i]), in->recs[i].name_len);
+
+	dns_hdr_t h;
+	memset(&h, 0, sizeof(h));
+	uint64_t size = dns_layout(&h, n, (uint64_t)nb * sizeof(uint32_t),
+		in->hdr->sec[DNS_SEC_STRINGS].size, in->hdr->sec[DNS_SEC_ADDRS].size);
+	uint8_t *base = dns_blob_alloc(size);
+	uint32_t *disp = (uint32_t *)(base + h.sec[DNS_SEC_INDEX].off);
+
+	uint64_t seed = 0;
+	int rc = -1;
+	for (int attempt = 0; attempt < 16 && rc != 0; attempt++) {
+		seed = dns_mix64(0x6D70685Full + (uint64_t)attempt);
+		rc = dns_mph_place(hashes, n, nb, seed, disp, slot_of);
+	}
+	if (rc != 0) {
+		free(base);
+		free(hashes);
+		free(slot_of);
+		return -1;
+	}
+
+	dns_rec_t *recs = (dns_rec_t *)(base + h.sec[DNS_SEC_RECS].off);
+	for (uint32_t i = 0; i < n; i++)
+		recs[slot_of[i]] = in->recs[i];
+	memcpy(base + h.sec[DNS_SEC_STRINGS].off, in->strings, h.sec[DNS_SEC_STRINGS].size);
+	memcpy(base + h.sec[DNS_SEC_ADDRS].off, in->addrs, h.sec[DNS_SEC_ADDRS].size);
+
+	h.magic = DNS_IMAGE_MAGIC;
+	h.version = DNS_IMAGE_VERSION;
+	h.index_kind = DNS_INDEX_MPH;
+	h.count = n;
+	h.index_size = nb;
+	h.mph_seed = seed;
+	base = dns_blob_add_trie(base, &h);
+	base = dns_blob_add_radix(base, &h);
+	base = dns_blob_add_bloom(base, &h);
+	base = dns_blob_finish(base, &h);
+	free(hashes);
+	free(slot_of);
+	return dns_table_attach(out, base, (size_t)h.total_size, 0);
+}
+
+/* ---- images ---- */
+
+/* fsync()s the directory holding path, so a rename or create in it is durable. */
+static inline int dns_fsync_dir(const char *path)
+{
+	char dir[4096];
+	snprintf(dir, sizeof(dir), "%s", path);
+	char *slash = strrchr(dir, '/');
+	if (!slash)
+		snprintf(dir, sizeof(dir), ".");
+	else if (slash == dir)
+		dir[1] = '\0';
+	else
+		*slash = '\0';
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	int rc = fsync(fd);
+	close(fd);
+	return rc;
+}
+
+/* write() of all len bytes to a file; 0, or -1 with errno set. */
+static inline int dns_write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	while (len > 0) {
+		ssize_t w = write(fd, p, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += w;
+		len -= (size_t)w;
+	}
+	return 0;
+}
+
+/*
+ * Writes len bytes to path through path.tmp, fsync() and rename(), so
+ * readers and crashes see the old file or the whole new one.
+ */
+static inline int dns_write_file(const char *path, const void *data, size_t len)
+{
+	char tmp[4096 + sizeof(".tmp")];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int rc = -1;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (dns_write_all(fd, data, len) == 0 && fsync(fd) == 0)
+		rc = 0;
+	if (close(fd) != 0)
+		rc = -1;
+	if (rc == 0 && (rename(tmp, path) != 0 || dns_fsync_dir(path) != 0))
+		rc = -1;
+	if (rc != 0)
+		unlink(tmp);
+	return rc;
+}
+
+/* Writes t as an MPH image, atomically replacing path. */
+static inline int dns_table_write(const dns_table_t *t, const char *path)
+{
+	dns_table_t mph;
+	const dns_table_t *src = t;
+	if (t->hdr->index_kind != DNS_INDEX_MPH) {
+		if (dns_table_build_mph(&mph, t) != 0)
+			return -1;
+		src = &mph;
+	}
+	int rc = dns_write_file(path, src->base, (size_t)src->hdr->total_size);
+	if (src == &mph)
+		dns_table_free(&mph);
+	return rc;
+}
+
+static inline int dns_table_map(dns_table_t *t, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return -1;
+	}
+	void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	if (dns_table_attach(t, (uint8_t *)p, (size_t)st.st_size, 1) != 0) {
+		munmap(p, (size_t)st.st_size);
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	t->fd = fd; /* for sendfile(), and the file stays put across a rename */
+	return 0;
+}
+
+/*
+ * Moves a table built in memory into a memfd (created with flags, then
+ * given seals) and maps it from there: still one copy, but now with a
+ * descriptor in t->fd to send or share. Returns 0, or -1 with t unchanged.
+ */
+static inline int dns_table_to_memfd(dns_table_t *t, unsigned flags, int seals)
+{
+	int fd = memfd_create("dns_table", MFD_CLOEXEC | flags);
+	if (fd < 0)
+		return -1;
+	size_t size = (size_t)t->hdr->total_size;
+	void *m = MAP_FAILED;
+	if (dns_write_all(fd, t->base, size) == 0 &&
+		(seals == 0 || fcntl(fd, F_ADD_SEALS, seals) == 0))
+		m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	dns_table_t moved;
+	if (m == MAP_FAILED || dns_table_attach(&moved, (uint8_t *)m, size, 1) != 0) {
+		if (m != MAP_FAILED)
+			munmap(m, size);
+		close(fd);
+		return -1;
+	}
+	moved.rotation = t->rotation;
+	moved.fd = fd;
+	t->rotation = NULL;
+	dns_table_free(t);
+	*t = moved;
+	return 0;
+}
+
+static inline int dns_is_image(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return 0;
+	uint32_t magic = 0;
+	int is = fread(&magic, sizeof(magic), 1, f) == 1 && magic == DNS_IMAGE_MAGIC;
+	fclose(f);
+	return is;
+}
+
+/*
+ * Opens either a compiled image (mapped) or a text database (parsed and
+ * built in memory), with fresh rotation counters. For a text database,
+ * stats (if given) gets the load's timings; its threads stay 0 for an
+ * image. Returns -1 with errno set on failure.
+ */
+static inline int dns_table_open(dns_table_t *t, const char *path, size_t *skipped,
+	dns_load_stats_t *stats)
+{
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
+	if (skipped)
+		*skipped = 0;
+	if (dns_is_image(path)) {
+		if (dns_table_map(t, path) != 0)
+			return -1;
+	} else {
+		dns_entries_t e;
+		memset(&e, 0, sizeof(e));
+		if (dns_entries_load_parallel(&e, path, 0, stats) != 0)
+			return -1;
+		double t0 = dns_clock_ms();
+		dns_table_build(t, &e, skipped);
+		dns_entries_free(&e);
+		if (stats)
+			stats->build_ms = dns_clock_ms() - t0;
+	}
+	/* Without counters every answer simply keeps database order. */
+	t->rotation = (_Atomic uint32_t *)calloc((size_t)t->hdr->count + 1, sizeof(uint32_t));
+	return 0;
+}
+
+#endif
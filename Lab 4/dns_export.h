@@ -0,0 +1,159 @@
+#ifndef DNS_EXPORT_H
+#define DNS_EXPORT_H
+
+#include "dns_journal.h"
+
+/*
+ * Bulk export of the served table, for replicas and backups.
+ *
+ * DNS_EXPORT_REQUEST answers "EXPORT image <bytes> <snapshot bytes>" and
+ * then exactly that many raw bytes (stream sockets only): the table as a
+ * dns_compile image, then the online changes on top of it as a journal
+ * snapshot (see dns_journal.h). The image leaves the server by sendfile()
+ * from its file, or from the memfd a text database is built into, so it
+ * is never copied through user space; the client splices it into its
+ * file the same way. A peer serves the image as it is, and with the
+ * snapshot at journal.snap and -J journal it has every online change too.
+ *
+ * DNS_EXPORT_TEXT_REQUEST answers "EXPORT text", then the same records,
+ * online changes merged in, as database lines in frames of at most
+ * DNS_EXPORT_CHUNK bytes, then DNS_EXPORT_END. Every frame of lines ends
+ * in a newline, so the marker cannot be one of them. Either transport.
+ *
+ * Both describe the table as it was when the request was read; changes
+ * made while the export runs are not in it.
+ */
+
+#define DNS_EXPORT_REQUEST "__export__"
+#define DNS_EXPORT_TEXT_REQUEST "__export_text__"
+#define DNS_EXPORT_END "EXPORT end"
+#define DNS_EXPORT_CHUNK (64 * 1024)
+#define DNS_SPLICE_MAX (1 << 20)
+
+/* read() and write() of len bytes from socket from to to; 0, or -1 with errno set. */
+static inline int dns_copy_all(int from, int to, uint64_t len)
+{
+	char *buf = (char *)malloc(DNS_SPLICE_MAX);
+	if (!buf)
+		dns_die("malloc");
+	int rc = 0;
+	while (len > 0 && rc == 0) {
+		ssize_t r = read(from, buf, len < DNS_SPLICE_MAX ? (size_t)len : DNS_SPLICE_MAX);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r == 0)
+			errno = ECONNRESET;
+		if (r <= 0 || dns_write_all(to, buf, (size_t)r) != 0)
+			rc = -1;
+		else
+			len -= (uint64_t)r;
+	}
+	free(buf);
+	return rc;
+}
+
+/*
+ * Moves len bytes from socket from to a file or pipe through a pipe of
+ * our own, so they are never copied into this process; anything else
+ * (a terminal, say) gets dns_copy_all(). Returns 0, or -1 with errno set.
+ */
+static inline int dns_splice_all(int from, int to, uint64_t len)
+{
+	struct stat st;
+	int p[2];
+	if (fstat(to, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode)) ||
+		pipe2(p, O_CLOEXEC) != 0)
+		return dns_copy_all(from, to, len);
+	fcntl(p[1], F_SETPIPE_SZ, DNS_SPLICE_MAX);
+	int rc = 0;
+	size_t in_pipe = 0;
+	while ((len > 0 || in_pipe > 0) && rc == 0) {
+		ssize_t r;
+		if (in_pipe == 0) {
+			r = splice(from, NULL, p[1], NULL, len < DNS_SPLICE_MAX ? (size_t)len :
+				DNS_SPLICE_MAX, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (r > 0) {
+				len -= (uint64_t)r;
+				in_pipe = (size_t)r;
+			}
+		} else {
+			r = splice(p[0], NULL, to, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (r > 0)
+				in_pipe -= (size_t)r;
+		}
+		if (r == 0)
+			errno = ECONNRESET;
+		if (r == 0 || (r < 0 && errno != EINTR))
+			rc = -1;
+	}
+	close(p[0]);
+	close(p[1]);
+	return rc;
+}
+
+/*
+ * Asks the server on sock for an export and writes the image or text to
+ * out_fd; an image's snapshot goes to snap. *bytes counts what went to
+ * out_fd. Returns 0, or -1 with the server's reply (or why it failed) in
+ * err.
+ */
+static inline int dns_export_fetch(int sock, int seqpacket, int text, int out_fd,
+	dns_buf_t *snap, uint64_t *bytes, char *err, size_t errsz)
+{
+	const char *req = text ? DNS_EXPORT_TEXT_REQUEST : DNS_EXPORT_REQUEST;
+	*bytes = 0;
+	if ((seqpacket ? send_record(sock, req, strlen(req)) : send_msg(sock, req)) != 0) {
+		snprintf(err, errsz, "send: %s", strerror(errno));
+		return -1;
+	}
+	char *buf = (char *)malloc(DNS_EXPORT_CHUNK + 1);
+	if (!buf)
+		dns_die("malloc");
+	int rc = -1;
+	int rr = seqpacket ? recv_record(sock, buf, DNS_EXPORT_CHUNK + 1) :
+		recv_msg(sock, buf, DNS_EXPORT_CHUNK + 1);
+	unsigned long long image = 0, snap_len = 0;
+	if (rr != 0) {
+		snprintf(err, errsz, "no reply");
+	} else if (strncmp(buf, "EXPORT ", 7) != 0) {
+		snprintf(err, errsz, "%s", buf);
+	} else if (!text) {
+		if (sscanf(buf, "EXPORT image %llu %llu", &image, &snap_len) != 2) {
+			snprintf(err, errsz, "unexpected reply: %s", buf);
+		} else if (dns_splice_all(sock, out_fd, image) != 0) {
+			snprintf(err, errsz, "receiving the image: %s", strerror(errno));
+		} else {
+			*bytes = image;
+			dns_buf_reserve(snap, (size_t)snap_len);
+			if (recv_all_bytes(sock, snap->buf + snap->len, (size_t)snap_len) == 0) {
+				snap->len += (size_t)snap_len;
+				rc = 0;
+			} else {
+				snprintf(err, errsz, "receiving the snapshot");
+			}
+		}
+	} else {
+		for (;;) {
+			rr = seqpacket ? recv_record(sock, buf, DNS_EXPORT_CHUNK + 1) :
+				recv_msg(sock, buf, DNS_EXPORT_CHUNK + 1);
+			if (rr != 0) {
+				snprintf(err, errsz, "export cut short");
+				break;
+			}
+			if (strcmp(buf, DNS_EXPORT_END) == 0) {
+				rc = 0;
+				break;
+			}
+			size_t n = strlen(buf);
+			if (dns_write_all(out_fd, buf, n) != 0) {
+				snprintf(err, errsz, "write: %s", strerror(errno));
+				break;
+			}
+			*bytes += n;
+		}
+	}
+	free(buf);
+	return rc;
+}
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef DNS_JOURNAL_H
+#define DNS_JOURNAL_H
+
+#include "dns_live.h"
+
+/*
+ * Durable online updates. Started with -J path, dns_server appends every
+ * ADD/DEL that changed a name to the journal at path as a binary record
+ * and acknowledges it once the record is on disk. The records written
+ * while one fsync runs are flushed together by the next, so one disk flush
+ * commits a whole group of updates.
+ *
+ * The journal is compacted in the background: once it outgrows the last
+ * snapshot, the overlay is written to path.snap as the records that
+ * rebuild it (a DEL of each changed name followed by an ADD for each of
+ * its addresses), new records go to path.next, and path.next replaces the
+ * journal when the snapshot is safely renamed into place. Records carry
+ * a sequence number and the snapshot the last one it covers, so a crash
+ * at any step loses nothing and applies nothing twice: recovery loads the
+ * snapshot, then replays the newer records of the journal and path.next.
+ * Restart cost follows the number of changed names, not of updates ever
+ * made; the table itself comes from the database as before.
+ */
+
+#define DNS_JOURNAL_MAGIC 0x4A534E44u /* "DNSJ" */
+#define DNS_SNAPSHOT_MAGIC 0x53534E44u /* "DNSS" */
+#define DNS_JOURNAL_VERSION 1
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t seq; /* snapshot: the last record it covers; 0 in a journal */
+} dns_journal_hdr_t;
+
+/* One record; the name's bytes follow. check covers everything after it. */
+typedef struct {
+	uint32_t len; /* of the record after this field */
+	uint32_t check;
+	uint64_t seq;
+	uint8_t op;
+	uint8_t family;
+	uint8_t prefix;
+	uint8_t reserved;
+	uint16_t weight;
+	uint16_t name_len;
+	uint8_t addr[16];
+} dns_journal_rec_t;
+
+#define DNS_JOURNAL_REC_CHECKED (sizeof(dns_journal_rec_t) - 2 * sizeof(uint32_t))
+
+static inline uint32_t dns_journal_check(const uint8_t *p, size_t len)
+{
+	return dns_hash32(dns_hash64((const char *)p, len));
+}
+
+/* Appends op to b as record seq. */
+static inline void dns_journal_encode(dns_buf_t *b, uint64_t seq, const dns_live_op_t *op)
+{
+	dns_journal_rec_t r;
+	memset(&r, 0, sizeof(r));
+	r.len = (uint32_t)(DNS_JOURNAL_REC_CHECKED + op->name_len);
+	r.seq = seq;
+	r.op = op->op;
+	r.family = op->family;
+	r.prefix = op->prefix;
+	r.weight = op->weight;
+	r.name_len = op->name_len;
+	memcpy(r.addr, op->addr, sizeof(r.addr));
+	dns_buf_reserve(b, sizeof(r) + op->name_len);
+	uint8_t *p = (uint8_t *)b->buf + b->len;
+	memcpy(p, &r, sizeof(r));
+	memcpy(p + sizeof(r), op->name, op->name_len);
+	r.check = dns_journal_check(p + 2 * sizeof(uint32_t), r.len);
+	memcpy(p + sizeof(uint32_t), &r.check, sizeof(r.check));
+	b->len += sizeof(r) + op->name_len;
+}
+
+static inline void dns_journal_encode_hdr(dns_buf_t *b, uint32_t magic, uint64_t seq)
+{
+	dns_journal_hdr_t h = {magic, DNS_JOURNAL_VERSION, seq};
+	dns_buf_reserve(b, sizeof(h));
+	memcpy(b->buf + b->len, &h, sizeof(h));
+	b->len += sizeof(h);
+}
+
+/*
+ * Decodes the record at p (left bytes remain) into op and *seq. Returns
+ * its size, or 0 when it is torn or corrupt.
+ */
+static inline size_t dns_journal_decode(const uint8_t *p, size_t left, dns_live_op_t *op,
+	uint64_t *seq)
+{
+	dns_journal_rec_t r;
+	if (left < sizeof(r))
+		return 0;
+	memcpy(&r, p, sizeof(r));
+	if (r.len < DNS_JOURNAL_REC_CHECKED || r.len > DNS_JOURNAL_REC_CHECKED + MAX_DOMAIN - 1 ||
+		r.len > left - 2 * sizeof(uint32_t) ||
+		r.name_len != r.len - DNS_JOURNAL_REC_CHECKED || r.name_len == 0 ||
+		dns_journal_check(p + 2 * sizeof(uint32_t), r.len) != r.check ||
+		(r.op != DNS_LIVE_ADD && r.op != DNS_LIVE_DEL))
+		return 0;
+	memset(op, 0, sizeof(*op));
+	op->op = r.op;
+	op->family = r.family;
+	op->prefix = r.prefix;
+	op->weight = r.weight;
+	op->name_len = r.name_len;
+	memcpy(op->addr, r.addr, sizeof(op->addr));
+	memcpy(op->name, p + sizeof(r), r.name_len);
+	*seq = r.seq;
+	return sizeof(r) + r.name_len;
+}
+
+/*
+ * Writes the records that rebuild l into out, after a snapshot header
+ * covering seq. Updates must be held off by the caller for seq to be exact.
+ */
+static inline void dns_journal_snapshot(dns_live_t *l, uint64_t seq, dns_buf_t *out)
+{
+	dns_journal_encode_hdr(out, DNS_SNAPSHOT_MAGIC, seq);
+	pthread_mutex_lock(&l->lock);
+	dns_live_slots_t *s = atomic_load_explicit(&l->slots, memory_order_relaxed);
+	for (uint32_t i = 0; i <= s->mask; i++) {
+		dns_live_entry_t *e = atomic_load_explicit(&s->slot[i], memory_order_relaxed);
+		if (!e)
+			continue;
+		dns_live_op_t op;
+		memset(&op, 0, sizeof(op));
+		op.op = DNS_LIVE_DEL;
+		op.name_len = e->name_len;
+		memcpy(op.name, dns_live_name(e), e->name_len);
+		dns_journal_encode(out, seq, &op);
+		dns_addr_t a[DNS_MAX_ADDRS];
+		int n = dns_live_addrs(e, a);
+		op.op = DNS_LIVE_ADD;
+		for (int k = 0; k < n; k++) {
+			op.family = a[k].family;
+			op.prefix = a[k].prefix;
+			op.weight = a[k].weight;
+			memcpy(op.addr, a[k].bytes, dns_addr_bits(a[k].family) / 8);
+			dns_journal_encode(out, seq, &op);
+		}
+	}
+	pthread_mutex_unlock(&l->lock);
+}
+
+typedef struct {
+	uint64_t seq; /* in: records up to it are skipped; out: the last one applied */
+	uint64_t applied;
+	uint64_t torn; /* bytes dropped from the end: a write cut short by a crash */
+} dns_replay_t;
+
+/* Whether a record decodes anywhere in [p, end). */
+static inline int dns_journal_any(const uint8_t *p, const uint8_t *end)
+{
+	for (; p < end; p++) {
+		dns_live_op_t op;
+		uint64_t seq;
+		if (dns_journal_decode(p, (size_t)(end - p), &op, &seq) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Applies the records of a journal or snapshot image (by magic) at p to l
+ * over table t. A snapshot's records all count as its header's seq. Only
+ * while l has no readers: replaced entries are freed straight away.
+ * A journal may end in a torn append, counted in r->torn; a bad record
+ * with good ones after it, or any bad record in a snapshot (written whole
+ * and renamed into place), is damage. Returns 0, or -1 with errno EINVAL
+ * for a bad header and EBADMSG for damage.
+ */
+static inline int dns_journal_apply(const uint8_t *p, size_t size, uint32_t magic,
+	dns_live_t *l, const dns_table_t *t, dns_replay_t *r)
+{
+	dns_journal_hdr_t h;
+	if (size < sizeof(h)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&h, p, sizeof(h));
+	if (h.magic != magic || h.version != DNS_JOURNAL_VERSION) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const uint8_t *end = p + size;
+	uint64_t after = r->seq;
+	p += sizeof(h);
+	while (p < end) {
+		dns_live_op_t op;
+		uint64_t seq;
+		size_t n = dns_journal_decode(p, (size_t)(end - p), &op, &seq);
+		if (n == 0)
+			break;
+		p += n;
+		if (magic == DNS_SNAPSHOT_MAGIC)
+			seq = h.seq;
+		else if (seq <= after)
+			continue;
+		dns_live_entry_t *e;
+		dns_live_apply(l, t, &op, &e);
+		r->applied++;
+		if (seq > r->seq)
+			r->seq = seq;
+		if ((r->applied & 4095) == 0)
+			dns_live_reclaim(l, UINT64_MAX);
+	}
+	if (p < end && (magic == DNS_SNAPSHOT_MAGIC || dns_journal_any(p + 1, end))) {
+		errno = EBADMSG;
+		return -1;
+	}
+	if (magic == DNS_SNAPSHOT_MAGIC && h.seq > r->seq)
+		r->seq = h.seq;
+	r->torn += (uint64_t)(end - p);
+	dns_live_reclaim(l, UINT64_MAX);
+	return 0;
+}
+
+/* dns_journal_apply() of the file at path; -1 with errno ENOENT when there is none. */
+static inline int dns_journal_replay(const char *path, uint32_t magic, dns_live_t *l,
+	const dns_table_t *t, dns_replay_t *r)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	size_t size = (size_t)st.st_size;
+	if (size < sizeof(dns_journal_hdr_t) && magic == DNS_JOURNAL_MAGIC) {
+		close(fd); /* created, but the crash came before its header */
+		r->torn += size;
+		return 0;
+	}
+	void *m = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (m == MAP_FAILED) {
+		errno = EINVAL;
+		return -1;
+	}
+	madvise(m, size, MADV_SEQUENTIAL);
+	int rc = dns_journal_apply((const uint8_t *)m, size, magic, l, t, r);
+	munmap(m, size);
+	return rc;
+}
+
+#endif
@@ -0,0 +1,381 @@
+#ifndef DNS_LIVE_H
+#define DNS_LIVE_H
+
+#include "dns_db.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Online updates. "ADD name ip[/len] [weight]" and "DEL name [ip[/len]]"
+ * change names on top of the loaded table without rebuilding it: every
+ * name changed since has an entry in the live overlay holding its whole
+ * new address set, or none once it is deleted. Lookups ask the overlay
+ * first and the table only for names the overlay does not know. Wildcard
+ * names still change only with the database.
+ *
+ * The overlay is an open-addressing table of entry pointers (linear
+ * probing, at most half full) that readers walk without locks. Entries
+ * are immutable: a writer builds the name's next entry and swaps it into
+ * the slot with one release store, so a reader sees the old address set or
+ * the new one, never a mix. Slots are never emptied (a deleted name keeps
+ * an entry with no addresses, which must hide the table's record anyway),
+ * so probe runs never break. Growing copies the slots into an array twice
+ * the size and publishes that, dropping deleted names the table does not
+ * have. Writers take one mutex.
+ *
+ * Replaced entries and slot arrays are retired, stamped with *epoch (which
+ * the writer then advances), and freed by dns_live_reclaim() once the
+ * caller knows no reader started before that stamp is still running.
+ */
+
+enum { DNS_LIVE_ADD = 1, DNS_LIVE_DEL = 2 };
+enum { DNS_LIVE_DONE, DNS_LIVE_ABSENT, DNS_LIVE_FULL };
+
+#define DNS_LIVE_MIN_SLOTS 1024
+
+typedef struct {
+	_Atomic uint32_t rotation; /* the only field written after publication */
+	uint32_t hash; /* dns_hash32() of the lowercased name */
+	uint16_t name_len;
+	uint16_t addr_count; /* 0 once the name is deleted */
+	uint32_t addr_bytes;
+	uint8_t data[]; /* addresses encoded as in ADDRS, then the name and a NUL */
+} dns_live_entry_t;
+
+typedef struct {
+	uint32_t mask;
+	_Atomic(dns_live_entry_t *) slot[];
+} dns_live_slots_t;
+
+typedef struct dns_live_retired {
+	struct dns_live_retired *next;
+	void *p;
+	uint64_t stamp;
+} dns_live_retired_t;
+
+typedef struct {
+	_Atomic(dns_live_slots_t *) slots;
+	_Atomic uint32_t used; /* slots holding an entry */
+	pthread_mutex_t lock; /* writers */
+	_Atomic uint64_t *epoch;
+	dns_live_retired_t *retired_head, *retired_tail;
+} dns_live_t;
+
+/* One parsed update, also the unit the journal records. */
+typedef struct {
+	uint8_t op;
+	uint8_t family; /* 0 for a DEL of the whole name */
+	uint8_t prefix;
+	uint8_t reserved;
+	uint16_t weight;
+	uint16_t name_len;
+	uint8_t addr[16];
+	char name[MAX_DOMAIN]; /* lowercased */
+} dns_live_op_t;
+
+static inline dns_live_slots_t *dns_live_slots_new(uint32_t n)
+{
+	dns_live_slots_t *s = (dns_live_slots_t *)calloc(1,
+		sizeof(dns_live_slots_t) + (size_t)n * sizeof(s->slot[0]));
+	if (!s)
+		dns_die("calloc live slots");
+	s->mask = n - 1;
+	return s;
+}
+
+static inline void dns_live_init(dns_live_t *l, _Atomic uint64_t *epoch)
+{
+	memset(l, 0, sizeof(*l));
+	pthread_mutex_init(&l->lock, NULL);
+	l->epoch = epoch;
+	atomic_store(&l->slots, dns_live_slots_new(DNS_LIVE_MIN_SLOTS));
+}
+
+static inline const char *dns_live_name(const dns_live_entry_t *e)
+{
+	return (const char *)e->data + e->addr_bytes;
+}
+
+/* Decodes e's addresses, in stored order, into a[DNS_MAX_ADDRS]. */
+static inline int dns_live_addrs(const dns_live_entry_t *e, dns_addr_t *a)
+{
+	const uint8_t *p = e->data;
+	for (int i = 0; i < e->addr_count; i++) {
+		a[i].family = p[0];
+		a[i].prefix = p[1];
+		memcpy(&a[i].weight, p + 2, sizeof(a[i].weight));
+		a[i].bytes = p + DNS_ADDR_HDR;
+		p += dns_addr_size(p[0]);
+	}
+	return e->addr_count;
+}
+
+/* Like dns_rec_ordered(): e's addresses in this answer's order. */
+static inline int dns_live_ordered(dns_live_entry_t *e, dns_addr_t *a)
+{
+	int n = dns_live_addrs(e, a);
+	if (n > 1)
+		dns_addrs_order(a, n, atomic_fetch_add_explicit(&e->rotation, 1,
+			memory_order_relaxed));
+	return n;
+}
+
+/* Formats e's addresses in this answer's order; -1 if it has none or out is small. */
+static inline int dns_live_answer(dns_live_entry_t *e, char *out, size_t outsz)
+{
+	dns_addr_t a[DNS_MAX_ADDRS];
+	int n = dns_live_ordered(e, a);
+	return n > 0 ? dns_addrs_answer(a, n, out, outsz) : -1;
+}
+
+/* Slot of a lowercased name in s: its entry's, or the empty one ending its run. */
+static inline uint32_t dns_live_probe(dns_live_slots_t *s, const char *lower, size_t len,
+	uint32_t h32)
+{
+	uint32_t pos = h32 & s->mask;
+	for (;; pos = (pos + 1) & s->mask) {
+		dns_live_entry_t *e = atomic_load_explicit(&s->slot[pos], memory_order_acquire);
+		if (!e || (e->hash == h32 && e->name_len == len &&
+			memcmp(dns_live_name(e), lower, len) == 0))
+			return pos;
+	}
+}
+
+/*
+ * The overlay's entry for name, deleted ones included; NULL when the
+ * table decides. Lock-free; the entry stays valid until the caller's
+ * reader section ends.
+ */
+static inline dns_live_entry_t *dns_live_find(const dns_live_t *l, const char *name)
+{
+	if (atomic_load_explicit(&l->used, memory_order_relaxed) == 0)
+		return NULL;
+	char lower[MAX_DOMAIN];
+	int len = dns_lower(name, lower);
+	if (len <= 0)
+		return NULL;
+	uint32_t h32 = dns_hash32(dns_hash64(lower, (size_t)len));
+	dns_live_slots_t *s = atomic_load_explicit(&((dns_live_t *)l)->slots,
+		memory_order_acquire);
+	return atomic_load_explicit(&s->slot[dns_live_probe(s, lower, (size_t)len, h32)],
+		memory_order_acquire);
+}
+
+/* ---- writers ---- */
+
+static inline dns_live_entry_t *dns_live_entry_new(const char *lower, size_t len, uint32_t h32,
+	const dns_addr_t *a, int n)
+{
+	uint32_t bytes = 0;
+	for (int i = 0; i < n; i++)
+		bytes += (uint32_t)dns_addr_size(a[i].family);
+	dns_live_entry_t *e = (dns_live_entry_t *)malloc(sizeof(*e) + bytes + len + 1);
+	if (!e)
+		dns_die("malloc live entry");
+	atomic_init(&e->rotation, 0);
+	e->hash = h32;
+	e->name_len = (uint16_t)len;
+	e->addr_count = (uint16_t)n;
+	e->addr_bytes = bytes;
+	uint8_t *p = e->data;
+	for (int i = 0; i < n; i++) {
+		p[0] = a[i].family;
+		p[1] = a[i].prefix;
+		memcpy(p + 2, &a[i].weight, sizeof(a[i].weight));
+		memcpy(p + DNS_ADDR_HDR, a[i].bytes, dns_addr_bits(a[i].family) / 8);
+		p += dns_addr_size(a[i].family);
+	}
+	memcpy(p, lower, len);
+	p[len] = '\0';
+	return e;
+}
+
+/* Queues p to be freed once readers are past the current epoch. Writer lock held. */
+static inline void dns_live_retire(dns_live_t *l, void *p)
+{
+	dns_live_retired_t *r = (dns_live_retired_t *)malloc(sizeof(*r));
+	if (!r)
+		dns_die("malloc retired");
+	r->next = NULL;
+	r->p = p;
+	r->stamp = atomic_fetch_add(l->epoch, 1);
+	if (l->retired_tail)
+		l->retired_tail->next = r;
+	else
+		l->retired_head = r;
+	l->retired_tail = r;
+}
+
+/* Frees what was retired before epoch safe, the oldest one any reader may be in. */
+static inline void dns_live_reclaim(dns_live_t *l, uint64_t safe)
+{
+	pthread_mutex_lock(&l->lock);
+	while (l->retired_head && l->retired_head->stamp < safe) {
+		dns_live_retired_t *r = l->retired_head;
+		l->retired_head = r->next;
+		free(r->p);
+		free(r);
+	}
+	if (!l->retired_head)
+		l->retired_tail = NULL;
+	pthread_mutex_unlock(&l->lock);
+}
+
+/*
+ * Moves the entries into a slot array sized for twice as many, leaving out
+ * deletions of names t does not have. Writer lock held.
+ */
+static inline void dns_live_grow(dns_live_t *l, const dns_table_t *t)
+{
+	dns_live_slots_t *old = atomic_load_explicit(&l->slots, memory_order_relaxed);
+	uint32_t keep = 0;
+	for (uint32_t i = 0; i <= old->mask; i++) {
+		dns_live_entry_t *e = atomic_load_explicit(&old->slot[i], memory_order_relaxed);
+		keep += e && (e->addr_count > 0 || dns_table_find(t, dns_live_name(e)));
+	}
+	uint32_t n = DNS_LIVE_MIN_SLOTS;
+	while (n < (keep + 1) * 4)
+		n *= 2;
+	dns_live_slots_t *s = dns_live_slots_new(n);
+	for (uint32_t i = 0; i <= old->mask; i++) {
+		dns_live_entry_t *e = atomic_load_explicit(&old->slot[i], memory_order_relaxed);
+		if (!e)
+			continue;
+		if (e->addr_count == 0 && !dns_table_find(t, dns_live_name(e))) {
+			dns_live_retire(l, e);
+			continue;
+		}
+		uint32_t pos = e->hash & s->mask;
+		while (atomic_load_explicit(&s->slot[pos], memory_order_relaxed))
+			pos = (pos + 1) & s->mask;
+		atomic_store_explicit(&s->slot[pos], e, memory_order_relaxed);
+	}
+	atomic_store_explicit(&l->used, keep, memory_order_relaxed);
+	atomic_store_explicit(&l->slots, s, memory_order_release);
+	dns_live_retire(l, old);
+}
+
+static inline int dns_addr_same(const dns_addr_t *a, const dns_live_op_t *op)
+{
+	return a->family == op->family && a->prefix == op->prefix &&
+		memcmp(a->bytes, op->addr, dns_addr_bits(op->family) / 8) == 0;
+}
+
+/*
+ * Applies op over table t: ADD appends the address (or sets the weight of
+ * one already there), DEL drops one address, or the name when op has
+ * none. Returns DNS_LIVE_DONE with the name's new entry in *out (valid
+ * for the caller's reader section), DNS_LIVE_ABSENT when there was
+ * nothing to delete, DNS_LIVE_FULL when the name has DNS_MAX_ADDRS.
+ */
+static inline int dns_live_apply(dns_live_t *l, const dns_table_t *t, const dns_live_op_t *op,
+	dns_live_entry_t **out)
+{
+	size_t len = op->name_len;
+	uint32_t h32 = dns_hash32(dns_hash64(op->name, len));
+	pthread_mutex_lock(&l->lock);
+	dns_live_slots_t *s = atomic_load_explicit(&l->slots, memory_order_relaxed);
+	uint32_t pos = dns_live_probe(s, op->name, len, h32);
+	dns_live_entry_t *cur = atomic_load_explicit(&s->slot[pos], memory_order_relaxed);
+
+	/* The name's addresses as they stand: from the overlay, else from t. */
+	dns_addr_t a[DNS_MAX_ADDRS];
+	int n = 0;
+	const dns_rec_t *r = cur ? NULL : dns_table_find(t, op->name);
+	if (cur)
+		n = dns_live_addrs(cur, a);
+	else if (r)
+		n = dns_rec_addrs(t, r, a, DNS_MAX_ADDRS);
+	if (n < 0)
+		n = 0;
+
+	int found = -1;
+	for (int i = 0; i < n && op->family; i++) {
+		if (dns_addr_same(&a[i], op))
+			found = i;
+	}
+	int rc = DNS_LIVE_DONE;
+	if (op->op == DNS_LIVE_ADD) {
+		if (found >= 0) {
+			a[found].weight = op->weight;
+		} else if (n == DNS_MAX_ADDRS) {
+			rc = DNS_LIVE_FULL;
+		} else {
+			a[n].family = op->family;
+			a[n].prefix = op->prefix;
+			a[n].weight = op->weight;
+			a[n].bytes = op->addr;
+			n++;
+		}
+	} else if (n == 0 || (op->family && found < 0)) {
+		rc = DNS_LIVE_ABSENT;
+	} else if (op->family) {
+		memmove(&a[found], &a[found + 1], (size_t)(n - found - 1) * sizeof(a[0]));
+		n--;
+	} else {
+		n = 0;
+	}
+
+	if (rc == DNS_LIVE_DONE) {
+		dns_live_entry_t *e = dns_live_entry_new(op->name, len, h32, a, n);
+		atomic_store_explicit(&s->slot[pos], e, memory_order_release);
+		if (cur)
+			dns_live_retire(l, cur);
+		else if (atomic_fetch_add_explicit(&l->used, 1, memory_order_relaxed) + 1 >
+			(s->mask + 1) / 2)
+			dns_live_grow(l, t);
+		*out = e;
+	}
+	pthread_mutex_unlock(&l->lock);
+	return rc;
+}
+
+static inline int dns_live_is_update(const char *request)
+{
+	return strncasecmp(request, "ADD ", 4) == 0 || strncasecmp(request, "DEL ", 4) == 0;
+}
+
+/*
+ * Parses "ADD name ip[/len] [weight]" or "DEL name [ip[/len]]" into op.
+ * Returns NULL, or what is wrong with the request.
+ */
+static inline const char *dns_live_parse(const char *request, dns_live_op_t *op)
+{
+	memset(op, 0, sizeof(*op));
+	char verb[4], name[MAX_DOMAIN], ip[MAX_IP], wtext[16], extra[2];
+	uint16_t weight = 1;
+	int fields = sscanf(request, "%3s %255s %63s %15s %1s", verb, name, ip, wtext, extra);
+	op->op = strcasecmp(verb, "ADD") == 0 ? DNS_LIVE_ADD : DNS_LIVE_DEL;
+	int max = op->op == DNS_LIVE_ADD ? 4 : 3;
+	if (fields < 2 || fields > max || (op->op == DNS_LIVE_ADD && fields < 3))
+		return "usage: ADD name ip[/len] [weight] | DEL name [ip[/len]]";
+	if (fields == 4 && dns_parse_weight(wtext, &weight) != 0)
+		return "invalid weight (0-65535)";
+	int len = dns_lower(name, op->name);
+	if (len <= 0)
+		return "invalid name";
+	if (strncmp(op->name, "*.", 2) == 0)
+		return "wildcard names change only with the database";
+	op->name_len = (uint16_t)len;
+	op->weight = weight;
+	if (fields >= 3) {
+		op->family = dns_parse_prefix(ip, op->addr, &op->prefix);
+		if (op->family == 0)
+			return "invalid address";
+	}
+	return NULL;
+}
+
+static inline void dns_live_free(dns_live_t *l)
+{
+	dns_live_reclaim(l, UINT64_MAX);
+	dns_live_slots_t *s = atomic_load(&l->slots);
+	for (uint32_t i = 0; s && i <= s->mask; i++)
+		free(atomic_load(&s->slot[i]));
+	free(s);
+	pthread_mutex_destroy(&l->lock);
+	memset(l, 0, sizeof(*l));
+}
+
+#endif
@@ -1,68 +1,139 @@
-#include "dns_common.h"
+#define _GNU_SOURCE
 
+#include "dns_cache.h"
+#include "dns_db.h"
+#include "dns_export.h"
+#include "dns_journal.h"
+#include "dns_live.h"
+#include "dns_shm.h"
+#include "dns_stats.h"
+#include "dns_wire.h"
+
+#include <libgen.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/un.h>
 
-typedef struct {
-	char domain[MAX_DOMAIN];
-	char ip[MAX_IP];
-} entry_t;
+/*
+ * The live table. Event loops read it without locks; the reload thread
+ * replaces it with publish_table() and frees the old one only after every
+ * loop has left the epoch in which it could still have seen it.
+ */
+static _Atomic(dns_table_t *) g_table;
+static _Atomic uint64_t g_epoch = 1;
+static const char *g_db_path = "./database.txt";
 
-static entry_t *g_entries = NULL;
-static size_t g_entry_count = 0;
-static size_t g_entry_cap = 0;
+/* ADD/DEL changes on top of g_table, retired under the same epochs. */
+static dns_live_t g_live;
 
-static void add_entry(const char *domain, const char *ip)
-{
-	if (g_entry_count == g_entry_cap) {
-		size_t new_cap = g_entry_cap ? g_entry_cap * 2 : 16;
-		entry_t *p = (entry_t *)realloc(g_entries, new_cap * sizeof(entry_t));
-		if (!p)
-			dns_die("realloc");
-		g_entries = p;
-		g_entry_cap = new_cap;
-	}
-	strncpy(g_entries[g_entry_count].domain, domain, MAX_DOMAIN - 1);
-	g_entries[g_entry_count].domain[MAX_DOMAIN - 1] = '\0';
-	strncpy(g_entries[g_entry_count].ip, ip, MAX_IP - 1);
-	g_entries[g_entry_count].ip[MAX_IP - 1] = '\0';
-	g_entry_count++;
-}
+/*
+ * -J: changes are journaled (see dns_journal.h). lock keeps the journal in
+ * the order changes were applied; the journal thread writes out pending
+ * and only then answers its waiters.
+ */
+typedef struct jwaiter {
+	struct jwaiter *next;
+	struct held *held;
+	uint32_t slot;
+	char reply[];
+} jwaiter_t;
 
-static void load_db(const char *path)
-{
-	FILE *f = fopen(path, "r");
-	if (!f)
-		dns_die("fopen database.txt");
+static struct {
+	const char *path;
+	char next_path[4096], snap_path[4096];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	dns_buf_t pending; /* records not yet written */
+	jwaiter_t *waiters_head, *waiters_tail;
+	uint64_t seq; /* of the last record appended */
+	int fd; /* the rest is the journal thread's */
+	uint64_t bytes; /* in the current file */
+	_Atomic uint64_t snapshot_bytes;
+	_Atomic int compacting;
+} g_journal = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .fd = -1};
 
-	char line[512];
-	while (fgets(line, sizeof(line), f)) {
-		trim_newline_dns(line);
-		if (line[0] == '\0' || line[0] == '#')
-			continue;
-		char domain[MAX_DOMAIN];
-		char ip[MAX_IP];
-		if (sscanf(line, "%255s %63s", domain, ip) == 2) {
-			add_entry(domain, ip);
-		}
+/* Forwarding mode: names missing from the table are asked of g_upstream. */
+static const char *g_upstream = NULL;
+static dns_cache_t g_cache;
+
+/* RFC 1035 front end: each loop has its own SO_REUSEPORT socket on it. */
+static struct sockaddr_in g_udp_addr;
+static int g_udp = 0;
+
+/*
+ * -M: the live table also sits in a sealed memfd that clients map through
+ * DNS_SHM_REQUEST. g_shm_lock pairs the current memfd with its generation.
+ */
+static dns_shm_ctl_t *g_shm = NULL;
+static int g_shm_ctl_fd = -1; /* read-only, handed to clients */
+static int g_shm_fd = -1;
+static pthread_mutex_t g_shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A text database is compiled in memory; a dns_compile image is mapped. */
+static dns_table_t *load_db(const char *path)
+{
+	dns_table_t *t = (dns_table_t *)calloc(1, sizeof(dns_table_t));
+	if (!t)
+		dns_die("calloc table");
+	size_t skipped = 0;
+	dns_load_stats_t ls;
+	if (dns_table_open(t, path, &skipped, &ls) != 0) {
+		free(t);
+		return NULL;
 	}
-	fclose(f);
+	if (skipped > 0)
+		fprintf(stderr, "[dns_server] Skipped %zu records (bad address or weight, or over %d "
+			"per name)\n", skipped, DNS_MAX_ADDRS);
+	/* Exports send the table from a descriptor; -M seals this same memfd. */
+	if (t->fd < 0 && dns_table_to_memfd(t, MFD_ALLOW_SEALING, 0) != 0)
+		fprintf(stderr, "[dns_server] Cannot move the table into a memfd (%s), so it "
+			"cannot be exported\n", strerror(errno));
+	if (ls.threads > 0)
+		printf("[dns_server] Parsed %.1f MB on %d thread%s: map %.1f ms, parse %.1f ms, "
+			"merge %.1f ms, build %.1f ms\n", (double)ls.bytes / 1e6, ls.threads,
+			ls.threads == 1 ? "" : "s", ls.map_ms, ls.parse_ms, ls.merge_ms, ls.build_ms);
+	return t;
 }
 
-static const char *lookup_ip(const char *domain)
+/*
+ * All of the name's addresses, rotated for this answer; NULL if unknown.
+ * Online changes come first. Names the table was asked for and lacks are
+ * counted in st, with those the Bloom filter turned away on its own.
+ */
+static const char *lookup_ip(const dns_table_t *t, dns_stats_t *st, const char *domain,
+	char *buf, size_t bufsz)
 {
-	for (size_t i = 0; i < g_entry_count; i++) {
-		if (strcasecmp(g_entries[i].domain, domain) == 0)
-			return g_entries[i].ip;
+	dns_live_entry_t *e = dns_live_find(&g_live, domain);
+	if (e && e->addr_count > 0)
+		return dns_live_answer(e, buf, bufsz) == 0 ? buf : NULL;
+	const dns_rec_t *r = NULL;
+	if (!e) {
+		int filtered = 0;
+		r = dns_table_lookup(t, domain, &filtered);
+		dns_stat_add(st, DNS_STAT_ABSENT, r == NULL);
+		dns_stat_add(st, DNS_STAT_FILTERED, (uint64_t)filtered);
 	}
-	return NULL;
+	if (!r)
+		r = dns_table_find_wildcard(t, domain);
+	return r && dns_rec_answer(t, r, buf, bufsz) == 0 ? buf : NULL;
 }
 
 static int g_listen_fd = -1;
+static const char *g_sock_path = DNS_SOCK_PATH;
+static int g_seqpacket = 0; /* -S: clients talk SOCK_SEQPACKET */
 
 static void cleanup_socket(void)
 {
-	unlink(DNS_SOCK_PATH);
+	unlink(g_sock_path);
 }
 
 static void on_sigint(int sig)
@@ -74,85 +145,1894 @@ static void on_sigint(int sig)
 	_exit(0);
 }
 
-static void handle_client(int fd)
+/*
+ * Per-connection state for the event loop. in holds received bytes not yet
+ * parsed into frames and grows only for batch frames; replies are framed
+ * into out and flushed together as the socket accepts them.
+ */
+#define CONN_WBUF_HIGH (64 * 1024) /* stop reading while this much is queued */
+#define MAX_EVENTS 64
+#define ANSWER_LINE (-1) /* the answer is the whole reply line */
+
+/* A forwarded answer on its way to the loop that owns the request. */
+typedef struct answer_msg {
+	struct answer_msg *next;
+	struct held *held;
+	uint32_t slot;
+	int status; /* DNS_CACHE_HIT, _NEGATIVE, _FAIL or ANSWER_LINE */
+	char answer[];
+} answer_msg_t;
+
+/*
+ * One event loop per worker thread. All loops watch the shared listening
+ * socket (EPOLLEXCLUSIVE wakes only one of them per connection) and then
+ * own the connections they accepted, so no connection state is shared.
+ * A published table is immutable and is read by every thread without
+ * locks; active_epoch pins it for the duration of one epoll batch.
+ */
+typedef struct {
+	_Alignas(64) _Atomic uint64_t active_epoch; /* 0 while outside a batch */
+	const dns_table_t *table; /* valid while active_epoch != 0 */
+	int epoll_fd;
+	int id;
+	pthread_t thread;
+
+	/* Forwarding: this loop's pipelined upstream connection and the
+	 * lowercased names it is waiting on, oldest first. */
+	struct conn *upstream;
+	char **up_names;
+	size_t up_head, up_count, up_cap;
+
+	/* Answers posted by any loop for connections owned by this one. */
+	int mbox_fd; /* eventfd */
+	pthread_mutex_t mbox_lock;
+	answer_msg_t *mbox_head, *mbox_tail;
+
+	int udp_fd;
+	struct udp_batch *udp;
+
+	char *pkt; /* receive buffer for SOCK_SEQPACKET records */
+
+	dns_stats_t stats; /* written by this loop only */
+} loop_t;
+
+static loop_t *g_loops = NULL;
+static long g_nloops = 0;
+static uint64_t g_start_ns;
+
+static void epoch_enter(loop_t *loop)
+{
+	atomic_store(&loop->active_epoch, atomic_load(&g_epoch));
+	loop->table = atomic_load(&g_table);
+}
+
+static void epoch_exit(loop_t *loop)
+{
+	loop->table = NULL;
+	atomic_store_explicit(&loop->active_epoch, 0, memory_order_release);
+}
+
+/* Oldest epoch a loop may still be reading in; older retirees are unreachable. */
+static uint64_t epoch_safe(void)
+{
+	uint64_t safe = atomic_load(&g_epoch);
+	for (long i = 0; i < g_nloops; i++) {
+		uint64_t a = atomic_load(&g_loops[i].active_epoch);
+		if (a != 0 && a < safe)
+			safe = a;
+	}
+	return safe;
+}
+
+/*
+ * Swaps in t and reclaims the previous table. A loop that entered before
+ * the epoch advanced may still hold the old pointer, so wait until each
+ * loop is idle or has re-entered in a later epoch. Only the reloader
+ * waits; lookups never block.
+ */
+static void publish_table(dns_table_t *t)
+{
+	dns_table_t *old = atomic_exchange(&g_table, t);
+	uint64_t epoch = atomic_fetch_add(&g_epoch, 1) + 1;
+	for (long i = 0; i < g_nloops; i++) {
+		for (;;) {
+			uint64_t a = atomic_load(&g_loops[i].active_epoch);
+			if (a == 0 || a >= epoch)
+				break;
+			usleep(100);
+		}
+	}
+	if (old) {
+		dns_table_free(old);
+		free(old);
+	}
+}
+
+/*
+ * A reply that has to wait its turn: some of its names are being forwarded,
+ * or an earlier request's are. Lines hold the answers in request order; a
+ * pending slot holds the queried name until its answer arrives. Held
+ * replies queue on the connection and go out in order as their prefix
+ * completes, so misses are pipelined like hits.
+ */
+typedef struct held {
+	struct held *next;
+	struct conn *conn;
+	int batch;
+	uint32_t count;
+	uint32_t unresolved;
+	uint64_t start_ns; /* when the request was read, 0 for other replies */
+	char *lines[];
+} held_t;
+
+#define CONN_MAX_HELD 256 /* stop reading while this many replies wait */
+#define EXPORT_BURST 4 /* export steps per flush, so one export cannot hog its loop */
+
+/*
+ * An export under way (see dns_export.h). Its body follows the reply once
+ * out has drained, and the connection reads no more requests until it is
+ * done. fd holds the image whatever happens to the table meanwhile; a text
+ * export maps it again, with the online changes replayed over it.
+ */
+typedef struct export {
+	int text;
+	int fd;
+	off_t off; /* image bytes sent */
+	size_t size;
+	dns_buf_t snap; /* the online changes, as a journal snapshot */
+	dns_table_t table;
+	dns_live_t live;
+	_Atomic uint64_t epoch; /* live's, which has no readers but us */
+	uint32_t rec; /* next record to format, then next overlay slot */
+	uint32_t slot;
+} export_t;
+
+typedef struct conn {
+	int fd;
+	int seqpacket; /* a record per message; out's frames keep their prefix */
+	loop_t *loop;
+	int closing; /* close once out drains */
+	int dead; /* fd closed while answers are pending; freed by the last one */
+	held_t *held_head, *held_tail;
+	uint32_t nheld;
+	uint32_t waiting; /* pending slots over all held replies */
+	uint32_t events; /* currently registered epoll events */
+	dns_buf_t in;
+	dns_buf_t out;
+	int pass_fd[2]; /* fds to attach to the frame at out.buf + pass_at */
+	int npass;
+	size_t pass_at;
+	export_t *exp;
+} conn_t;
+
+static void held_free(held_t *h)
+{
+	for (uint32_t i = 0; i < h->count; i++)
+		free(h->lines[i]);
+	free(h);
+}
+
+static void export_free(export_t *x)
 {
+	if (x->text) {
+		dns_live_free(&x->live);
+		dns_table_free(&x->table);
+	}
+	dns_buf_free(&x->snap);
+	close(x->fd);
+	free(x);
+}
+
+static void conn_free(conn_t *c)
+{
+	if (c->exp)
+		export_free(c->exp);
+	for (int i = 0; i < c->npass; i++)
+		close(c->pass_fd[i]);
+	while (c->held_head) {
+		held_t *next = c->held_head->next;
+		held_free(c->held_head);
+		c->held_head = next;
+	}
+	dns_buf_free(&c->in);
+	dns_buf_free(&c->out);
+	free(c);
+}
+
+static void conn_close(conn_t *c)
+{
+	close(c->fd); /* also drops it from the epoll set */
+	if (c->waiting > 0) {
+		c->dead = 1; /* pending answers still point at c */
+		return;
+	}
+	conn_free(c);
+}
+
+static void conn_queue_msg(conn_t *c, const char *s)
+{
+	dns_stat_answer(&c->loop->stats, s);
+	dns_buf_put(&c->out, s, strlen(s));
+}
+
+/*
+ * Sends the frame at out.off with the pending fds attached: the rest of
+ * the stream, or that one record.
+ */
+static ssize_t conn_send_fds(conn_t *c)
+{
+	dns_buf_t *b = &c->out;
+	const char *p = b->buf + b->off;
+	size_t len = b->len - b->off;
+	if (c->seqpacket) {
+		uint32_t n;
+		memcpy(&n, p, sizeof(n));
+		p += sizeof(n);
+		len = n;
+	}
+	ssize_t w = dns_send_fds(c->fd, p, len, c->pass_fd, c->npass);
+	if (w < 0)
+		return -1;
+	for (int i = 0; i < c->npass; i++)
+		close(c->pass_fd[i]);
+	c->npass = 0;
+	b->off += c->seqpacket ? sizeof(uint32_t) + len : (size_t)w;
+	if (b->off == b->len)
+		b->off = b->len = 0;
+	return w;
+}
+
+/*
+ * Frames the next stretch of a text export into out: every name's lines,
+ * table records (unless changed online) and then the online changes, in
+ * frames of at most DNS_EXPORT_CHUNK; DNS_EXPORT_END ends it. Returns 1
+ * when that was the last.
+ */
+static int export_text(conn_t *c, export_t *x)
+{
+	dns_buf_t *b = &c->out;
+	const dns_table_t *t = &x->table;
+	dns_live_slots_t *s = atomic_load_explicit(&x->live.slots, memory_order_relaxed);
+	size_t at = b->len;
+	dns_buf_reserve(b, sizeof(uint32_t) + DNS_EXPORT_CHUNK);
+	b->len += sizeof(uint32_t);
+	char *limit = b->buf + at + sizeof(uint32_t) + DNS_EXPORT_CHUNK;
 	for (;;) {
+		dns_addr_t a[DNS_MAX_ADDRS];
+		const char *name;
+		int n;
+		if (x->rec < t->hdr->count) {
+			const dns_rec_t *r = &t->recs[x->rec];
+			name = dns_rec_name(t, r);
+			n = dns_live_find(&x->live, name) ? 0 : dns_rec_addrs(t, r, a, DNS_MAX_ADDRS);
+		} else if (x->slot <= s->mask) {
+			dns_live_entry_t *e = atomic_load_explicit(&s->slot[x->slot], memory_order_relaxed);
+			name = e ? dns_live_name(e) : "";
+			n = e ? dns_live_addrs(e, a) : 0;
+		} else {
+			break;
+		}
+		int w = n > 0 ? dns_addrs_lines(name, a, n, b->buf + b->len,
+			(size_t)(limit - (b->buf + b->len))) : 0;
+		if (w < 0)
+			break; /* the frame is full; this name starts the next */
+		b->len += (size_t)w;
+		if (x->rec < t->hdr->count)
+			x->rec++;
+		else
+			x->slot++;
+	}
+	uint32_t len = (uint32_t)(b->len - at - sizeof(uint32_t));
+	if (len > 0) {
+		memcpy(b->buf + at, &len, sizeof(len));
+		return 0;
+	}
+	b->len = at;
+	conn_queue_msg(c, DNS_EXPORT_END);
+	return 1;
+}
+
+/*
+ * Moves an export along once out is empty: an image goes by sendfile()
+ * as far as the socket takes it, then its snapshot is queued; text is
+ * queued a frame at a time. Returns 1 with more queued in out, 0 when the
+ * socket is full, -1 on a dead peer.
+ */
+static int export_next(conn_t *c)
+{
+	export_t *x = c->exp;
+	int done;
+	if (x->text) {
+		done = export_text(c, x);
+	} else if ((size_t)x->off < x->size) {
+		ssize_t w = sendfile(c->fd, x->fd, &x->off, x->size - (size_t)x->off);
+		if (w < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+		dns_stat_add(&c->loop->stats, DNS_STAT_BYTES_OUT, (uint64_t)w);
+		return 1;
+	} else {
+		dns_buf_reserve(&c->out, x->snap.len);
+		memcpy(c->out.buf + c->out.len, x->snap.buf, x->snap.len);
+		c->out.len += x->snap.len;
+		done = 1;
+	}
+	if (done) {
+		export_free(x);
+		c->exp = NULL;
+	}
+	return 1;
+}
+
+/* The queued frames part of conn_flush(). */
+static int conn_flush_out(conn_t *c)
+{
+	dns_buf_t *b = &c->out;
+	while (b->off < b->len) {
+		int pass = c->npass && b->off == c->pass_at;
+		size_t end = c->npass && c->pass_at > b->off ? c->pass_at : b->len;
+		ssize_t w = pass ? conn_send_fds(c) : dns_buf_send(b, c->fd, c->seqpacket, end);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			uint32_t len;
+			memcpy(&len, b->buf + b->off, sizeof(len));
+			if (errno == EMSGSIZE && c->seqpacket && len > MAX_REPLY) {
+				/* Bigger than the socket can carry: answer that instead, a
+				 * line per name of a batch, in the tail of the frame it
+				 * replaces. */
+				static const char msg[] = "ERROR: reply too large";
+				const char *body = b->buf + b->off + sizeof(len);
+				uint32_t lines = 1;
+				for (uint32_t i = 0; i < len; i++)
+					lines += body[i] == '\n';
+				if (lines * sizeof(msg) > len)
+					lines = 1;
+				uint32_t need = lines * (uint32_t)sizeof(msg) - 1;
+				b->off += len - need;
+				memcpy(b->buf + b->off, &need, sizeof(need));
+				char *out = b->buf + b->off + sizeof(need);
+				for (uint32_t i = 0; i < lines; i++, out += sizeof(msg)) {
+					memcpy(out, msg, sizeof(msg) - 1);
+					if (i + 1 < lines)
+						out[sizeof(msg) - 1] = '\n';
+				}
+				continue;
+			}
+			return -1;
+		}
+		if (c != c->loop->upstream)
+			dns_stat_add(&c->loop->stats, DNS_STAT_BYTES_OUT, (uint64_t)w);
+	}
+	return 0;
+}
+
+/*
+ * Writes as much of out as the socket takes, every queued frame in one
+ * send() (one sendmmsg() for records), then the next steps of any export
+ * behind it. Returns -1 on a dead peer.
+ */
+static int conn_flush(conn_t *c)
+{
+	dns_buf_t *b = &c->out;
+	for (int burst = 0;; burst++) {
+		int r = conn_flush_out(c);
+		if (r != 0 || b->off < b->len || !c->exp)
+			return r;
+		if (burst == EXPORT_BURST)
+			return 0; /* the rest on the next EPOLLOUT, after the loop's other work */
+		if ((r = export_next(c)) <= 0)
+			return r;
+	}
+}
+
+static void conn_set_events(conn_t *c, uint32_t events)
+{
+	if (events == c->events)
+		return;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = c;
+	if (epoll_ctl(c->loop->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+		dns_die("epoll_ctl");
+	c->events = events;
+}
+
+static char *xstrdup(const char *s)
+{
+	char *p = strdup(s);
+	if (!p)
+		dns_die("strdup");
+	return p;
+}
+
+static void upstream_query(loop_t *loop, const char *lower, size_t len, uint32_t hash);
+
+/* "PTR ip[/len]" and "CIDR ip[/len]" requests, from the table's reverse index. */
+static int reverse_reply(conn_t *c, const char *request, char *reply, size_t sz)
+{
+	int cidr = toupper((unsigned char)request[0]) == 'C';
+	const char *arg = request + (cidr ? 5 : 4);
+	char buf[MAX_REPLY - 3];
+	switch (dns_table_reverse(c->loop->table, arg, cidr, buf, sizeof(buf))) {
+	case 0:
+		return snprintf(reply, sz, "OK %s", buf);
+	case -1:
+		return snprintf(reply, sz, "NOTFOUND %s", arg);
+	default:
+		return snprintf(reply, sz, "ERROR: invalid address %s", arg);
+	}
+}
+
+/* Queues op's record and parks reply as slot of h until it is on disk. Journal lock held. */
+static void journal_append(const dns_live_op_t *op, held_t *h, uint32_t slot, const char *reply)
+{
+	dns_journal_encode(&g_journal.pending, ++g_journal.seq, op);
+	size_t len = strlen(reply);
+	jwaiter_t *w = (jwaiter_t *)malloc(sizeof(*w) + len + 1);
+	if (!w)
+		dns_die("malloc journal waiter");
+	w->next = NULL;
+	w->held = h;
+	w->slot = slot;
+	memcpy(w->reply, reply, len + 1);
+	if (g_journal.waiters_tail)
+		g_journal.waiters_tail->next = w;
+	else
+		g_journal.waiters_head = w;
+	g_journal.waiters_tail = w;
+	pthread_cond_signal(&g_journal.cond);
+}
+
+/*
+ * "ADD name ip[/len] [weight]" and "DEL name [ip[/len]]": applies the
+ * change and answers "ADDED name ips" or "DELETED name [ip]" with the
+ * name's addresses after it, or "ABSENT name [ip]" when there was nothing
+ * to delete. With -J a change is answered as slot of h once it is on
+ * disk, and 0 is returned; lookups see it straight away.
+ */
+static int update_reply(conn_t *c, held_t *h, uint32_t slot, const char *request, char *reply,
+	size_t sz)
+{
+	dns_live_op_t op;
+	const char *err = dns_live_parse(request, &op);
+	if (err)
+		return snprintf(reply, sz, "ERROR: %s", err);
+	dns_live_entry_t *e = NULL;
+	if (g_journal.path)
+		pthread_mutex_lock(&g_journal.lock);
+	int rc = dns_live_apply(&g_live, c->loop->table, &op, &e);
+	int n;
+	if (rc == DNS_LIVE_FULL) {
+		n = snprintf(reply, sz, "ERROR: %s has %d addresses", op.name, DNS_MAX_ADDRS);
+	} else if (op.op == DNS_LIVE_DEL) {
+		char ip[MAX_IP] = "";
+		if (op.family)
+			dns_addr_format(op.family, op.prefix, op.addr, ip, sizeof(ip));
+		n = snprintf(reply, sz, "%s %s%s%s", rc == DNS_LIVE_DONE ? "DELETED" : "ABSENT",
+			op.name, op.family ? " " : "", ip);
+	} else {
+		dns_addr_t a[DNS_MAX_ADDRS];
+		char ipbuf[DNS_MAX_ADDRS * MAX_IP];
+		if (dns_addrs_answer(a, dns_live_addrs(e, a), ipbuf, sizeof(ipbuf)) != 0)
+			ipbuf[0] = '\0';
+		n = snprintf(reply, sz, "ADDED %s %s", op.name, ipbuf);
+	}
+	if (rc == DNS_LIVE_DONE) {
+		dns_stat_add(&c->loop->stats, DNS_STAT_UPDATES, 1);
+		if (g_journal.path) {
+			journal_append(&op, h, slot, reply);
+			n = 0;
+		}
+	}
+	if (g_journal.path)
+		pthread_mutex_unlock(&g_journal.lock);
+	dns_live_reclaim(&g_live, epoch_safe());
+	return n;
+}
+
+/*
+ * Answers domain from the table into reply ("OK name ips", or "NOTFOUND
+ * name" when not forwarding); returns the length, 0 if the cache must be
+ * asked or, for a journaled update, update_reply() with a held reply.
+ * Reverse lookups are never forwarded.
+ */
+static int table_reply(conn_t *c, const char *domain, char *reply, size_t sz)
+{
+	if (strncasecmp(domain, "PTR ", 4) == 0 || strncasecmp(domain, "CIDR ", 5) == 0)
+		return reverse_reply(c, domain, reply, sz);
+	if (dns_live_is_update(domain))
+		return g_journal.path ? 0 : update_reply(c, NULL, 0, domain, reply, sz);
+	char ipbuf[DNS_MAX_ADDRS * MAX_IP];
+	if (lookup_ip(c->loop->table, &c->loop->stats, domain, ipbuf, sizeof(ipbuf)))
+		return snprintf(reply, sz, "OK %s %s", domain, ipbuf);
+	if (!g_upstream)
+		return snprintf(reply, sz, "NOTFOUND %s", domain);
+	return 0;
+}
+
+/*
+ * Answers domain from the forwarding cache; returns the reply length, or
+ * 0 when the name was parked as slot of h until upstream answers.
+ */
+static int cache_reply(conn_t *c, held_t *h, uint32_t slot, const char *domain, char *reply,
+	size_t sz)
+{
+	char lower[MAX_DOMAIN];
+	char ipbuf[DNS_MAX_ADDRS * MAX_IP];
+	int len = dns_lower(domain, lower);
+	uint32_t hash = dns_hash32(dns_hash64(lower, (size_t)len));
+	switch (dns_cache_lookup(&g_cache, lower, (size_t)len, hash, h, slot, ipbuf,
+		sizeof(ipbuf))) {
+	case DNS_CACHE_HIT:
+		dns_stat_add(&c->loop->stats, DNS_STAT_CACHE_HITS, 1);
+		return snprintf(reply, sz, "OK %s %s", domain, ipbuf);
+	case DNS_CACHE_NEGATIVE:
+		return snprintf(reply, sz, "NOTFOUND %s", domain);
+	case DNS_CACHE_MISS:
+		upstream_query(c->loop, lower, (size_t)len, hash);
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+static held_t *held_new(conn_t *c, int batch, uint32_t count)
+{
+	held_t *h = (held_t *)calloc(1, sizeof(held_t) + count * sizeof(char *));
+	if (!h)
+		dns_die("calloc held");
+	h->conn = c;
+	h->batch = batch;
+	h->count = count;
+	return h;
+}
+
+/* Fills slot of h from the table or cache, or leaves it pending. */
+static void held_resolve(conn_t *c, held_t *h, uint32_t slot, const char *domain)
+{
+	char reply[MAX_REPLY];
+	if (table_reply(c, domain, reply, sizeof(reply)) > 0 ||
+		(dns_live_is_update(domain) ? update_reply(c, h, slot, domain, reply, sizeof(reply)) :
+		cache_reply(c, h, slot, domain, reply, sizeof(reply))) > 0) {
+		h->lines[slot] = xstrdup(reply);
+	} else {
+		h->lines[slot] = xstrdup(domain);
+		h->unresolved++;
+	}
+}
+
+/* Frames a completed held reply into out. */
+static void held_write(conn_t *c, const held_t *h)
+{
+	if (!h->batch) {
+		conn_queue_msg(c, h->lines[0]);
+		return;
+	}
+	size_t len = 0;
+	for (uint32_t i = 0; i < h->count; i++)
+		len += strlen(h->lines[i]) + (i > 0);
+	uint32_t len32 = (uint32_t)len;
+	dns_buf_t *b = &c->out;
+	dns_buf_reserve(b, sizeof(len32) + len);
+	memcpy(b->buf + b->len, &len32, sizeof(len32));
+	b->len += sizeof(len32);
+	for (uint32_t i = 0; i < h->count; i++) {
+		dns_stat_answer(&c->loop->stats, h->lines[i]);
+		if (i > 0)
+			b->buf[b->len++] = '\n';
+		size_t n = strlen(h->lines[i]);
+		memcpy(b->buf + b->len, h->lines[i], n);
+		b->len += n;
+	}
+}
+
+/* Sends the completed replies at the front of the held queue. */
+static void conn_release_held(conn_t *c)
+{
+	while (c->held_head && c->held_head->unresolved == 0) {
+		held_t *h = c->held_head;
+		c->held_head = h->next;
+		if (!c->held_head)
+			c->held_tail = NULL;
+		c->nheld--;
+		held_write(c, h);
+		if (h->start_ns)
+			dns_stat_latency(&c->loop->stats, dns_now_ns() - h->start_ns);
+		held_free(h);
+	}
+}
+
+static void conn_hold(conn_t *c, held_t *h)
+{
+	if (c->held_tail)
+		c->held_tail->next = h;
+	else
+		c->held_head = h;
+	c->held_tail = h;
+	c->nheld++;
+	c->waiting += h->unresolved;
+	conn_release_held(c);
+}
+
+/*
+ * Queues a one-line reply, behind any replies still waiting. start_ns is
+ * when the request was read, to time the answer; 0 for anything else.
+ */
+static void conn_reply(conn_t *c, const char *msg, uint64_t start_ns)
+{
+	if (!c->held_head) {
+		conn_queue_msg(c, msg);
+		if (start_ns)
+			dns_stat_latency(&c->loop->stats, dns_now_ns() - start_ns);
+		return;
+	}
+	held_t *h = held_new(c, 0, 1);
+	h->lines[0] = xstrdup(msg);
+	h->start_ns = start_ns;
+	conn_hold(c, h);
+}
+
+/* "__stats__" and "__stats_json__": every loop's counters, merged. */
+static void stats_reply(conn_t *c, int json)
+{
+	dns_stats_snap_t snap;
+	memset(&snap, 0, sizeof(snap));
+	for (long i = 0; i < g_nloops; i++)
+		dns_stats_merge(&snap, &g_loops[i].stats);
+	const dns_table_t *t = c->loop->table;
+	unsigned long long bloom = (unsigned long long)t->hdr->sec[DNS_SEC_BLOOM].size;
+	double bits = t->hdr->count ? (double)bloom * 8 / t->hdr->count : 0.0;
+	double fpr = dns_bloom_fpr(t);
+	unsigned live = atomic_load_explicit(&g_live.used, memory_order_relaxed);
+	char extra[512];
+	if (json)
+		snprintf(extra, sizeof(extra),
+			"\"threads\": %ld, \"records\": %u, \"table_bytes\": %llu, "
+			"\"bloom_bytes\": %llu, \"bloom_bits_per_name\": %.2f, "
+			"\"bloom_fpr_expected\": %.5f, \"live_names\": %u", g_nloops, t->hdr->count,
+			(unsigned long long)t->hdr->total_size, bloom, bits, fpr, live);
+	else
+		snprintf(extra, sizeof(extra), "dns_server: %ld threads, %u records (%llu bytes), "
+			"%u names changed online\nbloom filter %llu bytes (%.1f bits/name), "
+			"expected fpr %.3f%%", g_nloops, t->hdr->count,
+			(unsigned long long)t->hdr->total_size, live, bloom, bits, fpr * 100.0);
+	char out[2048];
+	double uptime = (double)(dns_now_ns() - g_start_ns) / 1e9;
+	if (dns_stats_format(&snap, uptime, json, extra, out, sizeof(out)) < 0)
+		snprintf(out, sizeof(out), "ERROR: stats do not fit");
+	conn_reply(c, out, 0);
+}
+
+/*
+ * DNS_SHM_REQUEST: "SHM generation size", carrying the table's memfd and
+ * the control page. Not counted as a query.
+ */
+static void shm_reply(conn_t *c)
+{
+	const char *err = !g_shm ? "ERROR: shared memory is off (start the server with -M)" :
+		c->held_head || c->npass ? "ERROR: shared memory busy, retry" : NULL;
+	if (err) {
+		conn_reply(c, err, 0);
+		return;
+	}
+	pthread_mutex_lock(&g_shm_lock);
+	int table_fd = fcntl(g_shm_fd, F_DUPFD_CLOEXEC, 0);
+	uint64_t gen = atomic_load(&g_shm->generation);
+	pthread_mutex_unlock(&g_shm_lock);
+	int ctl_fd = fcntl(g_shm_ctl_fd, F_DUPFD_CLOEXEC, 0);
+	struct stat st;
+	if (table_fd < 0 || ctl_fd < 0 || fstat(table_fd, &st) != 0) {
+		if (table_fd >= 0)
+			close(table_fd);
+		if (ctl_fd >= 0)
+			close(ctl_fd);
+		conn_reply(c, "ERROR: shared memory unavailable", 0);
+		return;
+	}
+	char msg[64];
+	snprintf(msg, sizeof(msg), "SHM %llu %lld", (unsigned long long)gen, (long long)st.st_size);
+	c->pass_at = c->out.len;
+	c->pass_fd[0] = table_fd;
+	c->pass_fd[1] = ctl_fd;
+	c->npass = 2;
+	conn_queue_msg(c, msg);
+}
+
+/* DNS_EXPORT_REQUEST and DNS_EXPORT_TEXT_REQUEST: starts streaming the table. */
+static void export_reply(conn_t *c, int text)
+{
+	const char *err = !text && c->seqpacket ? "ERROR: image export needs a stream socket" :
+		c->held_head || c->npass ? "ERROR: export busy, retry" : NULL;
+	if (err) {
+		conn_reply(c, err, 0);
+		return;
+	}
+	export_t *x = (export_t *)calloc(1, sizeof(*x));
+	if (!x)
+		dns_die("calloc export");
+	const dns_table_t *t = c->loop->table;
+	x->text = text;
+	x->size = (size_t)t->hdr->total_size;
+	/* The file the table was mapped from, or the memfd load_db() moved it into. */
+	x->fd = t->fd >= 0 ? fcntl(t->fd, F_DUPFD_CLOEXEC, 0) : -1;
+	if (x->fd < 0) {
+		free(x);
+		conn_reply(c, "ERROR: export unavailable", 0);
+		return;
+	}
+
+	/* With -J the snapshot covers exactly the journal up to its seq. */
+	if (g_journal.path)
+		pthread_mutex_lock(&g_journal.lock);
+	dns_journal_snapshot(&g_live, g_journal.seq, &x->snap);
+	if (g_journal.path)
+		pthread_mutex_unlock(&g_journal.lock);
+
+	char msg[96];
+	if (text) {
+		void *m = mmap(NULL, x->size, PROT_READ, MAP_SHARED, x->fd, 0);
+		if (m == MAP_FAILED || dns_table_attach(&x->table, (uint8_t *)m, x->size, 1) != 0) {
+			if (m != MAP_FAILED)
+				munmap(m, x->size);
+			x->text = 0; /* nothing of the text side to free */
+			export_free(x);
+			conn_reply(c, "ERROR: export unavailable", 0);
+			return;
+		}
+		dns_live_init(&x->live, &x->epoch);
+		dns_replay_t r;
+		memset(&r, 0, sizeof(r));
+		dns_journal_apply((const uint8_t *)x->snap.buf, x->snap.len, DNS_SNAPSHOT_MAGIC,
+			&x->live, &x->table, &r);
+		snprintf(msg, sizeof(msg), "EXPORT text");
+	} else {
+		snprintf(msg, sizeof(msg), "EXPORT image %zu %zu", x->size, x->snap.len);
+	}
+	conn_queue_msg(c, msg);
+	c->exp = x;
+}
+
+static void handle_request(conn_t *c, const char *domain)
+{
+	if (strcasecmp(domain, "exit") == 0) {
+		conn_reply(c, "bye", 0);
+		c->closing = 1;
+		return;
+	}
+	int json = strcmp(domain, "__stats_json__") == 0;
+	if (json || strcmp(domain, "__stats__") == 0) {
+		stats_reply(c, json);
+		return;
+	}
+	if (strcmp(domain, DNS_SHM_REQUEST) == 0) {
+		shm_reply(c);
+		return;
+	}
+	int text = strcmp(domain, DNS_EXPORT_TEXT_REQUEST) == 0;
+	if (text || strcmp(domain, DNS_EXPORT_REQUEST) == 0) {
+		export_reply(c, text);
+		return;
+	}
+
+	uint64_t start = dns_now_ns();
+	char reply[MAX_REPLY];
+	if (table_reply(c, domain, reply, sizeof(reply)) > 0) {
+		conn_reply(c, reply, start);
+		return;
+	}
+	held_t *h = held_new(c, 0, 1);
+	h->start_ns = start;
+	held_resolve(c, h, 0, domain);
+	conn_hold(c, h);
+}
+
+/* Answers a batch frame's names (after the tag) with one reply frame. */
+static void handle_batch(conn_t *c, const char *names, size_t len)
+{
+	/* Split and check first, so a bad batch gets no partial answer. */
+	const char *name[DNS_MAX_BATCH];
+	size_t nlen[DNS_MAX_BATCH];
+	uint32_t count = 0, updates = 0;
+	const char *p = names, *end = names + len;
+	while (p < end) {
+		const char *nl = (const char *)memchr(p, '\n', (size_t)(end - p));
+		size_t n = nl ? (size_t)(nl - p) : (size_t)(end - p);
+		if (n == 0 || n >= MAX_DOMAIN || count == DNS_MAX_BATCH) {
+			conn_reply(c, "ERROR: invalid request", 0);
+			c->closing = 1;
+			return;
+		}
+		updates += n > 4 && dns_live_is_update(p);
+		name[count] = p;
+		nlen[count++] = n;
+		p += n + 1;
+	}
+
+	uint64_t start = dns_now_ns();
+	if (g_upstream || (updates && g_journal.path)) {
+		/* Some answers may have to wait; collect them in a held reply. */
+		held_t *h = held_new(c, 1, count);
+		h->start_ns = start;
+		for (uint32_t i = 0; i < count; i++) {
+			char domain[MAX_DOMAIN];
+			memcpy(domain, name[i], nlen[i]);
+			domain[nlen[i]] = '\0';
+			held_resolve(c, h, i, domain);
+		}
+		conn_hold(c, h);
+		return;
+	}
+
+	dns_buf_t *b = &c->out;
+	size_t at = b->len;
+	dns_buf_reserve(b, sizeof(uint32_t));
+	b->len += sizeof(uint32_t);
+	for (uint32_t i = 0; i < count; i++) {
 		char domain[MAX_DOMAIN];
-		int rr = recv_msg(fd, domain, sizeof(domain));
-		if (rr == -2)
-			return; /* client closed */
-		if (rr != 0) {
-			(void)send_msg(fd, "ERROR: invalid request");
+		memcpy(domain, name[i], nlen[i]);
+		domain[nlen[i]] = '\0';
+		char reply[MAX_REPLY + 1];
+		int w = table_reply(c, domain, reply, sizeof(reply) - 1);
+		dns_stat_answer(&c->loop->stats, reply);
+		if (i + 1 < count)
+			reply[w++] = '\n';
+		dns_buf_reserve(b, (size_t)w);
+		memcpy(b->buf + b->len, reply, (size_t)w);
+		b->len += (size_t)w;
+	}
+	uint32_t rlen = (uint32_t)(b->len - at - sizeof(uint32_t));
+	memcpy(b->buf + at, &rlen, sizeof(rlen));
+	dns_stat_latency(&c->loop->stats, dns_now_ns() - start);
+}
+
+static void handle_message(conn_t *c, const char *payload, size_t len, int batch)
+{
+	if (batch) {
+		handle_batch(c, payload + DNS_BATCH_TAG_LEN, len - DNS_BATCH_TAG_LEN);
+		return;
+	}
+	char domain[MAX_DOMAIN];
+	memcpy(domain, payload, len);
+	domain[len] = '\0';
+	handle_request(c, domain);
+}
+
+/*
+ * Answers every complete frame in in, same framing as recv_msg(). A frame
+ * too long for one name must be a batch; in grows to hold it.
+ */
+static void conn_process(conn_t *c)
+{
+	while (!c->closing && c->nheld < CONN_MAX_HELD && !c->exp) {
+		char *payload;
+		size_t len;
+		int f = dns_buf_frame(&c->in, MAX_BATCH_MSG, &payload, &len);
+		if (f == 0)
+			break;
+		int batch = f > 0 && len >= DNS_BATCH_TAG_LEN &&
+			memcmp(payload, DNS_BATCH_TAG, DNS_BATCH_TAG_LEN) == 0;
+		if (f < 0 || (len >= MAX_DOMAIN && !batch)) {
+			conn_reply(c, "ERROR: invalid request", 0);
+			c->closing = 1;
+			break;
+		}
+		handle_message(c, payload, len, batch);
+	}
+}
+
+/*
+ * SOCK_SEQPACKET: each recv is one whole message, read into the loop's
+ * buffer and answered straight away; nothing is left to reassemble.
+ */
+static int conn_on_records(conn_t *c)
+{
+	char *pkt = c->loop->pkt;
+	while (!c->closing && c->nheld < CONN_MAX_HELD && !c->exp &&
+		dns_buf_pending(&c->out) < CONN_WBUF_HIGH) {
+		ssize_t r = recv(c->fd, pkt, MAX_BATCH_MSG + 1, MSG_TRUNC);
+		if (r == 0)
+			return -1; /* client closed */
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		dns_stat_add(&c->loop->stats, DNS_STAT_BYTES_IN, (uint64_t)r);
+		size_t len = (size_t)r;
+		int batch = len >= DNS_BATCH_TAG_LEN &&
+			memcmp(pkt, DNS_BATCH_TAG, DNS_BATCH_TAG_LEN) == 0;
+		if (len > MAX_BATCH_MSG || (len >= MAX_DOMAIN && !batch)) {
+			conn_reply(c, "ERROR: invalid request", 0);
+			c->closing = 1;
+			break;
+		}
+		handle_message(c, pkt, len, batch);
+	}
+	return 0;
+}
+
+/* Returns -1 when the connection should be dropped now. */
+static int conn_on_readable(conn_t *c)
+{
+	if (c->seqpacket)
+		return conn_on_records(c);
+	for (;;) {
+		ssize_t r = dns_buf_fill(&c->in, c->fd);
+		if (r == 0)
+			return -1; /* client closed */
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		dns_stat_add(&c->loop->stats, DNS_STAT_BYTES_IN, (uint64_t)r);
+		conn_process(c);
+		if (c->closing || c->nheld >= CONN_MAX_HELD || c->exp ||
+			dns_buf_pending(&c->out) >= CONN_WBUF_HIGH)
+			break;
+	}
+	return 0;
+}
+
+/* Flushes and re-arms epoll for what the connection waits on next. */
+static int conn_update(conn_t *c)
+{
+	for (;;) {
+		int exporting = c->exp != NULL;
+		if (conn_flush(c) != 0)
+			return -1;
+		if (!exporting || c->exp)
+			break;
+		conn_process(c); /* requests that came in behind the export */
+	}
+	size_t queued = dns_buf_pending(&c->out);
+	if (queued == 0 && c->closing && !c->held_head && !c->exp)
+		return -1;
+	uint32_t events = 0;
+	if (!c->closing && c->nheld < CONN_MAX_HELD && queued < CONN_WBUF_HIGH && !c->exp)
+		events |= EPOLLIN;
+	if (queued > 0 || c->exp)
+		events |= EPOLLOUT;
+	conn_set_events(c, events);
+	return 0;
+}
+
+/* ---- forwarding ---- */
+
+/* Hands a forwarded (or journaled) answer to the loop that owns h's connection. */
+static void post_answer(held_t *h, uint32_t slot, int status, const char *answer)
+{
+	size_t alen = answer ? strlen(answer) : 0;
+	answer_msg_t *m = (answer_msg_t *)malloc(sizeof(*m) + alen + 1);
+	if (!m)
+		dns_die("malloc answer");
+	m->next = NULL;
+	m->held = h;
+	m->slot = slot;
+	m->status = status;
+	memcpy(m->answer, answer ? answer : "", alen + 1);
+
+	loop_t *loop = h->conn->loop;
+	pthread_mutex_lock(&loop->mbox_lock);
+	int was_empty = loop->mbox_head == NULL;
+	if (loop->mbox_tail)
+		loop->mbox_tail->next = m;
+	else
+		loop->mbox_head = m;
+	loop->mbox_tail = m;
+	pthread_mutex_unlock(&loop->mbox_lock);
+	if (was_empty) {
+		uint64_t one = 1;
+		if (write(loop->mbox_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			dns_die("write eventfd");
+	}
+}
+
+/* Records the upstream result for a name and answers everyone waiting on it. */
+static void upstream_done(const char *lower, size_t len, uint32_t hash, int status,
+	const char *answer)
+{
+	dns_waiter_t *w = dns_cache_complete(&g_cache, lower, len, hash, status, answer);
+	while (w) {
+		dns_waiter_t *next = w->next;
+		post_answer((held_t *)w->owner, w->slot, status, answer);
+		free(w);
+		w = next;
+	}
+}
+
+/* Fails every query in flight on the upstream connection and drops it. */
+static void upstream_fail(loop_t *loop)
+{
+	conn_t *u = loop->upstream;
+	close(u->fd);
+	conn_free(u);
+	loop->upstream = NULL;
+	for (; loop->up_count > 0; loop->up_count--) {
+		char *name = loop->up_names[loop->up_head];
+		loop->up_head = (loop->up_head + 1) % loop->up_cap;
+		size_t len = strlen(name);
+		upstream_done(name, len, dns_hash32(dns_hash64(name, len)), DNS_CACHE_FAIL, NULL);
+		free(name);
+	}
+}
+
+static int upstream_connect(loop_t *loop)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, g_upstream, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+		perror("[dns_server] upstream connect");
+		close(fd);
+		return -1;
+	}
+
+	conn_t *u = (conn_t *)calloc(1, sizeof(conn_t));
+	if (!u)
+		dns_die("calloc conn");
+	u->fd = fd;
+	u->loop = loop;
+	u->events = EPOLLIN;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = u->events;
+	ev.data.ptr = u;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		dns_die("epoll_ctl");
+	loop->upstream = u;
+	return 0;
+}
+
+/*
+ * Sends one lowercased name upstream. Queries are pipelined on the loop's
+ * connection and flushed once per epoll batch; the upstream answers in
+ * order, so up_names says which name each reply belongs to.
+ */
+static void upstream_query(loop_t *loop, const char *lower, size_t len, uint32_t hash)
+{
+	if (!loop->upstream && upstream_connect(loop) != 0) {
+		upstream_done(lower, len, hash, DNS_CACHE_FAIL, NULL);
+		return;
+	}
+	if (loop->up_count == loop->up_cap) {
+		size_t cap = loop->up_cap ? loop->up_cap * 2 : 64;
+		char **names = (char **)malloc(cap * sizeof(char *));
+		if (!names)
+			dns_die("malloc");
+		for (size_t i = 0; i < loop->up_count; i++)
+			names[i] = loop->up_names[(loop->up_head + i) % loop->up_cap];
+		free(loop->up_names);
+		loop->up_names = names;
+		loop->up_head = 0;
+		loop->up_cap = cap;
+	}
+	loop->up_names[(loop->up_head + loop->up_count++) % loop->up_cap] = xstrdup(lower);
+	dns_stat_add(&loop->stats, DNS_STAT_FORWARDED, 1);
+	conn_queue_msg(loop->upstream, lower);
+}
+
+/* Matches upstream replies to the names in flight. */
+static void upstream_on_readable(loop_t *loop)
+{
+	conn_t *u = loop->upstream;
+	for (;;) {
+		ssize_t r = dns_buf_fill(&u->in, u->fd);
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
 			return;
+		if (r <= 0) {
+			fprintf(stderr, "[dns_server] Upstream connection lost\n");
+			upstream_fail(loop);
+			return;
+		}
+
+		char *payload;
+		size_t len;
+		int f;
+		while ((f = dns_buf_frame(&u->in, MAX_REPLY - 1, &payload, &len)) != 0) {
+			if (f < 0 || loop->up_count == 0) {
+				fprintf(stderr, "[dns_server] Bad reply from upstream\n");
+				upstream_fail(loop);
+				return;
+			}
+			char msg[MAX_REPLY];
+			memcpy(msg, payload, len);
+			msg[len] = '\0';
+
+			char *name = loop->up_names[loop->up_head];
+			loop->up_head = (loop->up_head + 1) % loop->up_cap;
+			loop->up_count--;
+			size_t nlen = strlen(name);
+			uint32_t hash = dns_hash32(dns_hash64(name, nlen));
+			const char *ips = strncmp(msg, "OK ", 3) == 0 ? strchr(msg + 3, ' ') : NULL;
+			if (ips)
+				upstream_done(name, nlen, hash, DNS_CACHE_HIT, ips + 1);
+			else if (strncmp(msg, "NOTFOUND", 8) == 0)
+				upstream_done(name, nlen, hash, DNS_CACHE_NEGATIVE, NULL);
+			else
+				upstream_done(name, nlen, hash, DNS_CACHE_FAIL, NULL);
+			free(name);
+		}
+	}
+}
+
+static void upstream_update(loop_t *loop)
+{
+	conn_t *u = loop->upstream;
+	if (conn_flush(u) != 0) {
+		fprintf(stderr, "[dns_server] Upstream connection lost\n");
+		upstream_fail(loop);
+		return;
+	}
+	conn_set_events(u, EPOLLIN | (dns_buf_pending(&u->out) > 0 ? EPOLLOUT : 0));
+}
+
+/* Fills in one forwarded answer and sends whatever it completes. */
+static void deliver_answer(answer_msg_t *m)
+{
+	held_t *h = m->held;
+	conn_t *c = h->conn;
+	const char *domain = h->lines[m->slot];
+	char reply[MAX_REPLY];
+	if (m->status == ANSWER_LINE)
+		snprintf(reply, sizeof(reply), "%s", m->answer);
+	else if (m->status == DNS_CACHE_HIT)
+		snprintf(reply, sizeof(reply), "OK %s %s", domain, m->answer);
+	else if (m->status == DNS_CACHE_NEGATIVE)
+		snprintf(reply, sizeof(reply), "NOTFOUND %s", domain);
+	else
+		snprintf(reply, sizeof(reply), "ERROR: upstream unavailable");
+	free(h->lines[m->slot]);
+	h->lines[m->slot] = xstrdup(reply);
+	h->unresolved--;
+	c->waiting--;
+
+	if (c->dead) {
+		if (c->waiting == 0)
+			conn_free(c);
+		return;
+	}
+	conn_release_held(c);
+	conn_process(c); /* frames left unread while too many replies were held */
+	if (conn_update(c) != 0)
+		conn_close(c);
+}
+
+static void mbox_drain(loop_t *loop)
+{
+	uint64_t v;
+	if (read(loop->mbox_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		dns_die("read eventfd");
+	pthread_mutex_lock(&loop->mbox_lock);
+	answer_msg_t *m = loop->mbox_head;
+	loop->mbox_head = loop->mbox_tail = NULL;
+	pthread_mutex_unlock(&loop->mbox_lock);
+	while (m) {
+		answer_msg_t *next = m->next;
+		deliver_answer(m);
+		free(m);
+		m = next;
+	}
+}
+
+static void accept_clients(loop_t *loop)
+{
+	for (;;) {
+		int fd = accept4(g_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EMFILE || errno == ENFILE) {
+				perror("accept4");
+				return;
+			}
+			dns_die("accept4");
 		}
 
-		if (strcasecmp(domain, "exit") == 0) {
-			(void)send_msg(fd, "bye");
+		conn_t *c = (conn_t *)calloc(1, sizeof(conn_t));
+		if (!c)
+			dns_die("calloc conn");
+		dns_stat_add(&loop->stats, DNS_STAT_CONNS, 1);
+		c->fd = fd;
+		c->seqpacket = g_seqpacket;
+		c->loop = loop;
+		c->events = EPOLLIN;
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = c->events;
+		ev.data.ptr = c;
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			dns_die("epoll_ctl");
+	}
+}
+
+/* ---- UDP front end ---- */
+
+#define UDP_BATCH 64
+#define UDP_ROUNDS 16 /* batches per wakeup before other sockets get a turn */
+
+/* recvmmsg/sendmmsg buffers, one set per loop. */
+typedef struct udp_batch {
+	struct mmsghdr rx[UDP_BATCH];
+	struct mmsghdr tx[UDP_BATCH];
+	struct iovec rx_iov[UDP_BATCH];
+	struct iovec tx_iov[UDP_BATCH];
+	struct sockaddr_storage peer[UDP_BATCH];
+	uint8_t in[UDP_BATCH][DNS_UDP_MAX];
+	uint8_t out[UDP_BATCH][DNS_UDP_MAX];
+} udp_batch_t;
+
+static void udp_init(loop_t *loop)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		dns_die("socket udp");
+	int one = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+		dns_die("SO_REUSEPORT");
+	if (bind(fd, (struct sockaddr *)&g_udp_addr, sizeof(g_udp_addr)) < 0)
+		dns_die("bind udp");
+
+	udp_batch_t *u = (udp_batch_t *)calloc(1, sizeof(udp_batch_t));
+	if (!u)
+		dns_die("calloc udp");
+	for (int i = 0; i < UDP_BATCH; i++) {
+		u->rx_iov[i].iov_base = u->in[i];
+		u->rx_iov[i].iov_len = sizeof(u->in[i]);
+		u->rx[i].msg_hdr.msg_iov = &u->rx_iov[i];
+		u->rx[i].msg_hdr.msg_iovlen = 1;
+		u->tx[i].msg_hdr.msg_iovlen = 1;
+	}
+	loop->udp = u;
+	loop->udp_fd = fd;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &loop->udp_fd;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		dns_die("epoll_ctl");
+}
+
+/*
+ * Drains queries a batch at a time: one recvmmsg, answers built in place,
+ * one sendmmsg. A reply the socket cannot take right now is dropped, as
+ * UDP allows; the client retries.
+ */
+static void udp_on_readable(loop_t *loop)
+{
+	udp_batch_t *u = loop->udp;
+	for (int round = 0; round < UDP_ROUNDS; round++) {
+		for (int i = 0; i < UDP_BATCH; i++) {
+			u->rx[i].msg_hdr.msg_name = &u->peer[i];
+			u->rx[i].msg_hdr.msg_namelen = sizeof(u->peer[i]);
+		}
+		int n = recvmmsg(loop->udp_fd, u->rx, UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (n <= 0) {
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("recvmmsg");
 			return;
 		}
 
-		const char *ip = lookup_ip(domain);
-		char reply[MAX_DOMAIN + MAX_IP + 32];
-		if (!ip) {
-			snprintf(reply, sizeof(reply), "NOTFOUND %s", domain);
-		} else {
-			snprintf(reply, sizeof(reply), "OK %s %s", domain, ip);
+		int m = 0;
+		uint64_t start = dns_now_ns();
+		dns_stats_t *st = &loop->stats;
+		for (int i = 0; i < n; i++) {
+			dns_query_t q;
+			dns_stat_add(st, DNS_STAT_BYTES_IN, u->rx[i].msg_len);
+			int rcode = dns_wire_parse(u->in[i], u->rx[i].msg_len, &q);
+			if (rcode < 0)
+				continue;
+			u->tx_iov[m].iov_base = u->out[m];
+			u->tx_iov[m].iov_len = dns_wire_answer(loop->table, &g_live, u->in[i], &q, rcode,
+				u->out[m]);
+			rcode = u->out[m][3] & 0x0F;
+			dns_stat_add(st, DNS_STAT_UDP, 1);
+			dns_stat_add(st, DNS_STAT_QUERIES, 1);
+			dns_stat_add(st, rcode == DNS_RCODE_OK ? DNS_STAT_HITS :
+				rcode == DNS_RCODE_NXDOMAIN ? DNS_STAT_MISSES : DNS_STAT_ERRORS, 1);
+			dns_stat_add(st, DNS_STAT_BYTES_OUT, u->tx_iov[m].iov_len);
+			dns_stat_latency(st, dns_now_ns() - start);
+			u->tx[m].msg_hdr.msg_iov = &u->tx_iov[m];
+			u->tx[m].msg_hdr.msg_name = &u->peer[i];
+			u->tx[m].msg_hdr.msg_namelen = u->rx[i].msg_hdr.msg_namelen;
+			m++;
+		}
+		for (int sent = 0; sent < m;) {
+			int w = sendmmsg(loop->udp_fd, u->tx + sent, (unsigned)(m - sent), MSG_DONTWAIT);
+			if (w <= 0) {
+				if (w < 0 && errno == EINTR)
+					continue;
+				break;
+			}
+			sent += w;
+		}
+		if (n < UDP_BATCH)
+			return;
+	}
+}
+
+static void loop_init(loop_t *loop, int id)
+{
+	loop->id = id;
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0)
+		dns_die("epoll_create1");
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL; /* the listening socket */
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, g_listen_fd, &ev) < 0)
+		dns_die("epoll_ctl");
+
+	pthread_mutex_init(&loop->mbox_lock, NULL);
+	loop->mbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->mbox_fd < 0)
+		dns_die("eventfd");
+	ev.events = EPOLLIN;
+	ev.data.ptr = &loop->mbox_fd;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->mbox_fd, &ev) < 0)
+		dns_die("epoll_ctl");
+
+	loop->udp_fd = -1;
+	if (g_udp)
+		udp_init(loop);
+	if (g_seqpacket) {
+		loop->pkt = (char *)malloc(MAX_BATCH_MSG + 1);
+		if (!loop->pkt)
+			dns_die("malloc");
+	}
+}
+
+/*
+ * Readiness loop: every client socket is non-blocking, so an idle or slow
+ * client only holds its own buffers, never the loop.
+ */
+static void *event_loop(void *arg)
+{
+	loop_t *loop = (loop_t *)arg;
+	struct epoll_event events[MAX_EVENTS];
+	for (;;) {
+		int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			dns_die("epoll_wait");
+		}
+		epoch_enter(loop);
+		int mbox = 0;
+		for (int i = 0; i < n; i++) {
+			conn_t *c = (conn_t *)events[i].data.ptr;
+			if (!c) {
+				accept_clients(loop);
+				continue;
+			}
+			if (events[i].data.ptr == &loop->mbox_fd) {
+				mbox = 1; /* after the batch: answers may close connections */
+				continue;
+			}
+			if (events[i].data.ptr == &loop->udp_fd) {
+				udp_on_readable(loop);
+				continue;
+			}
+			if (c == loop->upstream) {
+				upstream_on_readable(loop);
+				continue;
+			}
+			int drop = 0;
+			if (events[i].events & EPOLLIN)
+				drop = conn_on_readable(c);
+			else if (events[i].events & (EPOLLHUP | EPOLLERR))
+				drop = -1;
+			if (drop == 0)
+				drop = conn_update(c);
+			if (drop != 0)
+				conn_close(c);
+		}
+		if (mbox)
+			mbox_drain(loop);
+		if (loop->upstream)
+			upstream_update(loop);
+		epoch_exit(loop);
+	}
+	return NULL;
+}
+
+/* ---- journal ---- */
+
+#define JOURNAL_COMPACT_MIN (64u << 20) /* journal bytes worth a snapshot at the least */
+
+/* Creates an empty journal at path, durably; its fd, or -1. */
+static int journal_create(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	dns_journal_hdr_t h = {DNS_JOURNAL_MAGIC, DNS_JOURNAL_VERSION, 0};
+	if (dns_write_all(fd, &h, sizeof(h)) != 0 || fdatasync(fd) != 0 ||
+		dns_fsync_dir(path) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Writes the snapshot in arg, then drops the journal it makes redundant. */
+static void *compact_thread(void *arg)
+{
+	dns_buf_t *snap = (dns_buf_t *)arg;
+	uint64_t start = dns_now_ns();
+	if (dns_write_file(g_journal.snap_path, snap->buf, snap->len) != 0 ||
+		rename(g_journal.next_path, g_journal.path) != 0 ||
+		dns_fsync_dir(g_journal.path) != 0) {
+		/* Recovery still reads both journals; stop here so neither is lost. */
+		fprintf(stderr, "[dns_server] Journal compaction failed (%s); the journal grows until "
+			"restart\n", strerror(errno));
+	} else {
+		printf("[dns_server] Compacted the journal into a %zu-byte snapshot in %.1f ms\n",
+			snap->len, (double)(dns_now_ns() - start) / 1e6);
+		fflush(stdout);
+		atomic_store(&g_journal.snapshot_bytes, snap->len);
+		atomic_store(&g_journal.compacting, 0);
+	}
+	dns_buf_free(snap);
+	free(snap);
+	return NULL;
+}
+
+/*
+ * Group commit: one write() and one fdatasync() for every record appended
+ * since the last pass, then their answers. Once the journal outgrows the
+ * last snapshot, new records move to a fresh file and the overlay as of
+ * the last old one goes to compact_thread().
+ */
+static void *journal_thread(void *arg)
+{
+	(void)arg;
+	dns_buf_t batch;
+	memset(&batch, 0, sizeof(batch));
+	for (;;) {
+		int next_fd = -1;
+		uint64_t limit = atomic_load(&g_journal.snapshot_bytes);
+		if (!atomic_load(&g_journal.compacting) &&
+			g_journal.bytes >= (limit > JOURNAL_COMPACT_MIN ? limit : JOURNAL_COMPACT_MIN)) {
+			next_fd = journal_create(g_journal.next_path);
+			if (next_fd < 0) {
+				fprintf(stderr, "[dns_server] Cannot start %s (%s); the journal grows until "
+					"restart\n", g_journal.next_path, strerror(errno));
+				atomic_store(&g_journal.compacting, 1);
+			}
+		}
+
+		pthread_mutex_lock(&g_journal.lock);
+		while (g_journal.pending.len == 0 && next_fd < 0)
+			pthread_cond_wait(&g_journal.cond, &g_journal.lock);
+		dns_buf_t tmp = batch;
+		batch = g_journal.pending;
+		g_journal.pending = tmp;
+		jwaiter_t *w = g_journal.waiters_head;
+		g_journal.waiters_head = g_journal.waiters_tail = NULL;
+		dns_buf_t *snap = NULL;
+		if (next_fd >= 0) {
+			snap = (dns_buf_t *)calloc(1, sizeof(*snap));
+			if (!snap)
+				dns_die("calloc snapshot");
+			dns_journal_snapshot(&g_live, g_journal.seq, snap);
+		}
+		pthread_mutex_unlock(&g_journal.lock);
+
+		if (batch.len > 0) {
+			/* Nothing was acknowledged yet; better to stop than to lie. */
+			if (dns_write_all(g_journal.fd, batch.buf, batch.len) != 0 ||
+				fdatasync(g_journal.fd) != 0)
+				dns_die("write journal");
+			g_journal.bytes += batch.len;
+			batch.len = 0;
+		}
+		while (w) {
+			jwaiter_t *next = w->next;
+			post_answer(w->held, w->slot, ANSWER_LINE, w->reply);
+			free(w);
+			w = next;
+		}
+
+		if (next_fd >= 0) {
+			close(g_journal.fd);
+			g_journal.fd = next_fd;
+			g_journal.bytes = sizeof(dns_journal_hdr_t);
+			atomic_store(&g_journal.compacting, 1);
+			pthread_t t;
+			if (pthread_create(&t, NULL, compact_thread, snap) != 0)
+				dns_die("pthread_create");
+			pthread_detach(t);
+		}
+	}
+	return NULL;
+}
+
+/* Replays one file of the journal; damage stops the server before anything is compacted. */
+static void journal_recover(const char *path, uint32_t magic, const dns_table_t *t,
+	dns_replay_t *r)
+{
+	if (dns_journal_replay(path, magic, &g_live, t, r) == 0 || errno == ENOENT)
+		return;
+	fprintf(stderr, "[dns_server] Cannot recover from %s (%s); move it aside to start "
+		"without it\n", path, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * -J: rebuilds the overlay from the snapshot and journals at path over t,
+ * folds it all into a fresh snapshot, and starts an empty journal and the
+ * thread that writes it.
+ */
+static void journal_open(const char *path, const dns_table_t *t)
+{
+	g_journal.path = path;
+	snprintf(g_journal.next_path, sizeof(g_journal.next_path), "%s.next", path);
+	snprintf(g_journal.snap_path, sizeof(g_journal.snap_path), "%s.snap", path);
+	uint64_t start = dns_now_ns();
+
+	dns_replay_t snap, tail;
+	memset(&snap, 0, sizeof(snap));
+	memset(&tail, 0, sizeof(tail));
+	journal_recover(g_journal.snap_path, DNS_SNAPSHOT_MAGIC, t, &snap);
+	tail.seq = snap.seq;
+	journal_recover(path, DNS_JOURNAL_MAGIC, t, &tail);
+	journal_recover(g_journal.next_path, DNS_JOURNAL_MAGIC, t, &tail);
+	g_journal.seq = tail.seq;
+
+	/* The snapshot must be on disk before the journals it replaces go. */
+	dns_buf_t img;
+	memset(&img, 0, sizeof(img));
+	dns_journal_snapshot(&g_live, g_journal.seq, &img);
+	if (dns_write_file(g_journal.snap_path, img.buf, img.len) != 0)
+		dns_die("write journal snapshot");
+	atomic_store(&g_journal.snapshot_bytes, img.len);
+	dns_buf_free(&img);
+	g_journal.fd = journal_create(path);
+	if (g_journal.fd < 0)
+		dns_die("create journal");
+	if (unlink(g_journal.next_path) == 0)
+		dns_fsync_dir(path);
+	g_journal.bytes = sizeof(dns_journal_hdr_t);
+
+	printf("[dns_server] Journal %s: %u names changed online, recovered from a snapshot and "
+		"%llu newer records in %.1f ms\n", path, atomic_load(&g_live.used),
+		(unsigned long long)tail.applied, (double)(dns_now_ns() - start) / 1e6);
+	if (snap.torn || tail.torn)
+		fprintf(stderr, "[dns_server] Dropped %llu bytes of unfinished journal records\n",
+			(unsigned long long)(snap.torn + tail.torn));
+	fflush(stdout);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, journal_thread, NULL) != 0)
+		dns_die("pthread_create");
+	pthread_detach(thread);
+}
+
+/*
+ * -M: seals t's memfd (a table mapped from an image file is copied into
+ * one first) before it goes live, so the server and its clients map one
+ * copy, then bumps the generation to send clients to fetch it. On failure
+ * clients keep the previous table.
+ */
+static void shm_publish(dns_table_t *t)
+{
+	if (!g_shm)
+		return;
+	int fd = dns_shm_seal_table(t);
+	if (fd < 0) {
+		fprintf(stderr, "[dns_server] Cannot share the table (%s)\n", strerror(errno));
+		return;
+	}
+	pthread_mutex_lock(&g_shm_lock);
+	int old = g_shm_fd;
+	g_shm_fd = fd;
+	atomic_fetch_add_explicit(&g_shm->generation, 1, memory_order_release);
+	pthread_mutex_unlock(&g_shm_lock);
+	if (old >= 0)
+		close(old);
+}
+
+static void reload(void)
+{
+	dns_table_t *t = load_db(g_db_path);
+	if (!t) {
+		fprintf(stderr, "[dns_server] Reload of %s failed (%s), keeping current table\n",
+			g_db_path, strerror(errno));
+		return;
+	}
+	shm_publish(t);
+	publish_table(t);
+	printf("[dns_server] Reloaded %u records from %s\n", t->hdr->count, g_db_path);
+	fflush(stdout);
+}
+
+#define RELOAD_SETTLE_MS 200
+
+/*
+ * Rebuilds the table off the hot path on SIGHUP or when the database file
+ * changes. The file's directory is watched, since editors and dns_compile
+ * replace the file by rename; a burst of events is coalesced into one
+ * reload once the file has been quiet for RELOAD_SETTLE_MS.
+ */
+static void *reload_thread(void *arg)
+{
+	int sig_fd = *(int *)arg;
+
+	char dir_buf[4096], base_buf[4096];
+	snprintf(dir_buf, sizeof(dir_buf), "%s", g_db_path);
+	snprintf(base_buf, sizeof(base_buf), "%s", g_db_path);
+	const char *dir = dirname(dir_buf);
+	const char *base = basename(base_buf);
+
+	int in_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (in_fd >= 0 &&
+		inotify_add_watch(in_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+		perror("inotify_add_watch");
+		close(in_fd);
+		in_fd = -1;
+	}
+
+	int pending = 0;
+	for (;;) {
+		struct pollfd pfd[2] = {{sig_fd, POLLIN, 0}, {in_fd, POLLIN, 0}};
+		int n = poll(pfd, in_fd >= 0 ? 2 : 1, pending ? RELOAD_SETTLE_MS : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			dns_die("poll");
+		}
+		if (n == 0) {
+			pending = 0;
+			reload();
+			continue;
+		}
+		if (pfd[0].revents & POLLIN) {
+			struct signalfd_siginfo si;
+			if (read(sig_fd, &si, sizeof(si)) == (ssize_t)sizeof(si))
+				reload();
 		}
-		(void)send_msg(fd, reply);
+		if (in_fd >= 0 && (pfd[1].revents & POLLIN)) {
+			char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+			ssize_t len;
+			while ((len = read(in_fd, buf, sizeof(buf))) > 0) {
+				for (char *p = buf; p < buf + len;) {
+					const struct inotify_event *ev = (const struct inotify_event *)p;
+					if (ev->len > 0 && strcmp(ev->name, base) == 0)
+						pending = 1;
+					p += sizeof(*ev) + ev->len;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+#define CACHE_TTL 300
+#define CACHE_NEG_TTL 30
+#define CACHE_ENTRIES 65536
+
+static long parse_opt_long(const char *arg, long max, const char *what)
+{
+	char *end = NULL;
+	long v = strtol(arg, &end, 10);
+	if (!end || *end != '\0' || end == arg || v < 0 || v > max) {
+		fprintf(stderr, "Invalid %s '%s'\n", what, arg);
+		exit(EXIT_FAILURE);
+	}
+	return v;
+}
+
+/* "port" (on 127.0.0.1) or "a.b.c.d:port". */
+static int parse_udp_addr(const char *spec, struct sockaddr_in *sa)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	const char *colon = strrchr(spec, ':');
+	const char *port = spec;
+	if (colon) {
+		char host[INET_ADDRSTRLEN];
+		size_t n = (size_t)(colon - spec);
+		if (n >= sizeof(host))
+			return -1;
+		memcpy(host, spec, n);
+		host[n] = '\0';
+		if (inet_pton(AF_INET, host, &sa->sin_addr) != 1)
+			return -1;
+		port = colon + 1;
 	}
+	char *end = NULL;
+	long p = strtol(port, &end, 10);
+	if (end == port || *end != '\0' || p <= 0 || p > 65535)
+		return -1;
+	sa->sin_port = htons((uint16_t)p);
+	return 0;
 }
 
 static void usage(const char *argv0)
 {
-	fprintf(stderr, "Usage: %s [database.txt] [socket_path]\n", argv0);
+	fprintf(stderr, "Usage: %s [-S] [-M] [-t threads] [-U [addr:]port] [-J journal] "
+		"[-u upstream_socket [-T ttl]\n       [-N negative_ttl] [-C entries]] "
+		"[database.txt|image] [socket_path]\n", argv0);
 	fprintf(stderr, "Default db: ./database.txt\n");
+	fprintf(stderr, "Database lines are \"name ip[/len] [weight]\"; repeat a name for more "
+		"addresses.\n");
+	fprintf(stderr, "Besides names, clients may send \"PTR ip[/len]\", \"CIDR ip[/len]\", and "
+		"__stats__\nor __stats_json__ for counters and request latencies.\n");
+	fprintf(stderr, "\"ADD name ip[/len] [weight]\" and \"DEL name [ip[/len]]\" change names "
+		"while serving;\nthe changes outlive reloads, but -M clients see only the "
+		"database.\n");
+	fprintf(stderr, "-J: make those changes durable: acknowledge each once it is in the "
+		"journal file,\n    compacted into journal.snap in the background, and recover "
+		"them on restart\n");
+	fprintf(stderr, "__export__ streams the table as an image plus a snapshot of those "
+		"changes, and\n__export_text__ as database lines (see dns_client -E and -T).\n");
+	fprintf(stderr, "Images built by dns_compile are mapped instead of parsed.\n");
 	fprintf(stderr, "Default socket: %s\n", DNS_SOCK_PATH);
+	fprintf(stderr, "-S: listen with SOCK_SEQPACKET, one record per message and no length "
+		"prefix\n");
+	fprintf(stderr, "-M: share the table with local clients as a sealed memfd, mapped by "
+		"dns_client -m\n");
+	fprintf(stderr, "-t: worker threads, each with its own event loop "
+		"(default 1, 0 = one per online CPU)\n");
+	fprintf(stderr, "-U: also answer standard DNS A/AAAA/PTR queries over UDP "
+		"(address defaults to 127.0.0.1)\n");
+	fprintf(stderr, "The database is reloaded on SIGHUP and whenever the file changes.\n");
+	fprintf(stderr, "-u: forward names missing from the database to another server on this "
+		"UNIX socket\n    and cache its answers for -T seconds (default %d), NOTFOUND for -N "
+		"(default %d),\n    keeping at most -C names (default %d)\n", CACHE_TTL, CACHE_NEG_TTL,
+		CACHE_ENTRIES);
 }
 
 int main(int argc, char **argv)
 {
-	const char *db_path = "./database.txt";
-	const char *sock_path = DNS_SOCK_PATH;
+	const char *prog = argv[0];
+	long nthreads = 1;
+	long ttl = CACHE_TTL, neg_ttl = CACHE_NEG_TTL, cache_entries = CACHE_ENTRIES;
+	const char *journal = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:u:T:N:C:U:J:SM")) != -1) {
+		if (opt == 'S') {
+			g_seqpacket = 1;
+		} else if (opt == 'M') {
+			g_shm = dns_shm_ctl_create(&g_shm_ctl_fd);
+			if (!g_shm)
+				dns_die("shared memory control page");
+		} else if (opt == 'U') {
+			if (parse_udp_addr(optarg, &g_udp_addr) != 0) {
+				fprintf(stderr, "Invalid UDP address '%s'\n", optarg);
+				return 1;
+			}
+			g_udp = 1;
+		} else if (opt == 't') {
+			nthreads = parse_opt_long(optarg, 1024, "thread count");
+		} else if (opt == 'u') {
+			g_upstream = optarg;
+		} else if (opt == 'J') {
+			journal = optarg;
+		} else if (opt == 'T') {
+			ttl = parse_opt_long(optarg, 86400 * 365, "ttl");
+		} else if (opt == 'N') {
+			neg_ttl = parse_opt_long(optarg, 86400 * 365, "negative ttl");
+		} else if (opt == 'C') {
+			cache_entries = parse_opt_long(optarg, UINT32_MAX, "cache size");
+		} else {
+			usage(prog);
+			return 1;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc >= 2)
-		db_path = argv[1];
+		g_db_path = argv[1];
 	if (argc >= 3)
-		sock_path = argv[2];
+		g_sock_path = argv[2];
 	if (argc > 3) {
-		usage(argv[0]);
+		usage(prog);
 		return 1;
 	}
+	if (nthreads == 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads < 1)
+			nthreads = 1;
+	}
+
+	dns_live_init(&g_live, &g_epoch);
+	dns_table_t *table = load_db(g_db_path);
+	if (!table)
+		dns_die("open database");
+	atomic_store(&g_table, table);
+	printf("[dns_server] Loaded %u records from %s (%s, %.1f bytes/record)\n",
+		table->hdr->count, g_db_path, dns_is_image(g_db_path) ? "mapped image" : "text",
+		table->hdr->count ? (double)table->hdr->total_size / table->hdr->count : 0.0);
+	if (journal)
+		journal_open(journal, table);
+	shm_publish(table);
+	if (g_shm && g_shm_fd >= 0)
+		printf("[dns_server] Sharing the table with local clients (sealed memfd, %llu bytes)\n",
+			(unsigned long long)table->hdr->total_size);
+	if (g_upstream) {
+		dns_cache_init(&g_cache, (uint32_t)cache_entries, (uint32_t)ttl, (uint32_t)neg_ttl);
+		printf("[dns_server] Forwarding misses to %s (cache %ld names, ttl %lds, "
+			"negative ttl %lds)\n", g_upstream, cache_entries, ttl, neg_ttl);
+	}
 
-	load_db(db_path);
-	printf("[dns_server] Loaded %zu records from %s\n", g_entry_count, db_path);
+	/* SIGHUP is consumed by the reload thread; block it everywhere else. */
+	sigset_t hup;
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+	if (pthread_sigmask(SIG_BLOCK, &hup, NULL) != 0)
+		dns_die("pthread_sigmask");
+	int sig_fd = signalfd(-1, &hup, SFD_CLOEXEC);
+	if (sig_fd < 0)
+		dns_die("signalfd");
 
 	cleanup_socket();
 	signal(SIGINT, on_sigint);
+	signal(SIGPIPE, SIG_IGN);
 
-	g_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	g_listen_fd = socket(AF_UNIX, (g_seqpacket ? SOCK_SEQPACKET : SOCK_STREAM) | SOCK_NONBLOCK |
+		SOCK_CLOEXEC, 0);
 	if (g_listen_fd < 0)
 		dns_die("socket");
 
 	struct sockaddr_un addr;
 	memset(&addr, 0, sizeof(addr));
 	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+	strncpy(addr.sun_path, g_sock_path, sizeof(addr.sun_path) - 1);
 
 	if (bind(g_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
 		dns_die("bind");
-	if (listen(g_listen_fd, 8) < 0)
+	if (listen(g_listen_fd, SOMAXCONN) < 0)
 		dns_die("listen");
 
-	printf("[dns_server] Listening on UNIX socket %s\n", sock_path);
+	printf("[dns_server] Listening on UNIX %s socket %s with %ld thread%s\n",
+		g_seqpacket ? "seqpacket" : "stream", g_sock_path, nthreads, nthreads == 1 ? "" : "s");
+	if (g_udp) {
+		char host[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &g_udp_addr.sin_addr, host, sizeof(host));
+		printf("[dns_server] Answering DNS queries on UDP %s:%u\n", host,
+			ntohs(g_udp_addr.sin_port));
+	}
+	fflush(stdout);
 
-	for (;;) {
-		int client_fd = accept(g_listen_fd, NULL, NULL);
-		if (client_fd < 0) {
-			if (errno == EINTR)
-				continue;
-			dns_die("accept");
-		}
-		handle_client(client_fd);
-		close(client_fd);
+	loop_t *loops = NULL;
+	if (posix_memalign((void **)&loops, 64, (size_t)nthreads * sizeof(loop_t)) != 0)
+		dns_die("posix_memalign loops");
+	memset(loops, 0, (size_t)nthreads * sizeof(loop_t));
+	for (long i = 0; i < nthreads; i++)
+		loop_init(&loops[i], (int)i);
+	g_loops = loops;
+	g_nloops = nthreads;
+	g_start_ns = dns_now_ns();
+
+	pthread_t reloader;
+	if (pthread_create(&reloader, NULL, reload_thread, &sig_fd) != 0)
+		dns_die("pthread_create");
+	for (long i = 1; i < nthreads; i++) {
+		if (pthread_create(&loops[i].thread, NULL, event_loop, &loops[i]) != 0)
+			dns_die("pthread_create");
 	}
+	loops[0].thread = pthread_self();
+	event_loop(&loops[0]);
+	return 0;
 }
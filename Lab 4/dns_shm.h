@@ -0,0 +1,295 @@
+#ifndef DNS_SHM_H
+#define DNS_SHM_H
+
+#include "dns_db.h"
+
+#include <sys/un.h>
+
+/*
+ * Shared-memory tables for co-located clients. Started with -M, dns_server
+ * keeps the table it serves in a sealed memfd (no writes, no resizing) and
+ * answers DNS_SHM_REQUEST by passing that fd, plus a read-only control
+ * page, over the socket with SCM_RIGHTS. The client maps the table and
+ * resolves names with plain memory reads: no syscalls, no context
+ * switches.
+ *
+ * A published table is never modified. A reload publishes a new memfd and
+ * then bumps the control page's generation; the client compares it before
+ * each lookup and fetches the new fd over the socket when it has moved.
+ * Old mappings stay valid until the client drops them, so a lookup that
+ * races a reload simply answers from the previous table.
+ */
+
+#define DNS_SHM_REQUEST "__shm__"
+#define DNS_SHM_MAGIC 0x4D485344u /* "DSHM" */
+#define DNS_SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t reserved;
+	_Atomic uint64_t generation; /* bumped after each new table is published */
+} dns_shm_ctl_t;
+
+/* ---- fd passing ---- */
+
+static inline ssize_t dns_send_fds(int fd, const void *buf, size_t len, const int *fds, int n)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} ctl;
+	struct iovec iov = {(void *)buf, len};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	memset(&ctl, 0, sizeof(ctl));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = CMSG_SPACE((size_t)n * sizeof(int));
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN((size_t)n * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, (size_t)n * sizeof(int));
+	return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+/* recvmsg() that also collects up to max passed fds into fds[*n]. */
+static inline ssize_t dns_recv_fds(int fd, void *buf, size_t len, int flags, int *fds, int max,
+	int *n)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(4 * sizeof(int))];
+	} ctl;
+	struct iovec iov = {buf, len};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	ssize_t r;
+	do {
+		r = recvmsg(fd, &msg, flags | MSG_CMSG_CLOEXEC);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0)
+		return r;
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		int got = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		for (int i = 0; i < got; i++) {
+			int f;
+			memcpy(&f, CMSG_DATA(cm) + (size_t)i * sizeof(int), sizeof(f));
+			if (*n < max)
+				fds[(*n)++] = f;
+			else
+				close(f);
+		}
+	}
+	return r;
+}
+
+/* ---- server side ---- */
+
+/*
+ * Creates the control page. *ro_fd is a read-only descriptor of it for
+ * clients, so they cannot write the generation.
+ */
+static inline dns_shm_ctl_t *dns_shm_ctl_create(int *ro_fd)
+{
+	int fd = memfd_create("dns_ctl", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0 || ftruncate(fd, (off_t)sysconf(_SC_PAGESIZE)) != 0 ||
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+		return NULL;
+	dns_shm_ctl_t *ctl = (dns_shm_ctl_t *)mmap(NULL, sizeof(*ctl), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	*ro_fd = open(path, O_RDONLY | O_CLOEXEC);
+	close(fd);
+	if (ctl == MAP_FAILED || *ro_fd < 0)
+		return NULL;
+	ctl->magic = DNS_SHM_MAGIC;
+	return ctl;
+}
+
+/*
+ * Puts t's blob in a sealed memfd, so the server and its clients share one
+ * copy: the memfd a text table already lives in (see dns_table_to_memfd()),
+ * or a new one t is moved into. Returns another fd for the memfd, -1 on
+ * failure (t is then unchanged).
+ */
+static inline int dns_shm_seal_table(dns_table_t *t)
+{
+	if ((t->fd < 0 || fcntl(t->fd, F_ADD_SEALS, DNS_SHM_SEALS) != 0) &&
+		dns_table_to_memfd(t, MFD_ALLOW_SEALING, DNS_SHM_SEALS) != 0)
+		return -1;
+	return fcntl(t->fd, F_DUPFD_CLOEXEC, 0);
+}
+
+/* ---- client library ---- */
+
+/* One per thread: lookups are lock-free, but a refresh swaps the mapping. */
+typedef struct {
+	int sock;
+	int seqpacket;
+	const dns_shm_ctl_t *ctl;
+	uint64_t generation; /* of the mapped table */
+	uint64_t tried; /* the last generation a refresh went for; not retried until the next */
+	int refresh_err; /* errno of that refresh if it failed: answers are from an older table */
+	dns_table_t table;
+} dns_shm_t;
+
+/* Asks for the current table and maps it in place of the old one. */
+static inline int dns_shm_refresh(dns_shm_t *s)
+{
+	const char *req = DNS_SHM_REQUEST;
+	int rc = s->seqpacket ? send_record(s->sock, req, strlen(req)) : send_msg(s->sock, req);
+	if (rc != 0)
+		return -1;
+
+	/* The fds ride on the reply's first byte. */
+	char reply[128];
+	int fds[2], nfds = 0;
+	ssize_t r;
+	if (s->seqpacket) {
+		r = dns_recv_fds(s->sock, reply, sizeof(reply) - 1, 0, fds, 2, &nfds);
+		if (r > 0)
+			reply[r] = '\0';
+	} else {
+		/* The whole body is read even when too long, to keep the stream in step. */
+		uint32_t len = 0;
+		r = dns_recv_fds(s->sock, &len, sizeof(len), MSG_WAITALL, fds, 2, &nfds);
+		size_t keep = len < sizeof(reply) ? len : 0;
+		if (r != (ssize_t)sizeof(len) || recv_all_bytes(s->sock, reply, keep) != 0)
+			r = -1;
+		reply[keep] = '\0';
+		for (size_t left = len - keep; r > 0 && left > 0;) {
+			char junk[4096];
+			size_t n = left < sizeof(junk) ? left : sizeof(junk);
+			if (recv_all_bytes(s->sock, junk, n) != 0)
+				r = -1;
+			left -= n;
+		}
+		if (len >= sizeof(reply))
+			r = -1;
+	}
+	unsigned long long gen = 0;
+	if (r <= 0 || nfds != 2 || sscanf(reply, "SHM %llu", &gen) != 1) {
+		for (int i = 0; i < nfds; i++)
+			close(fds[i]);
+		errno = EPROTO;
+		return -1;
+	}
+
+	/* Only trust a table nobody can change underneath us. */
+	struct stat st;
+	void *m = MAP_FAILED;
+	if ((fcntl(fds[0], F_GET_SEALS) & (F_SEAL_WRITE | F_SEAL_SHRINK)) ==
+			(F_SEAL_WRITE | F_SEAL_SHRINK) &&
+		fstat(fds[0], &st) == 0 && st.st_size > 0)
+		m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	dns_table_t t;
+	if (m == MAP_FAILED || dns_table_attach(&t, (uint8_t *)m, (size_t)st.st_size, 1) != 0) {
+		if (m != MAP_FAILED)
+			munmap(m, (size_t)st.st_size);
+		close(fds[1]);
+		errno = EPROTO;
+		return -1;
+	}
+	t.rotation = (_Atomic uint32_t *)calloc((size_t)t.hdr->count + 1, sizeof(uint32_t));
+
+	if (!s->ctl) {
+		void *c = mmap(NULL, sizeof(dns_shm_ctl_t), PROT_READ, MAP_SHARED, fds[1], 0);
+		if (c != MAP_FAILED && ((const dns_shm_ctl_t *)c)->magic == DNS_SHM_MAGIC)
+			s->ctl = (const dns_shm_ctl_t *)c;
+		else if (c != MAP_FAILED)
+			munmap(c, sizeof(dns_shm_ctl_t));
+	}
+	close(fds[1]);
+	if (!s->ctl) {
+		dns_table_free(&t);
+		errno = EPROTO;
+		return -1;
+	}
+	dns_table_free(&s->table);
+	s->table = t;
+	s->generation = s->tried = gen;
+	return 0;
+}
+
+/*
+ * Connects to dns_server at path (either transport) and maps its table.
+ * Returns -1 with errno set when the server is unreachable or was not
+ * started with -M.
+ */
+static inline int dns_shm_open(dns_shm_t *s, const char *path)
+{
+	memset(s, 0, sizeof(*s));
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	for (int seqpacket = 0; seqpacket < 2; seqpacket++) {
+		s->sock = socket(AF_UNIX, (seqpacket ? SOCK_SEQPACKET : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+		if (s->sock < 0)
+			return -1;
+		if (connect(s->sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			s->seqpacket = seqpacket;
+			break;
+		}
+		int err = errno;
+		close(s->sock);
+		s->sock = -1;
+		if (err != EPROTOTYPE) {
+			errno = err;
+			return -1;
+		}
+	}
+	if (s->sock < 0 || dns_shm_refresh(s) != 0) {
+		if (s->sock >= 0)
+			close(s->sock);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Resolves name like the server does (exact, then wildcard). Normally
+ * only memory reads; after a reload the first lookup remaps the table.
+ * If that fails, lookups go on from the table we have, with the failure
+ * in s->refresh_err, and the next reload is the next try: a dead server
+ * costs one failed round trip, not one per lookup.
+ */
+static inline const dns_rec_t *dns_shm_resolve(dns_shm_t *s, const char *name)
+{
+	uint64_t gen = atomic_load_explicit(&s->ctl->generation, memory_order_acquire);
+	if (gen != s->generation && gen != s->tried) {
+		s->tried = gen;
+		s->refresh_err = dns_shm_refresh(s) == 0 ? 0 : errno;
+	}
+	return dns_table_resolve(&s->table, name);
+}
+
+/* Formats name's addresses like an "OK" reply's; 0, or -1 if it is not found. */
+static inline int dns_shm_lookup(dns_shm_t *s, const char *name, char *out, size_t outsz)
+{
+	const dns_rec_t *r = dns_shm_resolve(s, name);
+	return r ? dns_rec_answer(&s->table, r, out, outsz) : -1;
+}
+
+static inline void dns_shm_close(dns_shm_t *s)
+{
+	dns_table_free(&s->table);
+	if (s->ctl)
+		munmap((void *)s->ctl, sizeof(dns_shm_ctl_t));
+	if (s->sock >= 0)
+		close(s->sock);
+	memset(s, 0, sizeof(*s));
+	s->sock = -1;
+}
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef DNS_STATS_H
+#define DNS_STATS_H
+
+#include "dns_common.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+
+/*
+ * Runtime counters. Each event loop owns one dns_stats_t and is its only
+ * writer, so an update is a relaxed load and store on a line no other
+ * thread writes: no locks and no contended atomics on the query path.
+ * Readers merge every loop's copy on demand; a snapshot may be a few
+ * updates behind but never blocks a loop.
+ *
+ * Latencies go into a log-linear histogram: DNS_HIST_SUB buckets per power
+ * of two of nanoseconds, so a reported percentile is within 25% of the
+ * true value.
+ */
+
+enum {
+	DNS_STAT_QUERIES, /* names answered, over every protocol */
+	DNS_STAT_HITS,
+	DNS_STAT_MISSES,
+	DNS_STAT_ERRORS,
+	DNS_STAT_CACHE_HITS,
+	DNS_STAT_FORWARDED,
+	DNS_STAT_UDP,
+	DNS_STAT_CONNS,
+	DNS_STAT_BYTES_IN,
+	DNS_STAT_BYTES_OUT,
+	DNS_STAT_ABSENT, /* names not in the table (before wildcards) */
+	DNS_STAT_FILTERED, /* of those, turned away by the Bloom filter alone */
+	DNS_STAT_UPDATES, /* ADD and DEL requests that changed a name */
+	DNS_STAT_MAX
+};
+
+static const char *const dns_stat_names[DNS_STAT_MAX] = {
+	"queries", "hits", "misses", "errors", "cache_hits", "forwarded", "udp",
+	"connections", "bytes_in", "bytes_out", "absent", "bloom_filtered",
+	"updates",
+};
+
+#define DNS_HIST_SUB 4
+#define DNS_HIST_BUCKETS (64 * DNS_HIST_SUB)
+
+typedef struct {
+	_Alignas(64) _Atomic uint64_t v[DNS_STAT_MAX];
+	_Atomic uint64_t max_ns;
+	_Atomic uint64_t hist[DNS_HIST_BUCKETS];
+} dns_stats_t;
+
+/* A merged, plain copy. */
+typedef struct {
+	uint64_t v[DNS_STAT_MAX];
+	uint64_t max_ns;
+	uint64_t hist[DNS_HIST_BUCKETS];
+} dns_stats_snap_t;
+
+static inline void dns_stat_bump(_Atomic uint64_t *p, uint64_t n)
+{
+	atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+/* Owner thread only. */
+static inline void dns_stat_add(dns_stats_t *s, int k, uint64_t n)
+{
+	dns_stat_bump(&s->v[k], n);
+}
+
+static inline unsigned dns_hist_bucket(uint64_t ns)
+{
+	if (ns < DNS_HIST_SUB)
+		return (unsigned)ns;
+	unsigned msb = 63u - (unsigned)__builtin_clzll(ns);
+	return (msb - 1) * DNS_HIST_SUB + (unsigned)((ns >> (msb - 2)) & (DNS_HIST_SUB - 1));
+}
+
+/* Largest value that lands in bucket b. */
+static inline uint64_t dns_hist_upper(unsigned b)
+{
+	if (b < DNS_HIST_SUB)
+		return b;
+	unsigned msb = b / DNS_HIST_SUB + 1;
+	uint64_t lower = (uint64_t)(DNS_HIST_SUB + b % DNS_HIST_SUB) << (msb - 2);
+	return lower + ((uint64_t)1 << (msb - 2)) - 1;
+}
+
+/* Owner thread only. */
+static inline void dns_stat_latency(dns_stats_t *s, uint64_t ns)
+{
+	dns_stat_bump(&s->hist[dns_hist_bucket(ns)], 1);
+	if (ns > atomic_load_explicit(&s->max_ns, memory_order_relaxed))
+		atomic_store_explicit(&s->max_ns, ns, memory_order_relaxed);
+}
+
+/* Counts one answer line by its status word. */
+static inline void dns_stat_answer(dns_stats_t *s, const char *line)
+{
+	int k = strncmp(line, "OK ", 3) == 0 ? DNS_STAT_HITS :
+		strncmp(line, "NOTFOUND ", 9) == 0 ? DNS_STAT_MISSES :
+		strncmp(line, "ERROR", 5) == 0 ? DNS_STAT_ERRORS : -1;
+	if (k < 0)
+		return;
+	dns_stat_add(s, DNS_STAT_QUERIES, 1);
+	dns_stat_add(s, k, 1);
+}
+
+static inline void dns_stats_merge(dns_stats_snap_t *out, const dns_stats_t *s)
+{
+	for (int k = 0; k < DNS_STAT_MAX; k++)
+		out->v[k] += atomic_load_explicit(&s->v[k], memory_order_relaxed);
+	for (int b = 0; b < DNS_HIST_BUCKETS; b++)
+		out->hist[b] += atomic_load_explicit(&s->hist[b], memory_order_relaxed);
+	uint64_t m = atomic_load_explicit(&s->max_ns, memory_order_relaxed);
+	if (m > out->max_ns)
+		out->max_ns = m;
+}
+
+/* Upper bound of the p-th percentile latency, in ns; 0 with no samples. */
+static inline uint64_t dns_stats_percentile(const dns_stats_snap_t *s, double p)
+{
+	uint64_t total = 0;
+	for (int b = 0; b < DNS_HIST_BUCKETS; b++)
+		total += s->hist[b];
+	if (total == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(p / 100.0 * (double)(total - 1)) + 1, seen = 0;
+	for (int b = 0; b < DNS_HIST_BUCKETS; b++) {
+		seen += s->hist[b];
+		if (seen >= rank) {
+			uint64_t v = dns_hist_upper((unsigned)b);
+			return v < s->max_ns ? v : s->max_ns;
+		}
+	}
+	return s->max_ns;
+}
+
+/* Appends to out at *used; an overflow leaves *used at outsz for good. */
+static inline __attribute__((format(printf, 4, 5))) void dns_appendf(char *out,
+	size_t outsz, size_t *used, const char *fmt, ...)
+{
+	if (*used >= outsz)
+		return;
+	va_list ap;
+	va_start(ap, fmt);
+	int w = vsnprintf(out + *used, outsz - *used, fmt, ap);
+	va_end(ap);
+	*used = w < 0 || (size_t)w >= outsz - *used ? outsz : *used + (size_t)w;
+}
+
+/*
+ * Formats a snapshot as lines of text or as one JSON object. extra is
+ * preformatted "key": value pairs for JSON, or a leading text line.
+ * Returns the length, or -1 if out is too small.
+ */
+static inline int dns_stats_format(const dns_stats_snap_t *s, double uptime_s, int json,
+	const char *extra, char *out, size_t outsz)
+{
+	static const double pct[] = {50, 90, 99, 99.9};
+	static const char *const pct_json[] = {"p50", "p90", "p99", "p999"};
+	double lat[4];
+	for (int i = 0; i < 4; i++)
+		lat[i] = (double)dns_stats_percentile(s, pct[i]) / 1e3;
+	double max = (double)s->max_ns / 1e3;
+	unsigned long long v[DNS_STAT_MAX];
+	for (int k = 0; k < DNS_STAT_MAX; k++)
+		v[k] = (unsigned long long)s->v[k];
+	double qps = uptime_s > 0 ? (double)v[DNS_STAT_QUERIES] / uptime_s : 0.0;
+	double ratio = v[DNS_STAT_QUERIES] ?
+		(double)v[DNS_STAT_HITS] / (double)v[DNS_STAT_QUERIES] : 0.0;
+	double fpr = v[DNS_STAT_ABSENT] ? (double)(v[DNS_STAT_ABSENT] - v[DNS_STAT_FILTERED]) /
+		(double)v[DNS_STAT_ABSENT] : 0.0;
+	size_t n = 0;
+
+	if (json) {
+		dns_appendf(out, outsz, &n, "{%s, \"uptime_s\": %.3f", extra, uptime_s);
+		for (int k = 0; k < DNS_STAT_MAX; k++)
+			dns_appendf(out, outsz, &n, ", \"%s\": %llu", dns_stat_names[k], v[k]);
+		dns_appendf(out, outsz, &n, ", \"qps\": %.1f, \"hit_ratio\": %.4f", qps, ratio);
+		dns_appendf(out, outsz, &n, ", \"bloom_fpr_observed\": %.5f", fpr);
+		dns_appendf(out, outsz, &n, ", \"latency_us\": {");
+		for (int i = 0; i < 4; i++)
+			dns_appendf(out, outsz, &n, "\"%s\": %.3f, ", pct_json[i], lat[i]);
+		dns_appendf(out, outsz, &n, "\"max\": %.3f}}", max);
+	} else {
+		dns_appendf(out, outsz, &n, "%s\nuptime %.1f s\n", extra, uptime_s);
+		dns_appendf(out, outsz, &n,
+			"queries %llu (%.1f/s), hits %llu (%.1f%%), misses %llu, errors %llu\n",
+			v[DNS_STAT_QUERIES], qps, v[DNS_STAT_HITS], ratio * 100.0,
+			v[DNS_STAT_MISSES], v[DNS_STAT_ERRORS]);
+		dns_appendf(out, outsz, &n, "forwarded %llu, cache hits %llu, udp %llu, updates %llu\n",
+			v[DNS_STAT_FORWARDED], v[DNS_STAT_CACHE_HITS], v[DNS_STAT_UDP],
+			v[DNS_STAT_UPDATES]);
+		dns_appendf(out, outsz, &n, "connections %llu, bytes in %llu, out %llu\n",
+			v[DNS_STAT_CONNS], v[DNS_STAT_BYTES_IN], v[DNS_STAT_BYTES_OUT]);
+		dns_appendf(out, outsz, &n,
+			"absent names %llu, %llu stopped by the bloom filter (observed fpr %.3f%%)\n",
+			v[DNS_STAT_ABSENT], v[DNS_STAT_FILTERED], fpr * 100.0);
+		dns_appendf(out, outsz, &n,
+			"latency us: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f", lat[0],
+			lat[1], lat[2], lat[3], max);
+	}
+	return n < outsz ? (int)n : -1;
+}
+
+#endif
@@ -0,0 +1,287 @@
+#ifndef DNS_WIRE_H
+#define DNS_WIRE_H
+
+#include "dns_live.h"
+
+/*
+ * RFC 1035 messages for the UDP front end: one question of type A or AAAA
+ * (class IN) answered from the table, or PTR for a host under in-addr.arpa
+ * or ip6.arpa answered from its reverse index. Answers name the question
+ * through a compression pointer, so each A record costs 16 bytes. An EDNS
+ * OPT record in the query raises the reply limit from 512 bytes to
+ * DNS_UDP_MAX and is echoed back; answers that do not fit set TC.
+ */
+
+#define DNS_UDP_MAX 1232 /* EDNS payload size, per the 2020 DNS flag day */
+#define DNS_WIRE_TTL 60
+#define DNS_HDR_LEN 12
+
+enum {
+	DNS_TYPE_A = 1,
+	DNS_TYPE_PTR = 12,
+	DNS_TYPE_AAAA = 28,
+	DNS_TYPE_OPT = 41,
+	DNS_CLASS_IN = 1
+};
+enum {
+	DNS_RCODE_OK = 0,
+	DNS_RCODE_FORMERR = 1,
+	DNS_RCODE_SERVFAIL = 2,
+	DNS_RCODE_NXDOMAIN = 3,
+	DNS_RCODE_NOTIMP = 4
+};
+
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_AA 0x0400
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_OPCODE_MASK 0x7800
+
+typedef struct {
+	uint16_t id;
+	uint16_t flags;
+	uint16_t qtype;
+	uint16_t qclass;
+	size_t qend; /* end of the question section */
+	int edns;
+	uint16_t udp_size;
+	char name[MAX_DOMAIN]; /* dotted, without the trailing dot */
+} dns_query_t;
+
+static inline uint16_t dns_get16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline void dns_put16(uint8_t *p, uint16_t v)
+{
+	p[0] = (uint8_t)(v >> 8);
+	p[1] = (uint8_t)v;
+}
+
+/*
+ * Parses a query. Returns an rcode to answer with (DNS_RCODE_OK when the
+ * question is usable), or -1 for packets that get no reply at all.
+ */
+static inline int dns_wire_parse(const uint8_t *pkt, size_t len, dns_query_t *q)
+{
+	if (len < DNS_HDR_LEN)
+		return -1;
+	memset(q, 0, sizeof(*q));
+	q->id = dns_get16(pkt);
+	q->flags = dns_get16(pkt + 2);
+	q->qend = DNS_HDR_LEN;
+	if (q->flags & DNS_FLAG_QR)
+		return -1; /* a response; never answer those */
+	if (q->flags & DNS_OPCODE_MASK)
+		return DNS_RCODE_NOTIMP;
+	if (dns_get16(pkt + 4) != 1)
+		return DNS_RCODE_FORMERR;
+
+	/* QNAME: uncompressed labels, as every resolver sends them. */
+	size_t off = DNS_HDR_LEN, out = 0;
+	for (;;) {
+		if (off >= len)
+			return DNS_RCODE_FORMERR;
+		uint8_t l = pkt[off++];
+		if (l == 0)
+			break;
+		if (l > 63 || off + l > len || out + l + 1 >= MAX_DOMAIN)
+			return DNS_RCODE_FORMERR;
+		if (out > 0)
+			q->name[out++] = '.';
+		for (uint8_t i = 0; i < l; i++) {
+			char ch = (char)pkt[off + i];
+			if (ch == '.' || ch == '\0')
+				return DNS_RCODE_FORMERR;
+			q->name[out++] = ch;
+		}
+		off += l;
+	}
+	q->name[out] = '\0';
+	if (off + 4 > len)
+		return DNS_RCODE_FORMERR;
+	q->qtype = dns_get16(pkt + off);
+	q->qclass = dns_get16(pkt + off + 2);
+	q->qend = off + 4;
+
+	/* EDNS: an OPT record (root name) first in an otherwise empty tail. */
+	if (dns_get16(pkt + 6) == 0 && dns_get16(pkt + 8) == 0 && dns_get16(pkt + 10) >= 1 &&
+		q->qend + 11 <= len && pkt[q->qend] == 0 &&
+		dns_get16(pkt + q->qend + 1) == DNS_TYPE_OPT) {
+		q->edns = 1;
+		q->udp_size = dns_get16(pkt + q->qend + 3);
+	}
+	if (q->qclass != DNS_CLASS_IN)
+		return DNS_RCODE_NOTIMP;
+	return DNS_RCODE_OK;
+}
+
+/* Address named by a reverse ("4.3.2.1.in-addr.arpa") name; 0 if it is not one. */
+static inline uint8_t dns_wire_reverse(const char *name, uint8_t *addr)
+{
+	size_t len = strlen(name);
+	const char *v4 = ".in-addr.arpa", *v6 = "ip6.arpa";
+	if (len > strlen(v4) && strcasecmp(name + len - strlen(v4), v4) == 0) {
+		unsigned o[4];
+		int used = 0;
+		for (size_t i = 0; i < len - strlen(v4); i++) {
+			if (!isdigit((unsigned char)name[i]) && name[i] != '.')
+				return 0;
+		}
+		if (sscanf(name, "%3u.%3u.%3u.%3u.%n", &o[3], &o[2], &o[1], &o[0], &used) != 4 ||
+			(size_t)used != len - strlen(v4) + 1)
+			return 0;
+		for (int i = 0; i < 4; i++) {
+			if (o[i] > 255)
+				return 0;
+			addr[i] = (uint8_t)o[i];
+		}
+		return 4;
+	}
+	if (len == 64 + strlen(v6) && strcasecmp(name + 64, v6) == 0) {
+		/* 32 nibbles, least significant first, each its own label. */
+		memset(addr, 0, 16);
+		for (int i = 0; i < 32; i++) {
+			char ch = (char)tolower((unsigned char)name[2 * i]);
+			if (name[2 * i + 1] != '.' || !isxdigit((unsigned char)ch))
+				return 0;
+			uint8_t v = (uint8_t)(ch <= '9' ? ch - '0' : ch - 'a' + 10);
+			int nib = 31 - i;
+			addr[nib / 2] |= (uint8_t)(nib % 2 ? v : v << 4);
+		}
+		return 6;
+	}
+	return 0;
+}
+
+/* Writes name as uncompressed labels into out; returns the length, 0 if it won't go. */
+static inline size_t dns_wire_name(const char *name, size_t len, uint8_t *out)
+{
+	size_t o = 0, start = 0;
+	for (size_t i = 0; i <= len; i++) {
+		if (i < len && name[i] != '.')
+			continue;
+		size_t l = i - start;
+		if (l == 0 || l > 63)
+			return 0;
+		out[o++] = (uint8_t)l;
+		memcpy(out + o, name + start, l);
+		o += l;
+		start = i + 1;
+	}
+	out[o++] = 0;
+	return o;
+}
+
+/* One answer record naming the question, with rdata; returns its size. */
+static inline size_t dns_wire_rr(uint8_t *out, uint16_t type, const uint8_t *rdata,
+	size_t rdlen)
+{
+	dns_put16(out, 0xC000 | DNS_HDR_LEN); /* -> question name */
+	dns_put16(out + 2, type);
+	dns_put16(out + 4, DNS_CLASS_IN);
+	dns_put16(out + 6, (uint16_t)(DNS_WIRE_TTL >> 16));
+	dns_put16(out + 8, (uint16_t)DNS_WIRE_TTL);
+	dns_put16(out + 10, (uint16_t)rdlen);
+	memcpy(out + 12, rdata, rdlen);
+	return 12 + rdlen;
+}
+
+/*
+ * Builds the reply to pkt (already parsed into q with result rcode) into
+ * out[DNS_UDP_MAX]; returns its length. The question is echoed as sent.
+ * Addresses come from live's changes first, then from t; reverse answers
+ * from t alone.
+ */
+static inline size_t dns_wire_answer(const dns_table_t *t, const dns_live_t *live,
+	const uint8_t *pkt, const dns_query_t *q, int rcode, uint8_t *out)
+{
+	size_t limit = 512;
+	if (q->edns && q->udp_size > limit)
+		limit = q->udp_size < DNS_UDP_MAX ? q->udp_size : DNS_UDP_MAX;
+	size_t opt_len = q->edns ? 11 : 0;
+	int has_question = rcode == DNS_RCODE_OK || q->qend > DNS_HDR_LEN;
+	if (q->qend + opt_len > limit)
+		has_question = 0;
+
+	size_t off = DNS_HDR_LEN;
+	if (has_question) {
+		memcpy(out + off, pkt + DNS_HDR_LEN, q->qend - DNS_HDR_LEN);
+		off = q->qend;
+	}
+
+	uint16_t flags = DNS_FLAG_QR | (q->flags & (DNS_OPCODE_MASK | DNS_FLAG_RD));
+	uint16_t ancount = 0;
+	uint8_t raddr[16];
+	uint8_t rfamily = q->qtype == DNS_TYPE_PTR ? dns_wire_reverse(q->name, raddr) : 0;
+	if (rcode == DNS_RCODE_OK && rfamily) {
+		flags |= DNS_FLAG_AA;
+		const dns_radix_node_t *n =
+			dns_radix_find(t, rfamily, raddr, dns_addr_bits(rfamily), 1);
+		if (!n)
+			rcode = DNS_RCODE_NXDOMAIN;
+		for (uint32_t i = 0; n && i < n->name_count; i++) {
+			uint64_t k = (uint64_t)n->name_first + i;
+			if (k >= t->rnames_count || t->rnames[k] >= t->hdr->count)
+				break;
+			const dns_rec_t *r = &t->recs[t->rnames[k]];
+			uint8_t rdata[MAX_DOMAIN + 1];
+			size_t rdlen = dns_wire_name(dns_rec_name(t, r), r->name_len, rdata);
+			if (rdlen == 0)
+				continue;
+			if (off + 12 + rdlen + opt_len > limit) {
+				flags |= DNS_FLAG_TC;
+				break;
+			}
+			off += dns_wire_rr(out + off, DNS_TYPE_PTR, rdata, rdlen);
+			ancount++;
+		}
+	} else if (rcode == DNS_RCODE_OK) {
+		flags |= DNS_FLAG_AA;
+		dns_live_entry_t *e = dns_live_find(live, q->name);
+		const dns_rec_t *r = e ? NULL : dns_table_find(t, q->name);
+		if (!r && !(e && e->addr_count > 0))
+			r = dns_table_find_wildcard(t, q->name);
+		dns_addr_t a[DNS_MAX_ADDRS];
+		int n = 0;
+		if (r)
+			n = dns_rec_ordered(t, r, a);
+		else if (e && e->addr_count > 0)
+			n = dns_live_ordered(e, a);
+		if (n == 0)
+			rcode = DNS_RCODE_NXDOMAIN;
+		else if (n < 0)
+			rcode = DNS_RCODE_SERVFAIL;
+		uint8_t want = q->qtype == DNS_TYPE_A ? 4 : q->qtype == DNS_TYPE_AAAA ? 6 : 0;
+		for (int i = 0; i < n; i++) {
+			if (a[i].family != want || a[i].prefix != dns_addr_bits(want))
+				continue; /* prefixes are for CIDR lookups only */
+			size_t rdlen = want == 6 ? 16 : 4;
+			if (off + 12 + rdlen + opt_len > limit) {
+				flags |= DNS_FLAG_TC;
+				break;
+			}
+			off += dns_wire_rr(out + off, q->qtype, a[i].bytes, rdlen);
+			ancount++;
+		}
+	}
+
+	if (q->edns) {
+		out[off] = 0;
+		dns_put16(out + off + 1, DNS_TYPE_OPT);
+		dns_put16(out + off + 3, DNS_UDP_MAX);
+		memset(out + off + 5, 0, 6); /* extended rcode, version, flags, rdlen */
+		off += 11;
+	}
+
+	dns_put16(out, q->id);
+	dns_put16(out + 2, (uint16_t)(flags | rcode));
+	dns_put16(out + 4, has_question ? 1 : 0);
+	dns_put16(out + 6, ancount);
+	dns_put16(out + 8, 0);
+	dns_put16(out + 10, q->edns ? 1 : 0);
+	return off;
+}
+
+#endif
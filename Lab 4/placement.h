@@ -0,0 +1,278 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "common.h"
+
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Where the dispatcher and the three role workers run. A cpu of -1 leaves
+ * that process to the scheduler; node -1 keeps the default memory policy.
+ */
+typedef struct {
+	int dispatcher_cpu;
+	int worker_cpu[3]; /* regno, name, subject */
+	int node;
+} placement_t;
+
+#define PLACEMENT_MAX_CPUS 1024
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+static inline void placement_none(placement_t *p)
+{
+	p->dispatcher_cpu = -1;
+	for (int i = 0; i < 3; i++)
+		p->worker_cpu[i] = -1;
+	p->node = -1;
+}
+
+static inline long read_sysfs_long(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1;
+	long v = -1;
+	if (fscanf(f, "%ld", &v) != 1)
+		v = -1;
+	fclose(f);
+	return v;
+}
+
+/* NUMA node a cpu belongs to, from the cpuN/nodeM link; 0 on non-NUMA kernels. */
+static inline int cpu_node(int cpu)
+{
+	char path[128];
+	snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d", cpu);
+	DIR *d = opendir(path);
+	if (!d)
+		return -1;
+	int node = 0;
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		int n;
+		if (sscanf(e->d_name, "node%d", &n) == 1) {
+			node = n;
+			break;
+		}
+	}
+	closedir(d);
+	return node;
+}
+
+/* Parses a sysfs cpu list such as "0-3,8-11" into mask; returns the count. */
+static inline int parse_cpu_list(const char *s, unsigned char *mask, int max)
+{
+	int count = 0;
+	while (*s && *s != '\n') {
+		char *end = NULL;
+		long lo = strtol(s, &end, 10);
+		if (end == s)
+			return -1;
+		long hi = lo;
+		s = end;
+		if (*s == '-') {
+			hi = strtol(s + 1, &end, 10);
+			s = end;
+		}
+		for (long c = lo; c <= hi && c < max; c++) {
+			if (c >= 0 && !mask[c]) {
+				mask[c] = 1;
+				count++;
+			}
+		}
+		if (*s == ',')
+			s++;
+		else if (*s && *s != '\n')
+			return -1;
+	}
+	return count;
+}
+
+/*
+ * Default placement: stay on the package and node we were started on, and
+ * give the dispatcher and each worker its own physical core (one hardware
+ * thread per core) so pipe handoffs stay within one socket's caches. Falls
+ * back to SMT siblings, then to sharing, when the package is too small.
+ * Only cpus that are online and in our affinity mask (taskset, a cpuset,
+ * a container's limit) are candidates; an explicit list may name others.
+ */
+static inline int placement_auto(placement_t *p)
+{
+	placement_none(p);
+
+	char buf[4096];
+	FILE *f = fopen(SYSFS_CPU "/online", "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	static unsigned char usable[PLACEMENT_MAX_CPUS];
+	memset(usable, 0, sizeof(usable));
+	if (parse_cpu_list(buf, usable, PLACEMENT_MAX_CPUS) <= 0)
+		return -1;
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return -1;
+	int nusable = 0;
+	for (int c = 0; c < PLACEMENT_MAX_CPUS; c++) {
+		usable[c] = usable[c] && c < CPU_SETSIZE && CPU_ISSET(c, &allowed);
+		nusable += usable[c];
+	}
+	if (nusable == 0)
+		return -1;
+
+	int home = sched_getcpu();
+	if (home < 0 || home >= PLACEMENT_MAX_CPUS || !usable[home]) {
+		home = 0;
+		while (home < PLACEMENT_MAX_CPUS && !usable[home])
+			home++;
+	}
+
+	char path[128];
+	snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/physical_package_id", home);
+	long home_pkg = read_sysfs_long(path);
+	int home_node = cpu_node(home);
+
+	/* Candidates on the home package/node: first cores, then siblings. */
+	int picked[4];
+	int npicked = 0;
+	static long seen_core[PLACEMENT_MAX_CPUS];
+	int nseen = 0;
+	for (int pass = 0; pass < 2 && npicked < 4; pass++) {
+		for (int c = 0; c < PLACEMENT_MAX_CPUS && npicked < 4; c++) {
+			if (!usable[c])
+				continue;
+			snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/physical_package_id",
+				c);
+			if (read_sysfs_long(path) != home_pkg || cpu_node(c) != home_node)
+				continue;
+			snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/core_id", c);
+			long core = read_sysfs_long(path);
+
+			int dup = 0;
+			for (int i = 0; i < nseen; i++)
+				dup |= seen_core[i] == core;
+			int taken = 0;
+			for (int i = 0; i < npicked; i++)
+				taken |= picked[i] == c;
+			if (taken || (pass == 0 && dup))
+				continue;
+			if (pass == 0)
+				seen_core[nseen++] = core;
+			picked[npicked++] = c;
+		}
+	}
+	if (npicked == 0)
+		return -1;
+
+	p->dispatcher_cpu = picked[0];
+	for (int i = 0; i < 3; i++)
+		p->worker_cpu[i] = picked[(1 + i) % npicked];
+	p->node = home_node;
+	return 0;
+}
+
+/*
+ * "auto" (topology default), "off" (no pinning), or four cpu ids
+ * "dispatcher,regno,name,subject". Explicit lists take the node of the
+ * dispatcher cpu for memory placement.
+ */
+static inline int placement_parse(const char *spec, placement_t *p)
+{
+	if (strcmp(spec, "auto") == 0)
+		return placement_auto(p);
+	placement_none(p);
+	if (strcmp(spec, "off") == 0)
+		return 0;
+
+	int cpus[4];
+	char *end = NULL;
+	for (int i = 0; i < 4; i++) {
+		long v = strtol(spec, &end, 10);
+		if (end == spec || v < 0 || v >= PLACEMENT_MAX_CPUS)
+			return -1;
+		cpus[i] = (int)v;
+		if (i < 3 && *end != ',')
+			return -1;
+		spec = end + 1;
+	}
+	if (*end != '\0')
+		return -1;
+
+	p->dispatcher_cpu = cpus[0];
+	for (int i = 0; i < 3; i++)
+		p->worker_cpu[i] = cpus[1 + i];
+	p->node = cpu_node(cpus[0]);
+	return 0;
+}
+
+static inline int pin_to_cpu(int cpu)
+{
+	if (cpu < 0)
+		return 0;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+}
+
+/*
+ * Prefer the given node for every later allocation of this process. Pages
+ * are placed on first touch, so call this before loading the dataset; the
+ * forked workers inherit both the policy and the already-placed pages.
+ */
+static inline int prefer_node(int node)
+{
+	if (node < 0)
+		return 0;
+	unsigned long mask[PLACEMENT_MAX_CPUS / (8 * sizeof(unsigned long))];
+	memset(mask, 0, sizeof(mask));
+	if ((size_t)node >= sizeof(mask) * 8)
+		return -1;
+	mask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+	return (int)syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8);
+}
+
+/* Pins the calling process (the dispatcher) and sets its memory policy. */
+static inline void placement_apply_dispatcher(const placement_t *p)
+{
+	if (pin_to_cpu(p->dispatcher_cpu) != 0)
+		perror("sched_setaffinity dispatcher");
+	if (prefer_node(p->node) != 0)
+		perror("set_mempolicy");
+}
+
+static inline void placement_print(const placement_t *p, FILE *out)
+{
+	if (p->dispatcher_cpu < 0 && p->node < 0) {
+		fprintf(out, "[server] Placement: off\n");
+		return;
+	}
+	fprintf(out, "[server] Placement: dispatcher=cpu%d regno=cpu%d name=cpu%d "
+		"subject=cpu%d node=%d\n", p->dispatcher_cpu, p->worker_cpu[0],
+		p->worker_cpu[1], p->worker_cpu[2], p->node);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,188 @@
+#include "workers.h"
+
+#include <sys/wait.h>
+#include <time.h>
+
+#define BENCH_KEYS 1024
+#define BENCH_BUDGET_NS 500000000ull /* per measurement */
+#define BENCH_MAX_ITERS 2000000ull
+
+typedef enum { LOOKUP_REGNO, LOOKUP_NAME, LOOKUP_MARKS } lookup_kind_t;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-c placement] [sizes] [seed]\n", argv0);
+	fprintf(stderr, "sizes is a comma separated list, default 1000,100000,10000000\n");
+	fprintf(stderr, "placement is as for server (default off)\n");
+	fprintf(stderr, "name1st_ns is the time to a name's first holder; names repeat, so "
+		"that is near\nthe front of the table rather than a full scan\n");
+}
+
+/*
+ * Keys are drawn from existing records, so every lookup hits. Regnos and
+ * subjects are unique, so their linear scans cover half the table on
+ * average. Names are not: there are only a few thousand, Zipf-weighted,
+ * and find_by_name() stops at the first student with the name, which is
+ * near the front of the table. name1st_ns measures that early exit, not a
+ * scan.
+ */
+static void pick_keys(const student_db_t *db, lookup_kind_t kind, const char **keys,
+	uint64_t *rng)
+{
+	for (size_t i = 0; i < BENCH_KEYS; i++) {
+		if (kind == LOOKUP_MARKS) {
+			keys[i] = db->marks[gen_next(rng) % db->marks_count].subject;
+		} else {
+			const student_t *s = &db->students[gen_next(rng) % db->student_count];
+			keys[i] = kind == LOOKUP_REGNO ? s->regno : s->name;
+		}
+	}
+}
+
+/* Runs lookups until the time budget is spent; returns ns per lookup. */
+static double bench_lookup(const student_db_t *db, lookup_kind_t kind, uint64_t *rng)
+{
+	const char *keys[BENCH_KEYS];
+	pick_keys(db, kind, keys, rng);
+
+	uintptr_t sink = 0;
+	uint64_t iters = 0;
+	uint64_t start = now_ns();
+	uint64_t elapsed = 0;
+	do {
+		const char *k = keys[iters % BENCH_KEYS];
+		if (kind == LOOKUP_REGNO)
+			sink += (uintptr_t)find_by_regno(db, k);
+		else if (kind == LOOKUP_NAME)
+			sink += (uintptr_t)find_by_name(db, k);
+		else
+			sink += (uintptr_t)find_marks(db, k);
+		iters++;
+		if ((iters & 15) == 0 || iters < 16)
+			elapsed = now_ns() - start;
+	} while (elapsed < BENCH_BUDGET_NS && iters < BENCH_MAX_ITERS);
+	elapsed = now_ns() - start;
+
+	if (sink == 1)
+		printf("\n"); /* keep the lookups observable */
+	return (double)elapsed / (double)iters;
+}
+
+/* Round trips through the forked role workers, as server.c does per request. */
+static double bench_dispatch(const student_db_t *db, const placement_t *pl,
+	uint64_t *rng)
+{
+	const char *keys[3][BENCH_KEYS];
+	pick_keys(db, LOOKUP_REGNO, keys[0], rng);
+	pick_keys(db, LOOKUP_NAME, keys[1], rng);
+	pick_keys(db, LOOKUP_MARKS, keys[2], rng);
+
+	worker_t workers[3];
+	spawn_worker(&workers[0], OPT_REGNO, db, pl->worker_cpu[0]);
+	spawn_worker(&workers[1], OPT_NAME, db, pl->worker_cpu[1]);
+	spawn_worker(&workers[2], OPT_SUBJECT, db, pl->worker_cpu[2]);
+
+	request_t req;
+	response_t resp;
+	uint64_t iters = 0;
+	uint64_t start = now_ns();
+	uint64_t elapsed = 0;
+	do {
+		size_t role = (size_t)(iters % 3);
+		const char *k = keys[role][(iters / 3) % BENCH_KEYS];
+		memset(&req, 0, sizeof(req));
+		req.magic = APP_MAGIC;
+		req.option = (uint32_t)(role + 1);
+		if (role == 0)
+			snprintf(req.regno, sizeof(req.regno), "%s", k);
+		else if (role == 1)
+			snprintf(req.name, sizeof(req.name), "%s", k);
+		else
+			snprintf(req.subject, sizeof(req.subject), "%s", k);
+		if (route_to_worker(workers, &req, &resp) != 0)
+			die("route_to_worker");
+		iters++;
+		elapsed = now_ns() - start;
+	} while (elapsed < BENCH_BUDGET_NS && iters < BENCH_MAX_ITERS);
+
+	stop_workers(workers);
+	for (int i = 0; i < 3; i++)
+		waitpid(workers[i].pid, NULL, 0);
+	return (double)elapsed / (double)iters;
+}
+
+int main(int argc, char **argv)
+{
+	const char *prog = argv[0];
+	const char *placement_spec = "off";
+	int opt;
+	while ((opt = getopt(argc, argv, "c:")) != -1) {
+		if (opt == 'c') {
+			placement_spec = optarg;
+		} else {
+			usage(prog);
+			return 1;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	const char *sizes = "1000,100000,10000000";
+	uint64_t seed = 1;
+	if (argc > 3) {
+		usage(prog);
+		return 1;
+	}
+
+	placement_t placement;
+	if (placement_parse(placement_spec, &placement) != 0) {
+		fprintf(stderr, "Invalid placement '%s'\n", placement_spec);
+		return 1;
+	}
+	placement_apply_dispatcher(&placement);
+	if (argc >= 2)
+		sizes = argv[1];
+	if (argc == 3)
+		seed = strtoull(argv[2], NULL, 0);
+
+	printf("%10s %10s %10s %12s %12s %12s %12s\n", "records", "gen_ms", "bytes/rec",
+		"regno_ns", "name1st_ns", "marks_ns", "dispatch_ns");
+
+	char *list = strdup(sizes);
+	if (!list)
+		die("strdup");
+	char *save = NULL;
+	for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		size_t n = (size_t)strtoull(tok, NULL, 10);
+		if (n == 0) {
+			fprintf(stderr, "Invalid size '%s'\n", tok);
+			return 1;
+		}
+
+		uint64_t t0 = now_ns();
+		student_db_t db;
+		student_db_generate(&db, n, seed);
+		double gen_ms = (double)(now_ns() - t0) / 1e6;
+
+		uint64_t rng = seed ^ 0x5EEDull;
+		double regno_ns = bench_lookup(&db, LOOKUP_REGNO, &rng);
+		double name_ns = bench_lookup(&db, LOOKUP_NAME, &rng);
+		double marks_ns = bench_lookup(&db, LOOKUP_MARKS, &rng);
+		double dispatch_ns = bench_dispatch(&db, &placement, &rng);
+
+		printf("%10zu %10.1f %10.1f %12.1f %12.1f %12.1f %12.1f\n", n, gen_ms,
+			(double)student_db_bytes(&db) / (double)n, regno_ns, name_ns, marks_ns,
+			dispatch_ns);
+		fflush(stdout);
+		student_db_free(&db);
+	}
+	free(list);
+	return 0;
+}
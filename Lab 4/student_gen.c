@@ -0,0 +1,34 @@
+#include "students.h"
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s <count> [seed] > dataset.tsv\n", argv0);
+	fprintf(stderr, "Writes <count> synthetic students plus their subjects' marks.\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2 && argc != 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	char *end = NULL;
+	unsigned long long n = strtoull(argv[1], &end, 10);
+	if (!end || *end != '\0' || n == 0) {
+		fprintf(stderr, "Invalid count\n");
+		return 1;
+	}
+	uint64_t seed = argc == 3 ? strtoull(argv[2], NULL, 0) : 1;
+
+	student_db_t db;
+	student_db_generate(&db, (size_t)n, seed);
+	student_db_write(&db, stdout);
+	if (fflush(stdout) != 0)
+		die("write");
+
+	fprintf(stderr, "[student_gen] %zu students, %zu subjects\n", db.student_count,
+		db.marks_count);
+	student_db_free(&db);
+	return 0;
+}
@@ -0,0 +1,384 @@
+#ifndef STUDENTS_H
+#define STUDENTS_H
+
+#include "common.h"
+
+#include <strings.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	const char *regno;
+	const char *name;
+	const char *address;
+	const char *dept;
+	const char *semester;
+	const char *section;
+	const char *courses;
+} student_t;
+
+typedef struct {
+	const char *subject;
+	int marks;
+} marks_t;
+
+/* Strings of generated/loaded records live in fixed-size blocks that never move. */
+#define STUDENT_ARENA_BLOCK (64u << 10)
+
+typedef struct arena_block {
+	struct arena_block *next;
+	size_t used;
+	char data[];
+} arena_block_t;
+
+typedef struct {
+	student_t *students;
+	size_t student_count;
+	marks_t *marks;
+	size_t marks_count;
+	arena_block_t *arena; /* NULL for the built-in tables */
+	size_t arena_bytes; /* bytes reserved for blocks, headers included */
+} student_db_t;
+
+static const student_t g_builtin_students[] = {
+	{
+		.regno = "23CS001",
+		.name = "Asha",
+		.address = "12, MG Road, Bengaluru",
+		.dept = "CSE",
+		.semester = "4",
+		.section = "A",
+		.courses = "CS201, CS202, MA201",
+	},
+	{
+		.regno = "23EC014",
+		.name = "Rahul",
+		.address = "44, Lake View, Chennai",
+		.dept = "ECE",
+		.semester = "3",
+		.section = "B",
+		.courses = "EC210, EC211, MA201",
+	},
+};
+
+static const marks_t g_builtin_marks[] = {
+	{.subject = "CS201", .marks = 88},
+	{.subject = "CS202", .marks = 79},
+	{.subject = "MA201", .marks = 91},
+	{.subject = "EC210", .marks = 84},
+	{.subject = "EC211", .marks = 77},
+};
+
+static inline void student_db_builtin(student_db_t *db)
+{
+	memset(db, 0, sizeof(*db));
+	db->students = (student_t *)g_builtin_students;
+	db->student_count = sizeof(g_builtin_students) / sizeof(g_builtin_students[0]);
+	db->marks = (marks_t *)g_builtin_marks;
+	db->marks_count = sizeof(g_builtin_marks) / sizeof(g_builtin_marks[0]);
+}
+
+static inline void student_db_free(student_db_t *db)
+{
+	if (db->arena) {
+		free(db->students);
+		free(db->marks);
+	}
+	arena_block_t *b = db->arena;
+	while (b) {
+		arena_block_t *next = b->next;
+		free(b);
+		b = next;
+	}
+	memset(db, 0, sizeof(*db));
+}
+
+/* Bytes held by the db: record arrays plus string arena. */
+static inline size_t student_db_bytes(const student_db_t *db)
+{
+	return db->student_count * sizeof(student_t) + db->marks_count * sizeof(marks_t) +
+		db->arena_bytes;
+}
+
+static inline const char *arena_strdup(student_db_t *db, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	arena_block_t *b = db->arena;
+	if (!b || b->used + len > STUDENT_ARENA_BLOCK) {
+		size_t cap = len > STUDENT_ARENA_BLOCK ? len : STUDENT_ARENA_BLOCK;
+		b = (arena_block_t *)malloc(sizeof(arena_block_t) + cap);
+		if (!b)
+			die("malloc arena");
+		b->next = db->arena;
+		b->used = 0;
+		db->arena = b;
+		db->arena_bytes += sizeof(arena_block_t) + cap;
+	}
+	char *p = b->data + b->used;
+	memcpy(p, s, len);
+	b->used += len;
+	return p;
+}
+
+static inline const student_t *find_by_regno(const student_db_t *db, const char *regno)
+{
+	for (size_t i = 0; i < db->student_count; i++) {
+		if (strncmp(db->students[i].regno, regno, MAX_REGNO) == 0)
+			return &db->students[i];
+	}
+	return NULL;
+}
+
+static inline const student_t *find_by_name(const student_db_t *db, const char *name)
+{
+	for (size_t i = 0; i < db->student_count; i++) {
+		if (strcasecmp(db->students[i].name, name) == 0)
+			return &db->students[i];
+	}
+	return NULL;
+}
+
+static inline const marks_t *find_marks(const student_db_t *db, const char *subject)
+{
+	for (size_t i = 0; i < db->marks_count; i++) {
+		if (strcasecmp(db->marks[i].subject, subject) == 0)
+			return &db->marks[i];
+	}
+	return NULL;
+}
+
+/* ---- synthetic data ---- */
+
+static inline uint64_t gen_next(uint64_t *state)
+{
+	/* splitmix64 */
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+static inline double gen_uniform(uint64_t *state)
+{
+	return (double)(gen_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static const char *const g_first_names[] = {
+	"Aarav", "Asha", "Rahul", "Priya", "Vivaan", "Ananya", "Aditya", "Diya", "Arjun",
+	"Sneha", "Rohan", "Kavya", "Karthik", "Meera", "Siddharth", "Pooja", "Aryan",
+	"Nisha", "Vikram", "Ishita", "Rakesh", "Lakshmi", "Manoj", "Divya", "Suresh",
+	"Anjali", "Harsha", "Neha", "Pranav", "Shruti", "Varun", "Keerthi", "Nikhil",
+	"Swathi", "Abhishek", "Bhavana", "Deepak", "Gayathri", "Ganesh", "Revathi",
+	"Kiran", "Sowmya", "Naveen", "Tejaswini", "Sanjay", "Aishwarya", "Ravi",
+	"Madhuri", "Vishal", "Nandini", "Tarun", "Pallavi", "Yash", "Harini", "Akash",
+	"Ramya", "Gaurav", "Chitra", "Mohit", "Sahana", "Ajay", "Vidya", "Sameer", "Uma",
+};
+
+static const char *const g_last_names[] = {
+	"Sharma", "Rao", "Iyer", "Reddy", "Nair", "Kumar", "Singh", "Patel", "Gupta",
+	"Menon", "Shetty", "Joshi", "Pillai", "Hegde", "Verma", "Das", "Bhat", "Kulkarni",
+	"Naidu", "Mishra", "Chatterjee", "Gowda", "Agarwal", "Krishnan", "Mehta",
+	"Banerjee", "Prasad", "Shenoy", "Desai", "Kamath", "Yadav", "Subramanian",
+};
+
+static const char *const g_streets[] = {
+	"MG Road", "Lake View", "Brigade Road", "Anna Salai", "Park Street", "Residency Road",
+	"Church Street", "Gandhi Nagar", "Station Road", "Temple Street", "Hill View",
+	"Ring Road",
+};
+
+static const char *const g_cities[] = {
+	"Bengaluru", "Chennai", "Mumbai", "Hyderabad", "Pune", "Kolkata", "Delhi", "Kochi",
+	"Mysuru", "Mangaluru", "Coimbatore", "Udupi",
+};
+
+static const struct {
+	const char *dept;
+	const char *code;
+} g_depts[] = {
+	{"CSE", "CS"}, {"ECE", "EC"}, {"EEE", "EE"}, {"ME", "ME"}, {"CIVIL", "CV"}, {"ISE", "IS"},
+};
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+/*
+ * Zipf-like pick (weight 1/rank) so a handful of common names dominate,
+ * the way real rosters look. cdf must hold n cumulative weights.
+ */
+static inline size_t gen_zipf_pick(uint64_t *state, const double *cdf, size_t n)
+{
+	double u = gen_uniform(state) * cdf[n - 1];
+	size_t lo = 0, hi = n - 1;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static inline void gen_zipf_cdf(double *cdf, size_t n)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < n; i++) {
+		sum += 1.0 / (double)(i + 1);
+		cdf[i] = sum;
+	}
+}
+
+/* Subject count grows with the roster so find_marks() scales too. */
+static inline size_t gen_subject_count(size_t students)
+{
+	size_t m = students / 20;
+	return m < ARRAY_LEN(g_depts) ? ARRAY_LEN(g_depts) : m;
+}
+
+static inline void gen_subject_code(char *out, size_t outsz, size_t i)
+{
+	size_t d = i % ARRAY_LEN(g_depts);
+	snprintf(out, outsz, "%s%u", g_depts[d].code,
+		(unsigned)(101 + i / ARRAY_LEN(g_depts)));
+}
+
+/* Deterministic for a given (n, seed). */
+static inline void student_db_generate(student_db_t *db, size_t n, uint64_t seed)
+{
+	memset(db, 0, sizeof(*db));
+	uint64_t rng = seed;
+
+	size_t nsubj = gen_subject_count(n);
+	db->marks = (marks_t *)calloc(nsubj, sizeof(marks_t));
+	db->students = (student_t *)calloc(n ? n : 1, sizeof(student_t));
+	if (!db->marks || !db->students)
+		die("calloc");
+
+	char buf[160];
+	for (size_t i = 0; i < nsubj; i++) {
+		gen_subject_code(buf, sizeof(buf), i);
+		db->marks[i].subject = arena_strdup(db, buf);
+		/* Sum of three uniforms: bell-shaped around 70. */
+		double u = gen_uniform(&rng) + gen_uniform(&rng) + gen_uniform(&rng);
+		int m = 40 + (int)(u * 20.0);
+		db->marks[i].marks = m > 100 ? 100 : m;
+	}
+	db->marks_count = nsubj;
+
+	double first_cdf[ARRAY_LEN(g_first_names)];
+	double last_cdf[ARRAY_LEN(g_last_names)];
+	gen_zipf_cdf(first_cdf, ARRAY_LEN(g_first_names));
+	gen_zipf_cdf(last_cdf, ARRAY_LEN(g_last_names));
+
+	static const char *const semesters[] = {"1", "2", "3", "4", "5", "6", "7", "8"};
+	static const char *const sections[] = {"A", "B", "C", "D"};
+
+	for (size_t i = 0; i < n; i++) {
+		student_t *s = &db->students[i];
+		size_t d = (size_t)(gen_next(&rng) % ARRAY_LEN(g_depts));
+
+		snprintf(buf, sizeof(buf), "%02u%s%07zu", 20u + (unsigned)(gen_next(&rng) % 5),
+			g_depts[d].code, i + 1);
+		s->regno = arena_strdup(db, buf);
+
+		snprintf(buf, sizeof(buf), "%s %s",
+			g_first_names[gen_zipf_pick(&rng, first_cdf, ARRAY_LEN(g_first_names))],
+			g_last_names[gen_zipf_pick(&rng, last_cdf, ARRAY_LEN(g_last_names))]);
+		s->name = arena_strdup(db, buf);
+
+		snprintf(buf, sizeof(buf), "%u, %s, %s", 1u + (unsigned)(gen_next(&rng) % 400),
+			g_streets[gen_next(&rng) % ARRAY_LEN(g_streets)],
+			g_cities[gen_next(&rng) % ARRAY_LEN(g_cities)]);
+		s->address = arena_strdup(db, buf);
+
+		s->dept = g_depts[d].dept;
+		s->semester = semesters[gen_next(&rng) % ARRAY_LEN(semesters)];
+		s->section = sections[gen_next(&rng) % ARRAY_LEN(sections)];
+
+		/* Three subjects from the student's own department. */
+		char c[3][MAX_SUBJECT];
+		size_t per_dept = (nsubj + ARRAY_LEN(g_depts) - 1 - d) / ARRAY_LEN(g_depts);
+		for (int k = 0; k < 3; k++) {
+			size_t j = d + ARRAY_LEN(g_depts) * (size_t)(gen_next(&rng) % per_dept);
+			gen_subject_code(c[k], sizeof(c[k]), j);
+		}
+		snprintf(buf, sizeof(buf), "%s, %s, %s", c[0], c[1], c[2]);
+		s->courses = arena_strdup(db, buf);
+	}
+	db->student_count = n;
+}
+
+/*
+ * Dataset file written by student_gen, one record per line, tab separated:
+ *   S <regno> <name> <address> <dept> <semester> <section> <courses>
+ *   M <subject> <marks>
+ */
+static inline void student_db_write(const student_db_t *db, FILE *f)
+{
+	for (size_t i = 0; i < db->marks_count; i++)
+		fprintf(f, "M\t%s\t%d\n", db->marks[i].subject, db->marks[i].marks);
+	for (size_t i = 0; i < db->student_count; i++) {
+		const student_t *s = &db->students[i];
+		fprintf(f, "S\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n", s->regno, s->name, s->address,
+			s->dept, s->semester, s->section, s->courses);
+	}
+}
+
+static inline int student_db_load(student_db_t *db, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	memset(db, 0, sizeof(*db));
+	size_t scap = 0, mcap = 0;
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		trim_newline(line);
+		char *field[8];
+		int nf = 0;
+		char *save = NULL;
+		for (char *tok = strtok_r(line, "\t", &save); tok && nf < 8;
+			tok = strtok_r(NULL, "\t", &save))
+			field[nf++] = tok;
+
+		if (nf == 3 && strcmp(field[0], "M") == 0) {
+			if (db->marks_count == mcap) {
+				mcap = mcap ? mcap * 2 : 64;
+				marks_t *p = (marks_t *)realloc(db->marks, mcap * sizeof(marks_t));
+				if (!p)
+					die("realloc");
+				db->marks = p;
+			}
+			db->marks[db->marks_count].subject = arena_strdup(db, field[1]);
+			db->marks[db->marks_count].marks = atoi(field[2]);
+			db->marks_count++;
+		} else if (nf == 8 && strcmp(field[0], "S") == 0) {
+			if (db->student_count == scap) {
+				scap = scap ? scap * 2 : 64;
+				student_t *p = (student_t *)realloc(db->students, scap * sizeof(student_t));
+				if (!p)
+					die("realloc");
+				db->students = p;
+			}
+			student_t *s = &db->students[db->student_count++];
+			s->regno = arena_strdup(db, field[1]);
+			s->name = arena_strdup(db, field[2]);
+			s->address = arena_strdup(db, field[3]);
+			s->dept = arena_strdup(db, field[4]);
+			s->semester = arena_strdup(db, field[5]);
+			s->section = arena_strdup(db, field[6]);
+			s->courses = arena_strdup(db, field[7]);
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "placement.h"
+#include "students.h"
+
+#include <sys/types.h>
+
+typedef struct {
+	int p2c[2]; /* parent -> child */
+	int c2p[2]; /* child -> parent */
+	pid_t pid;
+	option_t role;
+} worker_t;
+
+static inline void close_fd(int *fd)
+{
+	if (*fd >= 0)
+		close(*fd);
+	*fd = -1;
+}
+
+static inline void worker_loop(const student_db_t *db, option_t role, int read_fd,
+	int write_fd)
+{
+	for (;;) {
+		request_t req;
+		ssize_t r = read(read_fd, &req, sizeof(req));
+		if (r == 0)
+			_exit(0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			_exit(2);
+		}
+		if ((size_t)r != sizeof(req))
+			continue;
+
+		response_t resp;
+		memset(&resp, 0, sizeof(resp));
+		resp.magic = APP_MAGIC;
+		resp.status = 0;
+		resp.child_pid = (int32_t)getpid();
+
+		if (req.magic != APP_MAGIC) {
+			resp.status = 1;
+			snprintf(resp.message, sizeof(resp.message), "Invalid request magic");
+		} else if ((option_t)req.option != role) {
+			resp.status = 2;
+			snprintf(resp.message, sizeof(resp.message), "Wrong worker role");
+		} else if (role == OPT_REGNO) {
+			const student_t *s = find_by_regno(db, req.regno);
+			if (!s) {
+				resp.status = 3;
+				snprintf(resp.message, sizeof(resp.message),
+					"Registration '%s' not found", req.regno);
+			} else {
+				snprintf(resp.message, sizeof(resp.message),
+					"Name: %s\nAddress: %s\nChild PID: %d", s->name,
+					s->address, (int)getpid());
+			}
+		} else if (role == OPT_NAME) {
+			const student_t *s = find_by_name(db, req.name);
+			if (!s) {
+				resp.status = 4;
+				snprintf(resp.message, sizeof(resp.message),
+					"Name '%s' not found", req.name);
+			} else {
+				snprintf(resp.message, sizeof(resp.message),
+					"Dept: %s\nSemester: %s\nSection: %s\nCourses: %s\nChild PID: %d",
+					s->dept, s->semester, s->section, s->courses, (int)getpid());
+			}
+		} else if (role == OPT_SUBJECT) {
+			const marks_t *m = find_marks(db, req.subject);
+			if (!m) {
+				resp.status = 5;
+				snprintf(resp.message, sizeof(resp.message),
+					"Subject '%s' not found", req.subject);
+			} else {
+				snprintf(resp.message, sizeof(resp.message),
+					"Subject: %s\nMarks: %d\nChild PID: %d", m->subject,
+					m->marks, (int)getpid());
+			}
+		} else {
+			resp.status = 6;
+			snprintf(resp.message, sizeof(resp.message), "Unknown option");
+		}
+
+		(void)write(write_fd, &resp, sizeof(resp));
+	}
+}
+
+/*
+ * The child inherits db through fork(); nothing is copied until written.
+ * cpu pins the child (-1 leaves it unpinned).
+ */
+static inline void spawn_worker(worker_t *w, option_t role, const student_db_t *db, int cpu)
+{
+	memset(w, 0, sizeof(*w));
+	w->p2c[0] = w->p2c[1] = -1;
+	w->c2p[0] = w->c2p[1] = -1;
+	w->role = role;
+
+	if (pipe(w->p2c) < 0)
+		die("pipe p2c");
+	if (pipe(w->c2p) < 0)
+		die("pipe c2p");
+
+	pid_t pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		/* child */
+		if (pin_to_cpu(cpu) != 0)
+			perror("sched_setaffinity worker");
+		close_fd(&w->p2c[1]);
+		close_fd(&w->c2p[0]);
+		worker_loop(db, role, w->p2c[0], w->c2p[1]);
+		_exit(0);
+	}
+
+	w->pid = pid;
+	/* parent */
+	close_fd(&w->p2c[0]);
+	close_fd(&w->c2p[1]);
+}
+
+static inline int route_to_worker(worker_t workers[3], const request_t *req, response_t *out)
+{
+	int idx = -1;
+	if (req->option == OPT_REGNO)
+		idx = 0;
+	else if (req->option == OPT_NAME)
+		idx = 1;
+	else if (req->option == OPT_SUBJECT)
+		idx = 2;
+	else
+		return -1;
+
+	if (write(workers[idx].p2c[1], req, sizeof(*req)) != (ssize_t)sizeof(*req))
+		return -2;
+	ssize_t r = read(workers[idx].c2p[0], out, sizeof(*out));
+	if (r != (ssize_t)sizeof(*out))
+		return -3;
+	return 0;
+}
+
+/* Closes the request pipes so each worker sees EOF and exits. */
+static inline void stop_workers(worker_t workers[3])
+{
+	for (int i = 0; i < 3; i++) {
+		close_fd(&workers[i].p2c[1]);
+		close_fd(&workers[i].c2p[0]);
+	}
+}
+
+#endif